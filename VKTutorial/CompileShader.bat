@@ -1,3 +1,13 @@
-E:\yjw\Graphics\Environment\VulkanSDK\Bin\glslc.exe shader.vert -o vert.spv
-E:\yjw\Graphics\Environment\VulkanSDK\Bin\glslc.exe shader.frag -o frag.spv
+@rem The build compiles these too. VULKAN_SDK is set by the SDK installer.
+set GLSLC="%VULKAN_SDK%\Bin\glslc.exe"
+%GLSLC% shader.vert -o shaders\vert.spv
+%GLSLC% shader.frag -o shaders\frag.spv
+%GLSLC% fullscreen.vert -o shaders\fullscreen_vert.spv
+%GLSLC% upscale.frag -o shaders\upscale_frag.spv
+%GLSLC% deferred_light.vert -o shaders\deferred_light_vert.spv
+%GLSLC% deferred_light.frag -o shaders\deferred_light_frag.spv
+%GLSLC% deferred_ambient.frag -o shaders\deferred_ambient_frag.spv
+%GLSLC% cluster_lights.comp -o shaders\cluster_lights_comp.spv
+%GLSLC% shadow.vert -o shaders\shadow_vert.spv
+%GLSLC% depth_prepass.vert -o shaders\depth_prepass_vert.spv
 pause
\ No newline at end of file
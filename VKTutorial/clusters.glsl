@@ -0,0 +1,47 @@
+// Froxel grid of the clustered shading: screen tiles split into depth 
+// slices. Must match the CLUSTER_ constants and the binning in main.cpp.
+
+const uvec3 CLUSTER_GRID = uvec3(16, 9, 24);
+const uint CLUSTER_COUNT = CLUSTER_GRID.x * CLUSTER_GRID.y * CLUSTER_GRID.z;
+// Lights beyond this are dropped, the highest indices first, which bounds
+// the cost of a fragment
+const uint MAX_LIGHTS_PER_CLUSTER = 128;
+
+// Slices are spaced exponentially, so that clusters stay about as deep as
+// they are wide
+uint depthSlice(float depth, float zNear, float zFar) {
+    float slice = log(depth / zNear) / log(zFar / zNear) * float(CLUSTER_GRID.z);
+    return uint(clamp(slice, 0.0, float(CLUSTER_GRID.z - 1)));
+}
+
+float sliceDepth(uint slice, float zNear, float zFar) {
+    return zNear * pow(zFar / zNear, float(slice) / float(CLUSTER_GRID.z));
+}
+
+uvec2 screenTile(vec2 ndc) {
+    vec2 tile = (ndc * 0.5 + 0.5) * vec2(CLUSTER_GRID.xy);
+    return uvec2(clamp(tile, vec2(0.0), vec2(CLUSTER_GRID.xy - 1)));
+}
+
+uint clusterIndex(uvec3 cluster) {
+    return (cluster.z * CLUSTER_GRID.y + cluster.y) * CLUSTER_GRID.x + cluster.x;
+}
+
+// Whether a sphere given in view space touches the view space bounding 
+// box of a cluster
+bool sphereIntersectsCluster(vec3 center, float radius, uvec3 cluster, mat4 proj, float zNear, float zFar) {
+    vec2 ndcLow = vec2(cluster.xy) / vec2(CLUSTER_GRID.xy) * 2.0 - 1.0;
+    vec2 ndcHigh = vec2(cluster.xy + 1) / vec2(CLUSTER_GRID.xy) * 2.0 - 1.0;
+    float nearDepth = sliceDepth(cluster.z, zNear, zFar);
+    float farDepth = sliceDepth(cluster.z + 1, zNear, zFar);
+    // view xy = ndc * depth / scale. The y flip is undone by min/max.
+    vec2 scale = vec2(proj[0][0], proj[1][1]);
+    vec2 a = ndcLow / scale * nearDepth;
+    vec2 b = ndcHigh / scale * nearDepth;
+    vec2 c = ndcLow / scale * farDepth;
+    vec2 d = ndcHigh / scale * farDepth;
+    vec3 boxLow = vec3(min(min(a, b), min(c, d)), -farDepth);
+    vec3 boxHigh = vec3(max(max(a, b), max(c, d)), -nearDepth);
+    vec3 offset = clamp(center, boxLow, boxHigh) - center;
+    return dot(offset, offset) <= radius * radius;
+}
@@ -0,0 +1,52 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "lighting.glsl"
+#include "shadows.glsl"
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+    mat4 invViewProj;
+    uint lightCount;
+    float lightIntensity;
+    float zNear;
+    float zFar;
+    mat4 shadowViewProj[SHADOW_CASCADE_COUNT];
+    vec4 shadowRects[SHADOW_CASCADE_COUNT];
+    vec4 cascadeSplits;
+    vec4 sun;
+} ubo;
+
+layout(input_attachment_index = 0, binding = 1) uniform subpassInput gAlbedo;
+layout(input_attachment_index = 1, binding = 2) uniform subpassInput gNormal;
+layout(input_attachment_index = 2, binding = 3) uniform subpassInput gDepth;
+
+layout(binding = 5) uniform sampler2DShadow shadowAtlas;
+
+// Must match DeferredPushConstants in main.cpp
+layout(push_constant) uniform DeferredPushConstants {
+    vec2 invExtent;
+    float zNear;
+} deferred;
+
+layout(location = 0) out vec4 outColor;
+
+// Fullscreen pass before the lights, so every covered pixel is written.
+// Adds the ambient term and the shadowed sun.
+void main() {
+    float depth = subpassLoad(gDepth).r;
+    if (depth <= 0.0) {
+        discard; // background, cleared to 0 with reverse-Z
+    }
+    vec2 ndc = gl_FragCoord.xy * deferred.invExtent * 2.0 - 1.0;
+    vec4 position = ubo.invViewProj * vec4(ndc, depth, 1.0);
+    position /= position.w;
+    float viewDepth = -(ubo.view * position).z;
+    vec3 normal = normalize(subpassLoad(gNormal).xyz * 2.0 - 1.0);
+    float shadow = sunShadow(shadowAtlas, ubo.shadowViewProj, ubo.shadowRects, ubo.cascadeSplits, position.xyz, viewDepth);
+    float light = AMBIENT + ubo.sun.w * max(dot(normal, -ubo.sun.xyz), 0.0) * shadow;
+    vec4 albedo = subpassLoad(gAlbedo);
+    outColor = vec4(albedo.rgb * light, albedo.a);
+}
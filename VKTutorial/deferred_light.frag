@@ -0,0 +1,46 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "lighting.glsl"
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+    mat4 invViewProj;
+    uint lightCount;
+    float lightIntensity;
+} ubo;
+
+// Written by the G-buffer subpass at this very pixel, so the reads can 
+// stay in tile memory
+layout(input_attachment_index = 0, binding = 1) uniform subpassInput gAlbedo;
+layout(input_attachment_index = 1, binding = 2) uniform subpassInput gNormal;
+layout(input_attachment_index = 2, binding = 3) uniform subpassInput gDepth;
+
+layout(std430, binding = 4) readonly buffer Lights {
+    Light lights[];
+};
+
+// Must match DeferredPushConstants in main.cpp
+layout(push_constant) uniform DeferredPushConstants {
+    vec2 invExtent;
+    float zNear;
+} deferred;
+
+layout(location = 0) flat in uint lightIndex;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+    float depth = subpassLoad(gDepth).r;
+    if (depth <= 0.0) {
+        discard; // background, cleared to 0 with reverse-Z
+    }
+    vec2 ndc = gl_FragCoord.xy * deferred.invExtent * 2.0 - 1.0;
+    vec4 position = ubo.invViewProj * vec4(ndc, depth, 1.0);
+    vec3 normal = normalize(subpassLoad(gNormal).xyz * 2.0 - 1.0);
+    vec3 albedo = subpassLoad(gAlbedo).rgb;
+    // Added to the ambient term by blending
+    outColor = vec4(albedo * evaluateLight(lights[lightIndex], position.xyz / position.w, normal, ubo.lightIntensity), 0.0);
+}
@@ -0,0 +1,35 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "lighting.glsl"
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+    mat4 invViewProj;
+    uint lightCount;
+    float lightIntensity;
+} ubo;
+
+layout(std430, binding = 4) readonly buffer Lights {
+    Light lights[];
+};
+
+// Must match DeferredPushConstants in main.cpp
+layout(push_constant) uniform DeferredPushConstants {
+    vec2 invExtent;
+    float zNear;
+} deferred;
+
+layout(location = 0) flat out uint lightIndex;
+
+// One screen rectangle per light instance, drawn as a triangle strip
+void main() {
+    Light light = lights[gl_InstanceIndex];
+    vec3 center = (ubo.view * vec4(light.positionRadius.xyz, 1.0)).xyz;
+    vec4 rect = screenRect(center, light.positionRadius.w, ubo.proj, deferred.zNear);
+    vec2 corner = vec2(gl_VertexIndex & 1, (gl_VertexIndex >> 1) & 1);
+    gl_Position = vec4(mix(rect.xy, rect.zw, corner), 0.0, 1.0);
+    lightIndex = gl_InstanceIndex;
+}
@@ -0,0 +1,25 @@
+#version 450
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+} ubo;
+
+// Must match PushConstants in main.cpp
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+    uint materialIndex;
+} pushConstants;
+
+layout(location = 0) in vec3 inPosition;
+
+// The color pass tests against this depth with EQUAL, so the position has
+// to come out bit for bit the same as in shader.vert
+invariant gl_Position;
+
+// Depth only, there is no fragment shader
+void main() {
+    vec4 position = pushConstants.model * vec4(inPosition, 1.0);
+    gl_Position = ubo.viewProj * position;
+}
@@ -0,0 +1,60 @@
+// Point and spot lights, shared by the forward, clustered and deferred 
+// shading. Light must match Light in main.cpp.
+
+struct Light {
+    vec4 positionRadius; // xyz: world position, w: radius of influence
+    vec4 color;          // rgb: color, a: animation phase
+    vec4 spot;           // xyz: direction, w: cosine of the cone half angle, -2 for point lights
+};
+
+const float AMBIENT = 0.1;
+// Fraction of the cone, from its axis, that is fully lit
+const float SPOT_INNER = 0.8;
+// How far the lights circle around their rest position
+const float LIGHT_ORBIT = 0.1;
+
+vec3 evaluateLight(Light light, vec3 position, vec3 normal, float intensity) {
+    vec3 toLight = light.positionRadius.xyz - position;
+    float distance = length(toLight);
+    vec3 direction = toLight / max(distance, 1e-4);
+    float falloff = max(1.0 - distance / light.positionRadius.w, 0.0);
+    float lambert = max(dot(normal, direction), 0.0);
+    // Always 1 for point lights
+    float cone = smoothstep(light.spot.w, mix(light.spot.w, 1.0, 1.0 - SPOT_INNER), dot(-direction, light.spot.xyz));
+    return light.color.rgb * (intensity * falloff * falloff * lambert * cone);
+}
+
+// Light at the given time, from its rest state. Must match animateLight 
+// in main.cpp.
+Light animateLight(Light light, float time) {
+    float phase = light.color.a;
+    float angle = time * (0.5 + fract(phase * 7.31)) + phase;
+    light.positionRadius.xy += LIGHT_ORBIT * vec2(cos(angle), sin(angle));
+    return light;
+}
+
+// Conservative NDC rectangle (min xy, max xy) of a sphere given in view 
+// space. Empty when it is behind the camera, the whole screen when the 
+// camera is inside or close. Must match lightScreenRect in main.cpp.
+vec4 screenRect(vec3 center, float radius, mat4 proj, float zNear) {
+    float nearDepth = -center.z - radius;
+    float farDepth = -center.z + radius;
+    if (farDepth <= zNear) {
+        return vec4(0.0); // behind the camera
+    }
+    if (nearDepth <= zNear) {
+        return vec4(-1.0, -1.0, 1.0, 1.0); // the camera is inside or close
+    }
+    // x / depth is extremal at a corner of the sphere's bounding box
+    vec2 low = center.xy - radius;
+    vec2 high = center.xy + radius;
+    vec2 a = low / nearDepth;
+    vec2 b = low / farDepth;
+    vec2 c = high / nearDepth;
+    vec2 d = high / farDepth;
+    // Symmetric frustum. The y flip of the projection is undone by min/max.
+    vec2 scale = vec2(proj[0][0], proj[1][1]);
+    vec2 p0 = min(min(a, b), min(c, d)) * scale;
+    vec2 p1 = max(max(a, b), max(c, d)) * scale;
+    return clamp(vec4(min(p0, p1), max(p0, p1)), -1.0, 1.0);
+}
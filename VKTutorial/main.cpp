@@ -14,21 +14,189 @@
 #include <set>
 #include <cstdint>
 #include <limits> // Necessary for std::numeric_limits
+#include <cfloat>
 #include <algorithm> // Necessary for std::clamp
 #include <fstream>
+#include <list>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
+// Lets glm pick up SSE/AVX from the compiler flags, and makes simd/matrix.h available
+#define GLM_FORCE_INTRINSICS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/simd/matrix.h>
+// Widest SIMD the culling kernels can use. MSVC defines __AVX2__ with 
+// /arch:AVX2 and always has SSE2 on x64.
+#if defined(__AVX2__)
+#define CULLING_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CULLING_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CULLING_NEON
+#include <arm_neon.h>
+#endif
+// Cycle counter for the CPU profiler, steady_clock where there is none
+#if defined(_M_X64) || defined(_M_IX86)
+#define PROFILER_RDTSC
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define PROFILER_RDTSC
+#include <x86intrin.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <memory>
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// Per-frame resources are created for this many frames. How many of them
+// are actually in flight is chosen at runtime (keys 1-4).
+const int MAX_FRAMES_IN_FLIGHT = 4;
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// Virtual texturing: the texture and its mips are cut into fixed-size pages,
+// and only the pages the fragment shader actually samples are kept in a
+// physical page cache. When disabled, the texture is sampled directly.
+const bool enableVirtualTexturing = true;
+// Side of a page in texels
+const uint32_t VT_PAGE_SIZE = 128;
+// The physical page cache is a square atlas of VT_CACHE_PAGES_PER_SIDE^2 pages
+const uint32_t VT_CACHE_PAGES_PER_SIDE = 4;
+// Upper bound on page uploads recorded into one frame
+const uint32_t VT_MAX_UPLOADS_PER_FRAME = 4;
+// Must match VT_MAX_LEVELS in shader.frag
+const uint32_t VT_MAX_LEVELS = 16;
+const uint32_t VT_NOT_RESIDENT = 0xFFFFFFFF;
+
+// How frames are paced and presented (cycled at runtime with key P)
+enum class PresentPolicy {
+    // FIFO: one frame per vblank, the GPU idles when done early
+    VSync,
+    // IMMEDIATE or MAILBOX: render as fast as possible
+    Uncapped,
+    // MAILBOX or IMMEDIATE, with a CPU frame limiter at TARGET_FPS
+    FixedFps,
+    // FIFO, sleeping before input is sampled so the frame starts as late
+    // as possible and still makes the next vblank
+    LatencyOptimized
+};
+const PresentPolicy DEFAULT_PRESENT_POLICY = PresentPolicy::VSync;
+const double TARGET_FPS = 60.0;
+// Time a latency-optimized frame keeps in reserve before the vblank
+const double LATENCY_MARGIN_MS = 1.0;
+
+// Dynamic resolution (cycled at runtime with key U): the scene is rendered
+// at a fraction of the swap chain size and upscaled, the fraction following
+// the measured GPU frame time
+enum class UpscaleMode {
+    Off,
+    Bilinear,
+    // Bilinear, then sharpened where the local contrast is low
+    EdgeAware
+};
+// Bounds of the render scale, per axis
+const float MIN_RENDER_SCALE = 0.5f;
+const float MAX_RENDER_SCALE = 1.0f;
+
+// How the scene is lit (cycled at runtime with key G). Deferred writes a
+// G-buffer in a first subpass and lights it in a second one that reads the
+// G-buffer through input attachments, so on tilers it never leaves tile 
+// memory, and each light only shades the pixels it can reach.
+enum class ShadingPath {
+    // Every light is evaluated for every fragment
+    Forward,
+    // A compute pass bins the lights into a froxel grid, and fragments 
+    // only evaluate the lights of their cluster
+    Clustered,
+    Deferred
+};
+// Consecutive draws of a frame that are measured together by pipeline 
+// statistics and occlusion queries
+enum class DrawGroup {
+    StaticShadows,
+    DynamicShadows,
+    DepthPrepass,
+    // The scene geometry: lit colors, or the G-buffer when deferred
+    Scene,
+    DeferredLighting,
+    Upscale
+};
+const uint32_t DRAW_GROUP_COUNT = 6;
+const std::array<const char*, DRAW_GROUP_COUNT> DRAW_GROUP_NAMES = { 
+    "static_shadows", "dynamic_shadows", "depth_prepass", "scene", "deferred_lighting", "upscale" };
+// What a device memory allocation is used for, as accounted by MemoryTracker
+enum class MemoryCategory {
+    Vertex,
+    Index,
+    Uniform,
+    // Storage buffers: lights, clusters, virtual texture page tables
+    Storage,
+    Texture,
+    // Render targets, including the shadow atlas
+    Attachment,
+    // Host visible upload buffers
+    Staging
+};
+const uint32_t MEMORY_CATEGORY_COUNT = 7;
+const std::array<const char*, MEMORY_CATEGORY_COUNT> MEMORY_CATEGORY_NAMES = { 
+    "vertex", "index", "uniform", "storage", "texture", "attachment", "staging" };
+// A heap whose usage passes this fraction of its budget is reported
+const double MEMORY_BUDGET_WARNING = 0.9;
+// Number of point and spot lights, cycled at runtime with key K
+constexpr std::array<uint32_t, 4> LIGHT_COUNTS = { 0, 1000, 10000, 100000 };
+const uint32_t DEFAULT_LIGHT_COUNT_INDEX = 1;
+// Froxel grid of the clustered path: screen tiles, split into depth slices
+// spaced exponentially between the near and far planes. Must match 
+// clusters.glsl.
+const uint32_t CLUSTER_GRID_X = 16;
+const uint32_t CLUSTER_GRID_Y = 9;
+const uint32_t CLUSTER_GRID_Z = 24;
+const uint32_t CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+// Lights binned into a cluster beyond this are dropped, which bounds the
+// cost of a fragment however many lights there are
+const uint32_t MAX_LIGHTS_PER_CLUSTER = 128;
+// Must match local_size_x in cluster_lights.comp
+const uint32_t LIGHT_CULLING_GROUP_SIZE = 64;
+// G-buffer layout. Normals are stored as n * 0.5 + 0.5, positions are 
+// reconstructed from depth.
+const VkFormat GBUFFER_ALBEDO_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+const VkFormat GBUFFER_NORMAL_FORMAT = VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+
+// Sun shadows: cascades over the view frustum, packed into one depth atlas.
+// Static casters are rendered into a cached copy of the atlas only when a 
+// cascade moves. Each frame the cache is copied over and the dynamic 
+// casters are drawn on top. Must match shadows.glsl.
+const uint32_t SHADOW_ATLAS_SIZE = 2048;
+const uint32_t SHADOW_CASCADE_COUNT = 3;
+const uint32_t SHADOW_CASCADE_RESOLUTION = 1024;
+// How far from the camera the cascades reach
+const float SHADOW_DISTANCE = 6.0f;
+// Blend between uniform (0) and logarithmic (1) cascade splits
+const float SHADOW_SPLIT_LAMBDA = 0.75f;
+// Cascades move in steps of this many texels, so that the cache survives
+// small camera movements. Costs as many texels of resolution.
+const uint32_t SHADOW_SNAP_TEXELS = 16;
+// How far towards the sun from a cascade casters are still rendered
+const float SHADOW_CASTER_DEPTH = 4.0f;
+// Direction the sunlight travels
+const glm::vec3 SUN_DIRECTION = glm::normalize(glm::vec3(-0.4f, -0.3f, -1.0f));
+const float SUN_INTENSITY = 0.6f;
 
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
@@ -37,7 +205,18 @@ const std::vector<const char*> validationLayers = {
 const std::vector<const char*> deviceExtensions = {
     // Presenting images is NOT a vulkan core function.
     // We have to check and enable it at the device level.
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    // vkCmdPipelineBarrier2, used by the render graph. Core in 1.3,
+    // but we target 1.2.
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME
+};
+
+// Enabled when the device supports them
+const std::vector<const char*> optionalDeviceExtensions = {
+    // Reports when images were actually presented
+    VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME,
+    // Per-heap budget and usage of the whole process
+    VK_EXT_MEMORY_BUDGET_EXTENSION_NAME
 };
 
 // Dynamic states (those that can be changed without requiring recompile)
@@ -91,6 +270,27 @@ struct Vertex {
 
         return attributeDescriptions;
     }
+
+    // The depth-only passes read the positions from a separate, tightly 
+    // packed stream, so they fetch none of the other attributes
+    static VkVertexInputBindingDescription getPositionBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(glm::vec3);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+        return bindingDescription;
+    }
+
+    static VkVertexInputAttributeDescription getPositionAttributeDescription() {
+        VkVertexInputAttributeDescription attributeDescription{};
+        attributeDescription.binding = 0;
+        attributeDescription.location = 0;
+        attributeDescription.format = VK_FORMAT_R32G32B32_SFLOAT;
+        attributeDescription.offset = 0;
+
+        return attributeDescription;
+    }
 };
 
 const std::vector<Vertex> vertices = {
@@ -102,329 +302,4060 @@ const std::vector<Vertex> vertices = {
     {{-0.5f, -0.5f, -0.5f}, {1.0f, 0.0f, 0.0f}, {0.0f, 0.0f}},
     {{0.5f, -0.5f, -0.5f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
     {{0.5f, 0.5f, -0.5f}, {0.0f, 0.0f, 1.0f}, {1.0f, 1.0f}},
-    {{-0.5f, 0.5f, -0.5f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}}
+    {{-0.5f, 0.5f, -0.5f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}},
+
+    // Static floor below the quads, which receives their shadows
+    {{-1.5f, -1.5f, -0.75f}, {1.0f, 1.0f, 1.0f}, {0.0f, 0.0f}},
+    {{1.5f, -1.5f, -0.75f}, {1.0f, 1.0f, 1.0f}, {1.0f, 0.0f}},
+    {{1.5f, 1.5f, -0.75f}, {1.0f, 1.0f, 1.0f}, {1.0f, 1.0f}},
+    {{-1.5f, 1.5f, -0.75f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f}}
 };
 
 const std::vector<uint16_t> indices = {
     0, 1, 2, 2, 3, 0,
-    4, 5, 6, 6, 7, 4
+    4, 5, 6, 6, 7, 4,
+    8, 9, 10, 10, 11, 8
 };
 
+// Per-frame data. Per-object data goes through PushConstants instead.
 struct UniformBufferObject {
-    alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 proj;
+    alignas(16) glm::mat4 viewProj;
+    // Reconstructs world positions from depth in the deferred light pass
+    alignas(16) glm::mat4 invViewProj;
+    alignas(16) uint32_t lightCount;
+    float lightIntensity;
+    // Depth range of the cluster grid
+    float zNear;
+    float zFar;
+    // World to light clip space of each cascade, and the part of the 
+    // atlas it covers (uv offset, uv scale)
+    alignas(16) std::array<glm::mat4, SHADOW_CASCADE_COUNT> shadowViewProj;
+    alignas(16) std::array<glm::vec4, SHADOW_CASCADE_COUNT> shadowRects;
+    // View depth at which each cascade ends
+    alignas(16) glm::vec4 cascadeSplits;
+    // xyz: direction the sunlight travels, w: intensity
+    alignas(16) glm::vec4 sun;
 };
+static_assert(SHADOW_CASCADE_COUNT <= 4, "cascade splits are packed into a vec4");
 
-class Application {
-public:
-    void run() {
-        initWindow();
-        initVulkan();
-        mainLoop();
-        cleanup();
-    }
+// Per-draw data, pushed into the command buffer right before each draw.
+// Layout must match the push_constant block in shader.vert.
+struct PushConstants {
+    glm::mat4 model;
+    uint32_t materialIndex;
+};
 
-private:
-    GLFWwindow* window;
-    // Instance: connect application and Vulkan library
-    VkInstance instance;
-    // The graphics card that we select to use
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
-    // logical device
-    VkDevice device;
-    // A queue family only stores a part of commands.
-    // The struct stores indices to different queue families that the 
-    // physical device supports, and that we need.
-    struct QueueFamilyIndices;
-    // handle to the graphics queue
-    // the queue itself is automatically created and destroyed with the 
-    // logical device, but we need a handle to it.
-    VkQueue graphicsQueue;
-    // Abstract type of surface to present rendered images to.
-    VkSurfaceKHR surface;
-    // Handle to the presentation queue
-    VkQueue presentQueue;
-    struct SwapChainSupportDetails;
-    VkSwapchainKHR swapChain;
-    std::vector<VkImage> swapChainImages;
-    VkFormat swapChainImageFormat;
-    VkExtent2D swapChainExtent;
-    std::vector<VkImageView> swapChainImageViews;
-    VkRenderPass renderPass;
-    VkDescriptorSetLayout descriptorSetLayout;
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
-    std::vector<VkFramebuffer> swapChainFramebuffers;
-    // Command pools manage the memory that is used to store 
-    // the buffers and command buffers are allocated from them
-    VkCommandPool commandPool;
-    std::vector<VkCommandBuffer> commandBuffers;
+// One indexed draw of the scene. Pipelines and meshes are referenced by 
+// index so that they fit in a render queue sort key.
+struct DrawItem {
+    glm::mat4 model;
+    uint32_t materialIndex;
+    uint32_t pipelineIndex;
+    uint32_t meshIndex;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    // Never moves, so its shadows are cached
+    bool isStatic = false;
+};
 
+// Vertex and index buffers bound together for a draw
+struct Mesh {
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    // The same vertices' positions only, for the depth-only passes
+    VkBuffer positionBuffer;
     VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
-    std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
-    std::vector<void*> uniformBuffersMapped;
-
-    std::vector<VkSemaphore> imageAvailableSemaphores;
-    std::vector<VkSemaphore> renderFinishedSemaphores;
-    std::vector<VkFence> inFlightFences;
-
-    VkDescriptorPool descriptorPool;
-    std::vector<VkDescriptorSet> descriptorSets;
-
-    VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
-    VkImageView textureImageView;
-    VkSampler textureSampler;
+    VkIndexType indexType;
+};
 
-    VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
-    VkImageView depthImageView;
+// Layout must match the push_constant block of the deferred light shaders
+struct DeferredPushConstants {
+    // Of the scene viewport, to turn fragment coordinates into NDC
+    glm::vec2 invExtent;
+    float zNear;
+};
 
-    bool framebufferResized = false;
+// Layout must match the push_constant block in cluster_lights.comp
+struct LightCullingPushConstants {
+    uint32_t lightCount;
+    // Seconds, animates the lights
+    float time;
+    // 0 to only animate the lights, for the paths that do not read clusters,
+    // 1 to also bin them, 2 to refill the clusters the binning overflowed
+    uint32_t bin;
+};
 
-    uint32_t currentFrame = 0;
+// Layout must match the push_constant block in shadow.vert
+struct ShadowPushConstants {
+    glm::mat4 model;
+    glm::mat4 viewProj;
+};
 
-    static void framebufferResizeCallback(GLFWwindow* window, int width, int height);
+// Layout must match the push_constant block in upscale.frag
+struct UpscalePushConstants {
+    // Part of the scene color target that was rendered, in uv
+    glm::vec2 uvScale;
+    glm::vec2 texelSize;
+    // 0 for plain bilinear
+    float sharpness;
+};
 
-    void initWindow();
-    void initVulkan();
-    void mainLoop();
-    void cleanup();
-    // REQUIRES: Null.
-    // Check and set up layers and (non-GPU-related) extension support.
-    // Layers are manually specified (e.g., validation layers), and compared 
-    // with vkEnumerateInstanceLayerProperties, which returns 
-    // global layer properties.
-    // Extension are manually specified (e.g., those required by glfw), and 
-    // compared with vkEnumerateInstanceExtensionProperties, which 
-    // typically returns extentions proviede by Vulkan implementation and 
-    // implicitly enabled layers.
-    void createInstance();
-    // Check if all required validations layers are available
-    bool checkValidationLayerSupport();
-    // Enumerate over physical devices and find a suitable one
-    // Checked by isDeviceSuitable()
-    // REQUIRES: Specific instance. We only select among GPUs that 
-    // are accessible to the previously created instance.
-    void pickPhysicsDevice();
-    // Check whether device supports required queue families,  
-    // required (device-related) extensions, and adequate swap chains.
-    bool isDeviceSuitable(VkPhysicalDevice device);
-    // Find the indices that correspond to the queue families specified in the 
-    // QueueFamilyIndices struct. It iterates over all queue families 
-    // supported by the device, and check whether they cover our requirements.
-    // For example, it should be able to not only do graphics operation, but also 
-    // present images.
-    // If all covered, isComplete on the returned struct would evaluate to true.
-    QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
-    // Create logical device and get queue handles.
-    // For each queue family, creates a queue. 
-    // Enabling (device-related) extensions.
-    void createLogicalDevice();
-    // Create surface: the (abstract) target to render images to.
-    void createSurface();
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device);
-    // We have checked the swap chain availability when choosing a physical 
-    // device. However, it may not be COMPATIBLE with our surface. 
-    // So we additionally query the physical device for its
-    //  the swap chain support details.
-    SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
-    // Choosing among supported swap chain settings. The choice is hard-coded.
-    VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats);
-    VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes);
-    VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities);
-    void createSwapChain();
-    // Create image views for each image in the swap chain
-    void createImageViews();
-    // 1. Load and create shader modules, put them in shader stages
-    // 2. Specify vertex input state
-    // 3. Describe input assembly state: What kind of geometry to draw, 
-    //    and whether to enable primitive restart: reutilization of 
-    //    vertex data by restart primitive assembly.
-    // 4. Specify viewport and scissors dimensions. Note that these are often 
-    //    set as dynamic states, and we only need to specify the count
-    //    in this scenario.
-    // 5. Set up rasterizer, who breaks vertices into fragments, plus 
-    //    depth testing, face cullinggit , and scissor test. We set depth clamp, 
-    //    polygonMode (fill polygons or just lines or points), line width, 
-    //    and cullMode. Special settings typically require enabling specific 
-    //    GPU features.
-    // 6. Set up multisampling state, which performs anti-aliasing. 
-    // 7. Set up depth and stencil testing.
-    // 8. Set up color blending.
-    // 9. Set up pipeline layout who specifies uniform values in shaders and 
-    //    push constants.
-    void createGraphicsPipeline();
-    static std::vector<char> readFile(const std::string& filename);
-    VkShaderModule createShaderModule(const std::vector<char>& code);
-    // Render pass describes the resources a render pipeline will use
-    // It contains one or more subpasses, and the attachments that will be used 
-    // in these subpasses.
-    void createRenderPass();
-    void createFramebuffers();
-    void createCommandPool();
-    void createCommandBuffer();
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
-    /*
-    Steps to render a frame:
-        Wait for the previous frame to finish
-        Acquire an image from the swap chain
-        Record a command buffer which draws the scene onto that image
-        Submit the recorded command buffer
-        Present the swap chain image
-    */
-    void drawFrame();
-    void createSyncObjects();
-    void recreateSwapChain();
-    void cleanupSwapChain();
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
-    void createVertexBuffer();
-    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags = VK_IMAGE_ASPECT_COLOR_BIT);
-    VkCommandBuffer beginSingleTimeCommands();
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer);
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
-    void createIndexBuffer();
-    void createDescriptorSetLayout();
-    void createUniformBuffers();
-    void updateUniformBuffer(uint32_t currentImage);
-    void createDescriptorPool();
-    void createDescriptorSets();
-    void createImage(uint32_t width, uint32_t height, 
-        VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, 
-        VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory);
-    void createTextureImage();
-    void createTextureImageView();
-    void createTextureSampler();
-    void createDepthResources();
-    VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
-    VkFormat findDepthFormat();
-    bool hasStencilComponent(VkFormat format);
+// Layout must match Light in lighting.glsl
+struct Light {
+    // xyz: world position, w: radius of influence
+    glm::vec4 positionRadius;
+    // rgb: color, a: animation phase
+    glm::vec4 color;
+    // xyz: direction, w: cosine of the cone half angle, -2 for point lights
+    glm::vec4 spot;
 };
 
-int main() {
-    Application app;
+// How far the lights circle around their rest position. Must match 
+// lighting.glsl.
+const float LIGHT_ORBIT = 0.1f;
+
+// Lights scattered over the scene, with the same result for the same seed.
+// Every fourth one is a spot light pointing down.
+std::vector<Light> generateLights(uint32_t count, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> horizontal(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> height(-0.45f, 0.35f);
+    std::uniform_real_distribution<float> radius(0.05f, 0.25f);
+    std::uniform_real_distribution<float> channel(0.2f, 1.0f);
+    std::uniform_real_distribution<float> phase(0.0f, glm::two_pi<float>());
+    std::uniform_real_distribution<float> tilt(-0.5f, 0.5f);
+    std::uniform_real_distribution<float> halfAngle(glm::radians(20.0f), glm::radians(45.0f));
+    std::vector<Light> lights(count);
+    for (uint32_t i = 0; i < count; i++) {
+        Light& light = lights[i];
+        light.positionRadius = glm::vec4(horizontal(random), horizontal(random), height(random), radius(random));
+        light.color = glm::vec4(channel(random), channel(random), channel(random), phase(random));
+        light.spot = glm::vec4(0.0f, 0.0f, -1.0f, -2.0f);
+        if (i % 4 == 3) {
+            light.spot = glm::vec4(glm::normalize(glm::vec3(tilt(random), tilt(random), -1.0f)), std::cos(halfAngle(random)));
+        }
+    }
+    return lights;
+}
 
-    try {
-        app.run();
+// Light at the given time, from its rest state. Must match animateLight in
+// lighting.glsl.
+Light animateLight(Light light, float time) {
+    float phase = light.color.a;
+    float angle = time * (0.5f + glm::fract(phase * 7.31f)) + phase;
+    light.positionRadius.x += LIGHT_ORBIT * std::cos(angle);
+    light.positionRadius.y += LIGHT_ORBIT * std::sin(angle);
+    return light;
+}
+
+// Conservative NDC rectangle (min xy, max xy) covering the sphere of 
+// influence of a light, as drawn by the deferred light pass. Empty when
+// the sphere is behind the camera, the whole screen when the camera is in
+// or close to it. Must match screenRect in lighting.glsl.
+glm::vec4 lightScreenRect(const Light& light, const glm::mat4& view, const glm::mat4& proj, float zNear) {
+    glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(light.positionRadius), 1.0f));
+    float radius = light.positionRadius.w;
+    float nearDepth = -center.z - radius;
+    float farDepth = -center.z + radius;
+    if (farDepth <= zNear) {
+        return glm::vec4(0.0f);
     }
-    catch (const std::exception& e) {
-        std::cerr << e.what() << std::endl;
-        return EXIT_FAILURE;
+    if (nearDepth <= zNear) {
+        return glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f);
     }
+    // x / depth is extremal at a corner of the sphere's bounding box
+    glm::vec2 low = glm::vec2(center) - radius;
+    glm::vec2 high = glm::vec2(center) + radius;
+    glm::vec2 a = low / nearDepth;
+    glm::vec2 b = low / farDepth;
+    glm::vec2 c = high / nearDepth;
+    glm::vec2 d = high / farDepth;
+    glm::vec2 scale(proj[0][0], proj[1][1]);
+    glm::vec2 p0 = glm::min(glm::min(a, b), glm::min(c, d)) * scale;
+    glm::vec2 p1 = glm::max(glm::max(a, b), glm::max(c, d)) * scale;
+    return glm::clamp(glm::vec4(glm::min(p0, p1), glm::max(p0, p1)), -1.0f, 1.0f);
+}
 
-    return EXIT_SUCCESS;
+// Light lists of the froxel grid, as cluster_lights.comp writes them
+struct LightClusters {
+    // May exceed MAX_LIGHTS_PER_CLUSTER, only that many lights are stored,
+    // the lowest indices
+    std::vector<uint32_t> counts;
+    // MAX_LIGHTS_PER_CLUSTER entries per cluster
+    std::vector<uint32_t> lights;
+};
+
+// Helpers of the clustered path. Must match clusters.glsl.
+uint32_t clusterDepthSlice(float depth, float zNear, float zFar) {
+    float slice = std::log(depth / zNear) / std::log(zFar / zNear) * CLUSTER_GRID_Z;
+    return static_cast<uint32_t>(glm::clamp(slice, 0.0f, static_cast<float>(CLUSTER_GRID_Z - 1)));
 }
 
+float clusterSliceDepth(uint32_t slice, float zNear, float zFar) {
+    return zNear * std::pow(zFar / zNear, static_cast<float>(slice) / CLUSTER_GRID_Z);
+}
 
+glm::uvec2 clusterScreenTile(const glm::vec2& ndc) {
+    glm::vec2 grid(CLUSTER_GRID_X, CLUSTER_GRID_Y);
+    return glm::uvec2(glm::clamp((ndc * 0.5f + 0.5f) * grid, glm::vec2(0.0f), grid - 1.0f));
+}
 
-struct Application::QueueFamilyIndices {
-    // optional: evaluate to false until assigned any value
-    std::optional<uint32_t> graphicsFamily;
-    std::optional<uint32_t> presentFamily;
+uint32_t clusterIndex(const glm::uvec3& cluster) {
+    return (cluster.z * CLUSTER_GRID_Y + cluster.y) * CLUSTER_GRID_X + cluster.x;
+}
 
-    bool isComplete() {
-        return graphicsFamily.has_value() && presentFamily.has_value();
+// Whether a sphere given in view space touches the view space bounding box
+// of a cluster
+bool sphereIntersectsCluster(const glm::vec3& center, float radius, const glm::uvec3& cluster, const glm::mat4& proj, float zNear, float zFar) {
+    glm::vec2 grid(CLUSTER_GRID_X, CLUSTER_GRID_Y);
+    glm::vec2 ndcLow = glm::vec2(cluster.x, cluster.y) / grid * 2.0f - 1.0f;
+    glm::vec2 ndcHigh = glm::vec2(cluster.x + 1, cluster.y + 1) / grid * 2.0f - 1.0f;
+    float nearDepth = clusterSliceDepth(cluster.z, zNear, zFar);
+    float farDepth = clusterSliceDepth(cluster.z + 1, zNear, zFar);
+    glm::vec2 scale(proj[0][0], proj[1][1]);
+    glm::vec2 a = ndcLow / scale * nearDepth;
+    glm::vec2 b = ndcHigh / scale * nearDepth;
+    glm::vec2 c = ndcLow / scale * farDepth;
+    glm::vec2 d = ndcHigh / scale * farDepth;
+    glm::vec3 boxLow(glm::min(glm::min(a, b), glm::min(c, d)), -farDepth);
+    glm::vec3 boxHigh(glm::max(glm::max(a, b), glm::max(c, d)), -nearDepth);
+    glm::vec3 offset = glm::clamp(center, boxLow, boxHigh) - center;
+    return glm::dot(offset, offset) <= radius * radius;
+}
+
+// Appends each light to every cluster its sphere of influence touches, 
+// like one invocation of cluster_lights.comp per light in order
+void binLights(const std::vector<Light>& lights, const glm::mat4& view, const glm::mat4& proj, float zNear, float zFar, LightClusters& clusters) {
+    clusters.counts.assign(CLUSTER_COUNT, 0);
+    clusters.lights.resize(static_cast<size_t>(CLUSTER_COUNT) * MAX_LIGHTS_PER_CLUSTER);
+    for (uint32_t i = 0; i < lights.size(); i++) {
+        const Light& light = lights[i];
+        glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(light.positionRadius), 1.0f));
+        float radius = light.positionRadius.w;
+        glm::vec4 rect = lightScreenRect(light, view, proj, zNear);
+        float nearDepth = std::max(-center.z - radius, zNear);
+        float farDepth = std::min(-center.z + radius, zFar);
+        if (rect.x >= rect.z || rect.y >= rect.w || nearDepth >= farDepth) {
+            continue;
+        }
+        glm::uvec2 tileLow = clusterScreenTile(glm::vec2(rect.x, rect.y));
+        glm::uvec2 tileHigh = clusterScreenTile(glm::vec2(rect.z, rect.w));
+        uint32_t sliceLow = clusterDepthSlice(nearDepth, zNear, zFar);
+        uint32_t sliceHigh = clusterDepthSlice(farDepth, zNear, zFar);
+        for (uint32_t z = sliceLow; z <= sliceHigh; z++) {
+            for (uint32_t y = tileLow.y; y <= tileHigh.y; y++) {
+                for (uint32_t x = tileLow.x; x <= tileHigh.x; x++) {
+                    glm::uvec3 cluster(x, y, z);
+                    if (!sphereIntersectsCluster(center, radius, cluster, proj, zNear, zFar)) {
+                        continue;
+                    }
+                    uint32_t cell = clusterIndex(cluster);
+                    uint32_t slot = clusters.counts[cell]++;
+                    if (slot < MAX_LIGHTS_PER_CLUSTER) {
+                        clusters.lights[cell * MAX_LIGHTS_PER_CLUSTER + slot] = i;
+                    }
+                }
+            }
+        }
     }
+}
+
+// State changes of one recorded frame
+struct RenderStats {
+    uint32_t draws = 0;
+    uint32_t pipelineBinds = 0;
+    uint32_t descriptorSetBinds = 0;
+    uint32_t vertexBufferBinds = 0;
+    uint32_t indexBufferBinds = 0;
+    uint32_t barriers = 0;
+    // Subresources already in the state a use required
+    uint32_t skippedBarriers = 0;
+    // Cascades whose static casters were rendered again, and draws of 
+    // the shadow passes
+    uint32_t staticShadowRenders = 0;
+    uint32_t shadowDraws = 0;
+    // Draws of the depth pre-pass
+    uint32_t prepassDraws = 0;
 };
 
-struct Application:: SwapChainSupportDetails {
-    // Min/max number of images in the swap chain, and w/h limits of images.
-    VkSurfaceCapabilitiesKHR capabilities;
-    // The surface format
-    std::vector<VkSurfaceFormatKHR> formats;
-    // Available presentation modes
-    std::vector<VkPresentModeKHR> presentModes;
+// Query results of one draw group. The first three are pipeline 
+// statistics, in the order of their flag bits.
+struct DrawGroupStats {
+    uint64_t vertexInvocations = 0;
+    uint64_t clippingPrimitives = 0;
+    uint64_t fragmentInvocations = 0;
+    // Samples that passed the depth test
+    uint64_t samplesPassed = 0;
 };
 
-void Application::framebufferResizeCallback(GLFWwindow* window, int width, int height) {
-    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
-    app->framebufferResized = true;
-}
+// One mip level of the virtual texture, kept on the CPU as the source
+// that pages are uploaded from.
+struct VirtualTextureLevel {
+    uint32_t width;
+    uint32_t height;
+    uint32_t pagesX;
+    uint32_t pagesY;
+    // Index of the first page of this level in the page table.
+    // Pages are stored level by level, row by row.
+    uint32_t firstPage;
+    std::vector<stbi_uc> pixels; // RGBA8
+};
 
-void Application::initWindow() {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+// Header of the page table storage buffer, followed by one uint per page.
+// Layout must match PageTable in shader.frag (std430).
+struct VirtualTextureHeader {
+    // x: level count, y: width, z: height of level 0 in texels
+    alignas(16) glm::uvec4 info;
+    // x: page size in texels, y: pages per side of the cache
+    alignas(16) glm::uvec4 cache;
+    // x: first page, y: pages wide, z: pages high
+    alignas(16) glm::uvec4 levels[VT_MAX_LEVELS];
+};
 
-    window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
-    glfwSetWindowUserPointer(window, this);
-    glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
-    if (!window) {
-        std::cout << "Creating glfw window error!\n";
+// Least-recently-used bookkeeping for the slots of the physical page cache.
+// Pages are identified by their page table index, slots by their position
+// in the cache atlas.
+class VirtualTextureCache {
+public:
+    void init(uint32_t pageCount, uint32_t slotCount) {
+        pageTable.assign(pageCount, VT_NOT_RESIDENT);
+        slotPage.assign(slotCount, VT_NOT_RESIDENT);
+        lru.clear();
+        lruPosition.assign(pageCount, lru.end());
+        lastUse.assign(pageCount, 0);
+        pinned.assign(pageCount, false);
+        tick = 0;
     }
-}
 
-void Application::initVulkan() {
-    createInstance();
-    createSurface();
-    pickPhysicsDevice();
+    // Start a new round of requests. Pages touched in the current round are
+    // never evicted by it.
+    void beginFrame() {
+        tick++;
+    }
+
+    bool isResident(uint32_t page) const {
+        return pageTable[page] != VT_NOT_RESIDENT;
+    }
+
+    void touch(uint32_t page) {
+        lastUse[page] = tick;
+        if (pinned[page]) {
+            return;
+        }
+        // Most recently used at the front
+        lru.splice(lru.begin(), lru, lruPosition[page]);
+    }
+
+    // Find a slot for the page, evicting the least recently used page if the
+    // cache is full. Returns VT_NOT_RESIDENT if every slot is pinned or
+    // still needed by the current round.
+    uint32_t allocate(uint32_t page, bool pin = false) {
+        uint32_t slot = VT_NOT_RESIDENT;
+        for (uint32_t i = 0; i < slotPage.size(); i++) {
+            if (slotPage[i] == VT_NOT_RESIDENT) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot == VT_NOT_RESIDENT) {
+            if (lru.empty() || lastUse[lru.back()] == tick) {
+                return VT_NOT_RESIDENT;
+            }
+            uint32_t evicted = lru.back();
+            lru.pop_back();
+            lruPosition[evicted] = lru.end();
+            slot = pageTable[evicted];
+            pageTable[evicted] = VT_NOT_RESIDENT;
+        }
+
+        pageTable[page] = slot;
+        slotPage[slot] = page;
+        lastUse[page] = tick;
+        pinned[page] = pin;
+        if (!pin) {
+            lru.push_front(page);
+            lruPosition[page] = lru.begin();
+        }
+        return slot;
+    }
+
+    // page -> slot, VT_NOT_RESIDENT if the page is not in the cache
+    std::vector<uint32_t> pageTable;
+
+private:
+    // slot -> page
+    std::vector<uint32_t> slotPage;
+    std::list<uint32_t> lru;
+    std::vector<std::list<uint32_t>::iterator> lruPosition;
+    std::vector<uint64_t> lastUse;
+    std::vector<bool> pinned;
+    uint64_t tick = 0;
+};
+
+// Destruction of objects that frames in flight may still reference.
+// Each entry is tagged with the number of frames submitted when it was 
+// retired, and runs once that many frames are known to have completed.
+class DeletionQueue {
+public:
+    void push(uint64_t retiredFrame, std::function<void()>&& destroy) {
+        pending.emplace_back(retiredFrame, std::move(destroy));
+    }
+
+    // Tags never decrease, so everything ready is at the front
+    void flush(uint64_t completedFrames) {
+        while (!pending.empty() && pending.front().first <= completedFrames) {
+            pending.front().second();
+            pending.pop_front();
+        }
+    }
+
+    size_t size() const {
+        return pending.size();
+    }
+
+private:
+    std::deque<std::pair<uint64_t, std::function<void()>>> pending;
+};
+
+// Lock-free single-producer single-consumer ring buffer. One thread may 
+// push and one other thread may pop concurrently. Capacity must be a 
+// power of two.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+public:
+    // Producer only. Returns false if the queue is full.
+    bool push(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        // The consumer's index is only reloaded when the queue looks full,
+        // which keeps its cache line out of the common case
+        if (h - cachedTail == Capacity) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h - cachedTail == Capacity) {
+                return false;
+            }
+        }
+        items[h & (Capacity - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool pop(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (cachedHead == t) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (cachedHead == t) {
+                return false;
+            }
+        }
+        item = items[t & (Capacity - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> items;
+    // On separate cache lines so the two threads don't contend
+    alignas(64) std::atomic<size_t> head{ 0 }; // written by the producer
+    size_t cachedTail = 0;                     // producer's last view of tail
+    alignas(64) std::atomic<size_t> tail{ 0 }; // written by the consumer
+    size_t cachedHead = 0;                     // consumer's last view of head
+};
+
+// CPU zone profiler. PROFILE_ZONE("name") times the rest of the enclosing 
+// scope. Each thread pushes its finished zones into its own lock-free ring, 
+// which a background thread drains, so a zone costs two timestamp reads and 
+// one push. Define ENABLE_CPU_PROFILER as 0 to compile all of it out.
+#ifndef ENABLE_CPU_PROFILER
+#define ENABLE_CPU_PROFILER 1
+#endif
+
+#if ENABLE_CPU_PROFILER
+// A finished zone, as pushed by the thread that ran it
+struct ProfileEvent {
+    const char* name; // string literal, only the pointer is stored
+    uint64_t begin;
+    uint64_t end;
+    // Trace thread id, fixed when the event is pushed, since the ring may
+    // pass to another thread before it is drained
+    uint32_t thread;
+};
+
+class Profiler {
+public:
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    // Raw timestamp. Converted to time only when a trace is written.
+    static uint64_t now() {
+#ifdef PROFILER_RDTSC
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    static void record(const char* name, uint64_t begin, uint64_t end) {
+        ThreadRing* ring = threadRing;
+        if (ring == nullptr) {
+            ring = instance().registerThread();
+        }
+        if (!ring->events.push({ name, begin, end, ring->id })) {
+            // Nothing is captured, or the drain thread fell behind. Losing 
+            // zones beats blocking.
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Shown instead of the thread id in the trace
+    void setThreadName(const std::string& name) {
+        ThreadRing* ring = threadRing != nullptr ? threadRing : registerThread();
+        std::lock_guard<std::mutex> lock(mutex);
+        ring->name = name;
+    }
+
+    bool capturing() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capture;
+    }
+
+    // Zones that begin from now on are kept until endCapture
+    void beginCapture() {
+        std::unique_lock<std::mutex> lock(mutex);
+        // The rings fill up while nothing is captured. Emptied first, so 
+        // that the first zones of the capture find room.
+        waitForDrain(lock);
+        captured.clear();
+        captureBegin = now();
+        droppedAtBegin = droppedEvents();
+        capture = true;
+        lock.unlock();
+        wake.notify_one();
+    }
+
+    // Returns once every zone that ended before the call has been drained, 
+    // which makes room in the calling thread's ring
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        waitForDrain(lock);
+    }
+
+    // Stops capturing and writes the kept zones as Chrome trace JSON, which
+    // chrome://tracing and Perfetto open. Returns the number of zones.
+    size_t endCapture(const std::string& filename) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waitForDrain(lock);
+        capture = false;
+        std::vector<ProfileEvent> events = std::move(captured);
+        captured.clear();
+        std::vector<std::pair<uint32_t, std::string>> names;
+        for (const auto& ring : rings) {
+            if (!ring->name.empty()) {
+                names.emplace_back(ring->id, ring->name);
+            }
+        }
+        uint64_t dropped = droppedEvents() - droppedAtBegin;
+        uint64_t begin = captureBegin;
+        lock.unlock();
+
+        // Timestamps are only calibrated against steady_clock here, over 
+        // the whole lifetime of the profiler
+        double ticksPerUs = static_cast<double>(now() - calibrationTicks) /
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - calibrationTime).count();
+
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open trace output!");
+        }
+        file << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedZones\":" << dropped << "},\"traceEvents\":[\n";
+        for (const auto& [id, name] : names) {
+            file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << id 
+                << ",\"args\":{\"name\":\"" << name << "\"}},\n";
+        }
+        file << std::fixed;
+        file.precision(3);
+        for (size_t i = 0; i < events.size(); i++) {
+            const ProfileEvent& event = events[i];
+            file << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+                << ",\"ts\":" << (event.begin - begin) / ticksPerUs << ",\"dur\":" << (event.end - event.begin) / ticksPerUs << '}'
+                << (i + 1 < events.size() ? "," : "") << '\n';
+        }
+        file << "]}\n";
+        return events.size();
+    }
+
+private:
+    // Rings are never freed, since the drain thread may still be reading 
+    // one after its thread exited. A new thread reuses an old one instead,
+    // under a new id, as the zones of the old thread may not be drained yet.
+    struct ThreadRing {
+        SpscQueue<ProfileEvent, 4096> events;
+        std::atomic<uint64_t> dropped{ 0 };
+        // Only written by registerThread, before the thread records
+        uint32_t id;
+        std::string name;
+        bool inUse = true;
+    };
+
+    // Gives the ring back when its thread exits
+    struct ThreadRingRelease {
+        ThreadRing* ring = nullptr;
+        ~ThreadRingRelease() {
+            if (ring != nullptr) {
+                Profiler& profiler = instance();
+                std::lock_guard<std::mutex> lock(profiler.mutex);
+                ring->inUse = false;
+                ring->name.clear();
+                threadRing = nullptr;
+            }
+        }
+    };
+
+    Profiler() : calibrationTicks(now()), calibrationTime(std::chrono::steady_clock::now()) {
+        drainThread = std::thread([this] { drainLoop(); });
+    }
+
+    ~Profiler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        drainThread.join();
+    }
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Over all threads, since the start of the program. Called with the 
+    // mutex held.
+    uint64_t droppedEvents() const {
+        uint64_t dropped = 0;
+        for (const auto& ring : rings) {
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    // Zones that ended before this call may still sit in the rings. Two 
+    // passes guarantee that one of them started after this point.
+    void waitForDrain(std::unique_lock<std::mutex>& lock) {
+        uint64_t target = drainPasses + 2;
+        drainRequested = std::max(drainRequested, target);
+        wake.notify_one();
+        drained.wait(lock, [&] { return drainPasses >= target; });
+    }
+
+    ThreadRing* registerThread() {
+        ThreadRing* ring = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& unused : rings) {
+                if (!unused->inUse) {
+                    ring = unused.get();
+                    ring->inUse = true;
+                    break;
+                }
+            }
+            if (ring == nullptr) {
+                rings.push_back(std::make_unique<ThreadRing>());
+                ring = rings.back().get();
+            }
+            ring->id = ++lastThreadId;
+        }
+        // Only touched here, so that record reads a plain pointer
+        static thread_local ThreadRingRelease release;
+        release.ring = ring;
+        threadRing = ring;
+        return ring;
+    }
+
+    void drainLoop() {
+        std::vector<ThreadRing*> active;
+        std::vector<ProfileEvent> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            active.clear();
+            for (const auto& ring : rings) {
+                active.push_back(ring.get());
+            }
+            lock.unlock();
+            ProfileEvent event;
+            for (ThreadRing* ring : active) {
+                while (ring->events.pop(event)) {
+                    batch.push_back(event);
+                }
+            }
+            lock.lock();
+            if (capture) {
+                for (const auto& zone : batch) {
+                    if (zone.begin >= captureBegin) {
+                        captured.push_back(zone);
+                    }
+                }
+            }
+            batch.clear();
+            drainPasses++;
+            drained.notify_all();
+            // Sleeps until a capture begins, as zones are discarded anyway
+            auto requested = [this] { return stopping || drainPasses < drainRequested; };
+            if (capture) {
+                wake.wait_for(lock, std::chrono::milliseconds(1), requested);
+            } else {
+                wake.wait(lock, [&] { return capture || requested(); });
+            }
+        }
+    }
+
+    inline static thread_local ThreadRing* threadRing = nullptr;
+
+    const uint64_t calibrationTicks;
+    const std::chrono::steady_clock::time_point calibrationTime;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::thread drainThread;
+    bool stopping = false;
+    uint64_t drainPasses = 0;
+    uint64_t drainRequested = 0;
+    std::vector<std::unique_ptr<ThreadRing>> rings;
+    uint32_t lastThreadId = 0;
+    bool capture = false;
+    uint64_t captureBegin = 0;
+    uint64_t droppedAtBegin = 0;
+    std::vector<ProfileEvent> captured;
+};
+
+class ProfileZone {
+public:
+    explicit ProfileZone(const char* name) : name(name), begin(Profiler::now()) {}
+    ~ProfileZone() { Profiler::record(name, begin, Profiler::now()); }
+
+    ProfileZone(const ProfileZone&) = delete;
+    ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+    const char* name;
+    uint64_t begin;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+// name must be a string literal
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_THREAD(name) Profiler::instance().setThreadName(name)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_THREAD(name)
+#endif
+
+// Persistent worker threads for data-parallel jobs. parallelFor splits 
+// [0, count) into chunks of grain items, which the workers and the calling 
+// thread take in turn, and returns once all of them are done. Only one 
+// thread may issue jobs at a time.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threadCount = std::max(std::thread::hardware_concurrency(), 1u) - 1) {
+        for (unsigned i = 0; i < threadCount; i++) {
+            threads.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Including the calling thread
+    size_t threadCount() const { return threads.size() + 1; }
+
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+        grain = std::max<size_t>(grain, 1);
+        if (threads.empty() || count <= grain) {
+            if (count > 0) {
+                fn(0, count);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobCount = count;
+            jobGrain = grain;
+            nextChunk = 0;
+            generation++;
+        }
+        wake.notify_all();
+        runChunks();
+
+        // Workers that joined may still be finishing their last chunk
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return activeWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    void runChunks() {
+        for (;;) {
+            size_t begin = nextChunk.fetch_add(1) * jobGrain;
+            if (begin >= jobCount) {
+                return;
+            }
+            PROFILE_ZONE("parallelFor");
+            (*job)(begin, std::min(begin + jobGrain, jobCount));
+        }
+    }
+
+    void workerLoop() {
+        PROFILE_THREAD("worker");
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            // A worker waking up after the job finished must not join it
+            wake.wait(lock, [&] { return stopping || (job != nullptr && generation != seen); });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            activeWorkers++;
+            lock.unlock();
+            runChunks();
+            lock.lock();
+            if (--activeWorkers == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+    uint64_t generation = 0;
+    size_t activeWorkers = 0;
+    const std::function<void(size_t, size_t)>* job = nullptr;
+    size_t jobCount = 0;
+    size_t jobGrain = 1;
+    std::atomic<size_t> nextChunk{ 0 };
+};
+
+// Window input forwarded from the main thread to the render thread
+struct InputEvent {
+    enum class Type {
+        Key,
+        MouseButton,
+        CursorPosition,
+        Scroll
+    };
+    Type type;
+    int code; // GLFW key or mouse button
+    int action;
+    int mods;
+    double x; // cursor position or scroll offset
+    double y;
+};
+
+const size_t INPUT_QUEUE_CAPACITY = 1024;
+
+// Reverse-Z perspective projection without a far plane, y flipped for 
+// Vulkan. Depth is zNear / view depth: 1 at the near plane, going to 0 at
+// infinity. Float depth has most of its precision near 0, which cancels 
+// out the 1 / depth falloff, so precision is nearly uniform with distance.
+glm::mat4 infiniteReversePerspective(float fovy, float aspect, float zNear) {
+    float f = 1.0f / std::tan(fovy * 0.5f);
+    glm::mat4 proj(0.0f);
+    proj[0][0] = f / aspect;
+    proj[1][1] = -f;
+    proj[2][3] = -1.0f;
+    proj[3][2] = zNear;
+    return proj;
+}
+
+// Perspective camera with cached matrices. Setters only mark what they 
+// affect as dirty; view, proj, viewProj and the frustum planes are 
+// recomputed on the next access. World space is Z-up.
+class Camera {
+public:
+    void setPosition(const glm::vec3& newPosition) {
+        position = newPosition;
+        viewDirty = true;
+    }
+
+    // Yaw around +Z from +X, pitch up from the XY plane, in radians
+    void setRotation(float newYaw, float newPitch) {
+        yaw = newYaw;
+        pitch = glm::clamp(newPitch, -glm::radians(89.0f), glm::radians(89.0f));
+        viewDirty = true;
+    }
+
+    void setPerspective(float newFovy, float newZNear, float newZFar) {
+        fovy = newFovy;
+        zNear = newZNear;
+        zFar = newZFar;
+        projDirty = true;
+    }
+
+    void setAspect(float newAspect) {
+        if (newAspect != aspect) {
+            aspect = newAspect;
+            projDirty = true;
+        }
+    }
+
+    const glm::vec3& getPosition() const { return position; }
+    float getYaw() const { return yaw; }
+    float getPitch() const { return pitch; }
+    float getNear() const { return zNear; }
+    // The projection has no far plane. zFar only bounds culling, the light
+    // clusters and the shadow cascades.
+    float getFar() const { return zFar; }
+    float getFovy() const { return fovy; }
+    float getAspect() const { return aspect; }
+
+    glm::vec3 getForward() const {
+        return glm::vec3(cos(pitch) * cos(yaw), cos(pitch) * sin(yaw), sin(pitch));
+    }
+
+    glm::vec3 getRight() const {
+        return glm::normalize(glm::cross(getForward(), glm::vec3(0.0f, 0.0f, 1.0f)));
+    }
+
+    const glm::mat4& getView() { update(); return view; }
+    const glm::mat4& getProj() { update(); return proj; }
+    const glm::mat4& getViewProj() { update(); return viewProj; }
+    // Left, right, bottom, top, near, far. xyz is the inward normal, w the 
+    // distance, so a point p is inside a plane when dot(plane.xyz, p) + plane.w >= 0.
+    const std::array<glm::vec4, 6>& getFrustumPlanes() { update(); return frustumPlanes; }
+    // Incremented every time the matrices are recomputed
+    uint64_t getVersion() { update(); return version; }
+
+private:
+    void update() {
+        if (!viewDirty && !projDirty) {
+            return;
+        }
+        if (viewDirty) {
+            view = glm::lookAt(position, position + getForward(), glm::vec3(0.0f, 0.0f, 1.0f));
+        }
+        if (projDirty) {
+            proj = infiniteReversePerspective(fovy, aspect, zNear);
+        }
+        viewProj = proj * view;
+
+        // Gribb-Hartmann: planes are sums of the rows of viewProj. 
+        // Clip space depth is [0, w], reversed: the near plane is z = w. 
+        // z = 0 is at infinity, so the far plane is placed at zFar from 
+        // the view matrix instead.
+        glm::mat4 m = glm::transpose(viewProj);
+        frustumPlanes[0] = m[3] + m[0];
+        frustumPlanes[1] = m[3] - m[0];
+        frustumPlanes[2] = m[3] + m[1];
+        frustumPlanes[3] = m[3] - m[1];
+        frustumPlanes[4] = m[3] - m[2];
+        frustumPlanes[5] = glm::transpose(view) * glm::vec4(0.0f, 0.0f, 1.0f, zFar);
+        for (auto& plane : frustumPlanes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+
+        viewDirty = projDirty = false;
+        version++;
+    }
+
+    // Looking at the origin from (2, 2, 2)
+    glm::vec3 position = glm::vec3(2.0f, 2.0f, 2.0f);
+    float yaw = glm::radians(-135.0f);
+    float pitch = -0.6154797f;
+    float fovy = glm::radians(45.0f);
+    float aspect = 1.0f;
+    float zNear = 0.1f;
+    float zFar = 10.0f;
+
+    bool viewDirty = true;
+    bool projDirty = true;
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::mat4 viewProj;
+    std::array<glm::vec4, 6> frustumPlanes;
+    uint64_t version = 0;
+};
+
+// Fly-through camera control: WASD to move, Q/E to go down/up, drag with 
+// the right mouse button to look around, scroll to change the speed.
+class CameraController {
+public:
+    void onKey(int key, int action) {
+        if (action == GLFW_REPEAT) {
+            return;
+        }
+        bool pressed = action == GLFW_PRESS;
+        switch (key) {
+        case GLFW_KEY_W: moveForward = pressed; break;
+        case GLFW_KEY_S: moveBack = pressed; break;
+        case GLFW_KEY_A: moveLeft = pressed; break;
+        case GLFW_KEY_D: moveRight = pressed; break;
+        case GLFW_KEY_E: moveUp = pressed; break;
+        case GLFW_KEY_Q: moveDown = pressed; break;
+        }
+    }
+
+    void onMouseButton(int button, int action) {
+        if (button == GLFW_MOUSE_BUTTON_RIGHT) {
+            looking = action == GLFW_PRESS;
+            hasCursor = false;
+        }
+    }
+
+    void onCursor(double x, double y) {
+        if (looking && hasCursor) {
+            lookYaw -= static_cast<float>(x - cursorX) * sensitivity;
+            lookPitch -= static_cast<float>(y - cursorY) * sensitivity;
+        }
+        cursorX = x;
+        cursorY = y;
+        hasCursor = true;
+    }
+
+    void onScroll(double offset) {
+        speed = glm::clamp(speed * static_cast<float>(pow(1.2, offset)), 0.1f, 100.0f);
+    }
+
+    // Apply the input gathered since the last call. The camera is left 
+    // untouched, and its cache valid, when nothing moved.
+    void update(Camera& camera, float deltaTime) {
+        if (lookYaw != 0.0f || lookPitch != 0.0f) {
+            camera.setRotation(camera.getYaw() + lookYaw, camera.getPitch() + lookPitch);
+            lookYaw = lookPitch = 0.0f;
+        }
+
+        glm::vec3 direction(0.0f);
+        if (moveForward) direction += camera.getForward();
+        if (moveBack) direction -= camera.getForward();
+        if (moveRight) direction += camera.getRight();
+        if (moveLeft) direction -= camera.getRight();
+        if (moveUp) direction.z += 1.0f;
+        if (moveDown) direction.z -= 1.0f;
+        if (glm::dot(direction, direction) > 0.0f) {
+            camera.setPosition(camera.getPosition() + glm::normalize(direction) * speed * deltaTime);
+        }
+    }
+
+private:
+    bool moveForward = false;
+    bool moveBack = false;
+    bool moveLeft = false;
+    bool moveRight = false;
+    bool moveUp = false;
+    bool moveDown = false;
+    bool looking = false;
+    bool hasCursor = false;
+    double cursorX = 0.0;
+    double cursorY = 0.0;
+    float lookYaw = 0.0f;
+    float lookPitch = 0.0f;
+    // Radians per pixel
+    float sensitivity = 0.005f;
+    // World units per second
+    float speed = 2.0f;
+};
+
+// Scene graph transforms stored as structure-of-arrays in depth-first 
+// order: a parent always precedes its children and every subtree is a 
+// contiguous range of slots. Nodes are addressed by stable ids, since 
+// slots change whenever the hierarchy is re-sorted.
+class TransformHierarchy {
+public:
+    static constexpr uint32_t NO_PARENT = 0xFFFFFFFF;
+    // Subtrees up to this many nodes are updated as one job
+    static constexpr uint32_t JOB_SIZE = 4096;
+
+    uint32_t create(uint32_t parent = NO_PARENT) {
+        if (parent != NO_PARENT && parent >= idToSlot.size()) {
+            throw std::runtime_error("invalid transform parent!");
+        }
+        uint32_t id = static_cast<uint32_t>(idToSlot.size());
+        uint32_t slot = static_cast<uint32_t>(parents.size());
+        idToSlot.push_back(slot);
+        slotToId.push_back(id);
+        parents.push_back(parent == NO_PARENT ? NO_PARENT : idToSlot[parent]);
+        positions.push_back(glm::vec3(0.0f));
+        rotations.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+        scales.push_back(glm::vec3(1.0f));
+        worldMatrices.push_back(glm::mat4(1.0f));
+        dirty.push_back(1);
+        changed.push_back(0);
+        orderDirty = true;
+        return id;
+    }
+
+    void setPosition(uint32_t id, const glm::vec3& position) {
+        uint32_t slot = idToSlot[id];
+        positions[slot] = position;
+        dirty[slot] = 1;
+    }
+
+    void setRotation(uint32_t id, const glm::quat& rotation) {
+        uint32_t slot = idToSlot[id];
+        rotations[slot] = rotation;
+        dirty[slot] = 1;
+    }
+
+    void setScale(uint32_t id, const glm::vec3& scale) {
+        uint32_t slot = idToSlot[id];
+        scales[slot] = scale;
+        dirty[slot] = 1;
+    }
+
+    // Valid after update()
+    const glm::mat4& getWorld(uint32_t id) const { return worldMatrices[idToSlot[id]]; }
+
+    size_t size() const { return parents.size(); }
+
+    // Recompute the world matrices of dirty nodes and their descendants. 
+    // Nodes above the job subtrees are done first on the calling thread, 
+    // then the subtrees in parallel, as they only depend on their own 
+    // nodes and on those above.
+    void update(WorkerPool* pool = nullptr) {
+        if (orderDirty) {
+            sortDepthFirst();
+        }
+        for (uint32_t slot : topSlots) {
+            updateSlot(slot);
+        }
+        auto updateRanges = [this](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                for (uint32_t slot = jobRanges[i].first; slot < jobRanges[i].second; slot++) {
+                    updateSlot(slot);
+                }
+            }
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(jobRanges.size(), 1, updateRanges);
+        } else {
+            updateRanges(0, jobRanges.size());
+        }
+    }
+
+private:
+    void updateSlot(uint32_t slot) {
+        uint32_t parent = parents[slot];
+        bool parentChanged = parent != NO_PARENT && changed[parent];
+        if (!dirty[slot] && !parentChanged) {
+            changed[slot] = 0;
+            return;
+        }
+
+        glm::mat4 local = glm::mat4_cast(rotations[slot]);
+        local[0] *= scales[slot].x;
+        local[1] *= scales[slot].y;
+        local[2] *= scales[slot].z;
+        local[3] = glm::vec4(positions[slot], 1.0f);
+        if (parent == NO_PARENT) {
+            worldMatrices[slot] = local;
+        } else {
+            multiply(worldMatrices[parent], local, worldMatrices[slot]);
+        }
+        dirty[slot] = 0;
+        changed[slot] = 1;
+    }
+
+    static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& result) {
+#if GLM_ARCH & GLM_ARCH_SSE2_BIT
+        glm_vec4 in1[4], in2[4], out[4];
+        for (int i = 0; i < 4; i++) {
+            in1[i] = _mm_loadu_ps(&a[i][0]);
+            in2[i] = _mm_loadu_ps(&b[i][0]);
+        }
+        glm_mat4_mul(in1, in2, out);
+        for (int i = 0; i < 4; i++) {
+            _mm_storeu_ps(&result[i][0], out[i]);
+        }
+#else
+        result = a * b;
+#endif
+    }
+
+    template <typename T>
+    static void permute(std::vector<T>& values, const std::vector<uint32_t>& order) {
+        std::vector<T> sorted(values.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sorted[i] = values[order[i]];
+        }
+        values.swap(sorted);
+    }
+
+    void sortDepthFirst() {
+        uint32_t count = static_cast<uint32_t>(parents.size());
+        std::vector<uint32_t> firstChild(count, NO_PARENT);
+        std::vector<uint32_t> nextSibling(count, NO_PARENT);
+        for (uint32_t slot = count; slot-- > 0;) {
+            if (parents[slot] != NO_PARENT) {
+                nextSibling[slot] = firstChild[parents[slot]];
+                firstChild[parents[slot]] = slot;
+            }
+        }
+
+        // order[new slot] = old slot
+        std::vector<uint32_t> order;
+        order.reserve(count);
+        std::vector<uint32_t> stack;
+        for (uint32_t root = 0; root < count; root++) {
+            if (parents[root] != NO_PARENT) {
+                continue;
+            }
+            stack.push_back(root);
+            while (!stack.empty()) {
+                uint32_t slot = stack.back();
+                stack.pop_back();
+                order.push_back(slot);
+                for (uint32_t child = firstChild[slot]; child != NO_PARENT; child = nextSibling[child]) {
+                    stack.push_back(child);
+                }
+            }
+        }
+
+        std::vector<uint32_t> newSlot(count);
+        for (uint32_t i = 0; i < count; i++) {
+            newSlot[order[i]] = i;
+        }
+        for (auto& parent : parents) {
+            if (parent != NO_PARENT) {
+                parent = newSlot[parent];
+            }
+        }
+        permute(parents, order);
+        permute(positions, order);
+        permute(rotations, order);
+        permute(scales, order);
+        permute(worldMatrices, order);
+        permute(dirty, order);
+        permute(changed, order);
+        permute(slotToId, order);
+        for (uint32_t slot = 0; slot < count; slot++) {
+            idToSlot[slotToId[slot]] = slot;
+        }
+
+        // Parents come first, so sizes can be accumulated backwards
+        std::vector<uint32_t> subtreeSize(count, 1);
+        for (uint32_t slot = count; slot-- > 0;) {
+            if (parents[slot] != NO_PARENT) {
+                subtreeSize[parents[slot]] += subtreeSize[slot];
+            }
+        }
+
+        // Split into the largest subtrees that fit a job, merging neighbours,
+        // and the nodes above them
+        topSlots.clear();
+        jobRanges.clear();
+        for (uint32_t slot = 0; slot < count;) {
+            if (subtreeSize[slot] > JOB_SIZE) {
+                topSlots.push_back(slot);
+                slot++;
+                continue;
+            }
+            uint32_t end = slot + subtreeSize[slot];
+            if (!jobRanges.empty() && jobRanges.back().second == slot && end - jobRanges.back().first <= JOB_SIZE) {
+                jobRanges.back().second = end;
+            } else {
+                jobRanges.push_back({ slot, end });
+            }
+            slot = end;
+        }
+        orderDirty = false;
+    }
+
+    // Indexed by slot
+    std::vector<uint32_t> parents;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::mat4> worldMatrices;
+    std::vector<uint8_t> dirty;   // local transform changed
+    std::vector<uint8_t> changed; // world matrix recomputed in the last update
+    std::vector<uint32_t> slotToId;
+
+    std::vector<uint32_t> idToSlot;
+    bool orderDirty = false;
+    std::vector<uint32_t> topSlots;
+    std::vector<std::pair<uint32_t, uint32_t>> jobRanges;
+};
+
+// Arrays of object bounds are padded to a multiple of this, so the culling
+// kernels never need a scalar tail
+const size_t CULLING_BATCH = 8;
+
+// Object bounds as structure-of-arrays, both as spheres and as boxes
+class ObjectBounds {
+public:
+    void resize(size_t newCount) {
+        count = newCount;
+        size_t padded = (count + CULLING_BATCH - 1) / CULLING_BATCH * CULLING_BATCH;
+        for (auto* values : { &centerX, &centerY, &centerZ, &radius, &minX, &minY, &minZ, &maxX, &maxY, &maxZ }) {
+            values->resize(padded, 0.0f);
+        }
+    }
+
+    size_t size() const { return count; }
+
+    void set(size_t index, const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        glm::vec3 center = 0.5f * (boxMin + boxMax);
+        centerX[index] = center.x;
+        centerY[index] = center.y;
+        centerZ[index] = center.z;
+        radius[index] = glm::length(boxMax - center);
+        minX[index] = boxMin.x;
+        minY[index] = boxMin.y;
+        minZ[index] = boxMin.z;
+        maxX[index] = boxMax.x;
+        maxY[index] = boxMax.y;
+        maxZ[index] = boxMax.z;
+    }
+
+    // World space bounds of a local box placed by model
+    void setTransformed(size_t index, const glm::mat4& model, const glm::vec3& localMin, const glm::vec3& localMax) {
+        glm::vec3 center = glm::vec3(model * glm::vec4(0.5f * (localMin + localMax), 1.0f));
+        glm::vec3 extent = 0.5f * (localMax - localMin);
+        glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * extent.x 
+            + glm::abs(glm::vec3(model[1])) * extent.y 
+            + glm::abs(glm::vec3(model[2])) * extent.z;
+        set(index, center - worldExtent, center + worldExtent);
+    }
+
+    std::vector<float> centerX, centerY, centerZ, radius;
+    std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+
+private:
+    size_t count = 0;
+};
+
+// The few SIMD operations the culling and BVH kernels need, over four 
+// lanes, with a scalar emulation for targets without SIMD
+#if defined(CULLING_AVX2) || defined(CULLING_SSE2)
+struct Lanes4 {
+    static constexpr size_t WIDTH = 4;
+    using Float = __m128;
+    using Mask = __m128;
+    static Float load(const float* p) { return _mm_loadu_ps(p); }
+    static Float splat(float v) { return _mm_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+    static Float negate(Float a) { return _mm_sub_ps(_mm_setzero_ps(), a); }
+    static void store(float* p, Float a) { _mm_storeu_ps(p, a); }
+    static Mask greaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+    static Mask lessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+    static Mask less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+    static Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+    static Mask all() { return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+    static uint32_t bits(Mask m) { return static_cast<uint32_t>(_mm_movemask_ps(m)); }
+};
+#elif defined(CULLING_NEON)
+struct Lanes4 {
+    static constexpr size_t WIDTH = 4;
+    using Float = float32x4_t;
+    using Mask = uint32x4_t;
+    static Float load(const float* p) { return vld1q_f32(p); }
+    static Float splat(float v) { return vdupq_n_f32(v); }
+    static Float add(Float a, Float b) { return vaddq_f32(a, b); }
+    static Float sub(Float a, Float b) { return vsubq_f32(a, b); }
+    static Float mul(Float a, Float b) { return vmulq_f32(a, b); }
+    static Float min(Float a, Float b) { return vminq_f32(a, b); }
+    static Float max(Float a, Float b) { return vmaxq_f32(a, b); }
+    static Float negate(Float a) { return vnegq_f32(a); }
+    static void store(float* p, Float a) { vst1q_f32(p, a); }
+    static Mask greaterEqual(Float a, Float b) { return vcgeq_f32(a, b); }
+    static Mask lessEqual(Float a, Float b) { return vcleq_f32(a, b); }
+    static Mask less(Float a, Float b) { return vcltq_f32(a, b); }
+    static Mask both(Mask a, Mask b) { return vandq_u32(a, b); }
+    static Mask all() { return vdupq_n_u32(0xFFFFFFFF); }
+    static uint32_t bits(Mask m) {
+        const uint32_t laneBits[4] = { 1, 2, 4, 8 };
+        return vaddvq_u32(vandq_u32(m, vld1q_u32(laneBits)));
+    }
+};
+#else
+struct Lanes4 {
+    static constexpr size_t WIDTH = 4;
+    struct Float { float v[4]; };
+    using Mask = uint32_t;
+    template <typename Op>
+    static Float map(Float a, Float b, Op op) {
+        return { { op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3]) } };
+    }
+    template <typename Op>
+    static Mask compare(Float a, Float b, Op op) {
+        return op(a.v[0], b.v[0]) | op(a.v[1], b.v[1]) << 1 | op(a.v[2], b.v[2]) << 2 | op(a.v[3], b.v[3]) << 3;
+    }
+    static Float load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+    static Float splat(float v) { return { { v, v, v, v } }; }
+    static Float add(Float a, Float b) { return map(a, b, [](float x, float y) { return x + y; }); }
+    static Float sub(Float a, Float b) { return map(a, b, [](float x, float y) { return x - y; }); }
+    static Float mul(Float a, Float b) { return map(a, b, [](float x, float y) { return x * y; }); }
+    static Float min(Float a, Float b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+    static Float max(Float a, Float b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+    static Float negate(Float a) { return sub(splat(0.0f), a); }
+    static void store(float* p, Float a) { memcpy(p, a.v, sizeof(a.v)); }
+    static Mask greaterEqual(Float a, Float b) { return compare(a, b, [](float x, float y) { return uint32_t(x >= y); }); }
+    static Mask lessEqual(Float a, Float b) { return compare(a, b, [](float x, float y) { return uint32_t(x <= y); }); }
+    static Mask less(Float a, Float b) { return compare(a, b, [](float x, float y) { return uint32_t(x < y); }); }
+    static Mask both(Mask a, Mask b) { return a & b; }
+    static Mask all() { return 0xF; }
+    static uint32_t bits(Mask m) { return m; }
+};
+#endif
+
+// The culling kernels use eight lanes where the target has them
+#if defined(CULLING_AVX2)
+struct CullingLanes {
+    static constexpr size_t WIDTH = 8;
+    using Float = __m256;
+    using Mask = __m256;
+    static Float load(const float* p) { return _mm256_loadu_ps(p); }
+    static Float splat(float v) { return _mm256_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float negate(Float a) { return _mm256_sub_ps(_mm256_setzero_ps(), a); }
+    static Mask greaterEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+    static Mask all() { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+    static uint32_t bits(Mask m) { return static_cast<uint32_t>(_mm256_movemask_ps(m)); }
+};
+#else
+using CullingLanes = Lanes4;
+#endif
+
+// Culls object bounds against the planes from Camera::getFrustumPlanes, 
+// producing the indices of the visible objects in ascending order.
+class FrustumCuller {
+public:
+    enum class Test {
+        Sphere,
+        Box
+    };
+
+    // Objects per job, a multiple of CULLING_BATCH
+    static constexpr size_t CHUNK_SIZE = 4096;
+
+    void cull(const std::array<glm::vec4, 6>& planes, const ObjectBounds& bounds, Test test, WorkerPool* pool, std::vector<uint32_t>& visible) {
+        size_t count = bounds.size();
+        size_t chunkCount = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        // Each chunk writes to its own part of scratch, at most one index per object
+        scratch.resize(bounds.centerX.size());
+        chunkVisible.resize(chunkCount);
+
+        auto cullChunks = [&](size_t begin, size_t end) {
+            for (size_t chunk = begin; chunk < end; chunk++) {
+                size_t first = chunk * CHUNK_SIZE;
+                chunkVisible[chunk] = cullRange(planes, bounds, test, first, std::min(first + CHUNK_SIZE, count), scratch.data() + first);
+            }
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(chunkCount, 1, cullChunks);
+        } else {
+            cullChunks(0, chunkCount);
+        }
+
+        visible.clear();
+        for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+            auto first = scratch.begin() + chunk * CHUNK_SIZE;
+            visible.insert(visible.end(), first, first + chunkVisible[chunk]);
+        }
+    }
+
+    // Tests objects [begin, end), begin being a multiple of CULLING_BATCH, 
+    // and writes the visible ones to out, which must have room for the 
+    // whole padded batch. Returns how many were written.
+    static size_t cullRange(const std::array<glm::vec4, 6>& planes, const ObjectBounds& bounds, Test test, size_t begin, size_t end, uint32_t* out) {
+        using L = CullingLanes;
+        size_t visibleCount = 0;
+        for (size_t i = begin; i < end; i += L::WIDTH) {
+            L::Mask inside = L::all();
+            if (test == Test::Sphere) {
+                L::Float x = L::load(&bounds.centerX[i]);
+                L::Float y = L::load(&bounds.centerY[i]);
+                L::Float z = L::load(&bounds.centerZ[i]);
+                L::Float negRadius = L::negate(L::load(&bounds.radius[i]));
+                for (const auto& plane : planes) {
+                    L::Float d = L::add(L::add(L::add(L::mul(L::splat(plane.x), x), L::mul(L::splat(plane.y), y)), L::mul(L::splat(plane.z), z)), L::splat(plane.w));
+                    inside = L::both(inside, L::greaterEqual(d, negRadius));
+                }
+            } else {
+                const L::Float lo[3] = { L::load(&bounds.minX[i]), L::load(&bounds.minY[i]), L::load(&bounds.minZ[i]) };
+                const L::Float hi[3] = { L::load(&bounds.maxX[i]), L::load(&bounds.maxY[i]), L::load(&bounds.maxZ[i]) };
+                inside = boxesInside<L>(planes, lo, hi);
+            }
+            // Branchless compaction
+            uint32_t mask = L::bits(inside);
+            for (size_t lane = 0; lane < L::WIDTH; lane++) {
+                out[visibleCount] = static_cast<uint32_t>(i + lane);
+                visibleCount += (mask >> lane) & 1;
+            }
+        }
+        // Drop the padding of the last batch
+        while (visibleCount > 0 && out[visibleCount - 1] >= end) {
+            visibleCount--;
+        }
+        return visibleCount;
+    }
+
+    // Lanes whose box [lo, hi] is not entirely outside any of the planes
+    template <typename L>
+    static typename L::Mask boxesInside(const std::array<glm::vec4, 6>& planes, const typename L::Float lo[3], const typename L::Float hi[3]) {
+        typename L::Mask inside = L::all();
+        typename L::Float zero = L::splat(0.0f);
+        for (const auto& plane : planes) {
+            // Corner furthest along the plane normal
+            typename L::Float x = plane.x >= 0.0f ? hi[0] : lo[0];
+            typename L::Float y = plane.y >= 0.0f ? hi[1] : lo[1];
+            typename L::Float z = plane.z >= 0.0f ? hi[2] : lo[2];
+            typename L::Float d = L::add(L::add(L::add(L::mul(L::splat(plane.x), x), L::mul(L::splat(plane.y), y)), L::mul(L::splat(plane.z), z)), L::splat(plane.w));
+            inside = L::both(inside, L::greaterEqual(d, zero));
+        }
+        return inside;
+    }
+
+    // Lanes whose box [lo, hi] is entirely inside all of the planes
+    template <typename L>
+    static typename L::Mask boxesContained(const std::array<glm::vec4, 6>& planes, const typename L::Float lo[3], const typename L::Float hi[3]) {
+        typename L::Mask contained = L::all();
+        typename L::Float zero = L::splat(0.0f);
+        for (const auto& plane : planes) {
+            // Corner furthest against the plane normal
+            typename L::Float x = plane.x >= 0.0f ? lo[0] : hi[0];
+            typename L::Float y = plane.y >= 0.0f ? lo[1] : hi[1];
+            typename L::Float z = plane.z >= 0.0f ? lo[2] : hi[2];
+            typename L::Float d = L::add(L::add(L::add(L::mul(L::splat(plane.x), x), L::mul(L::splat(plane.y), y)), L::mul(L::splat(plane.z), z)), L::splat(plane.w));
+            contained = L::both(contained, L::greaterEqual(d, zero));
+        }
+        return contained;
+    }
+
+    // Reference for the kernels, with the same arithmetic one object at a time
+    static bool isVisible(const std::array<glm::vec4, 6>& planes, const ObjectBounds& bounds, Test test, size_t i) {
+        for (const auto& plane : planes) {
+            float d;
+            if (test == Test::Sphere) {
+                d = plane.x * bounds.centerX[i] + plane.y * bounds.centerY[i] + plane.z * bounds.centerZ[i] + plane.w;
+                if (!(d >= -bounds.radius[i])) {
+                    return false;
+                }
+            } else {
+                float x = plane.x >= 0.0f ? bounds.maxX[i] : bounds.minX[i];
+                float y = plane.y >= 0.0f ? bounds.maxY[i] : bounds.minY[i];
+                float z = plane.z >= 0.0f ? bounds.maxZ[i] : bounds.minZ[i];
+                d = plane.x * x + plane.y * y + plane.z * z + plane.w;
+                if (!(d >= 0.0f)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static size_t cullRangeScalar(const std::array<glm::vec4, 6>& planes, const ObjectBounds& bounds, Test test, size_t begin, size_t end, uint32_t* out) {
+        size_t visibleCount = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (isVisible(planes, bounds, test, i)) {
+                out[visibleCount++] = static_cast<uint32_t>(i);
+            }
+        }
+        return visibleCount;
+    }
+
+private:
+    std::vector<uint32_t> scratch;
+    std::vector<size_t> chunkVisible;
+};
+
+// Four-wide bounding volume hierarchy over the boxes of an ObjectBounds. 
+// A node stores the boxes of its four children as structure-of-arrays, so
+// one node is tested with a handful of four-lane operations. Built with 
+// binned SAH; when objects move it is refit, and rebuilt once refitting 
+// has degraded it too much.
+class Bvh4 {
+public:
+    static constexpr uint32_t NO_HIT = 0xFFFFFFFF;
+    static constexpr uint32_t MAX_LEAF_SIZE = 4;
+    // Rebuild when the SAH cost after a refit exceeds the built cost by this
+    static constexpr float REBUILD_RATIO = 1.5f;
+
+    void build(const ObjectBounds& bounds) {
+        nodes.clear();
+        objectIndices.clear();
+        builtCost = 0.0f;
+        if (bounds.size() == 0) {
+            return;
+        }
+
+        refs.resize(bounds.size());
+        for (size_t i = 0; i < bounds.size(); i++) {
+            refs[i].min = glm::vec3(bounds.minX[i], bounds.minY[i], bounds.minZ[i]);
+            refs[i].max = glm::vec3(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i]);
+            refs[i].index = static_cast<uint32_t>(i);
+        }
+        buildNode(0, refs.size());
+
+        objectIndices.resize(refs.size());
+        for (size_t i = 0; i < refs.size(); i++) {
+            objectIndices[i] = refs[i].index;
+        }
+        builtCost = cost();
+    }
+
+    // Update the node boxes after objects moved, keeping the tree topology
+    void refit(const ObjectBounds& bounds) {
+        if (bounds.size() != objectIndices.size()) {
+            build(bounds);
+            return;
+        }
+        // Children are always stored after their parent
+        for (size_t n = nodes.size(); n-- > 0;) {
+            Node& node = nodes[n];
+            for (int i = 0; i < 4; i++) {
+                if (node.child[i] == EMPTY) {
+                    continue;
+                }
+                glm::vec3 boxMin(FLT_MAX);
+                glm::vec3 boxMax(-FLT_MAX);
+                if (node.child[i] == LEAF) {
+                    for (uint32_t k = node.first[i]; k < node.first[i] + node.count[i]; k++) {
+                        uint32_t object = objectIndices[k];
+                        boxMin = glm::min(boxMin, glm::vec3(bounds.minX[object], bounds.minY[object], bounds.minZ[object]));
+                        boxMax = glm::max(boxMax, glm::vec3(bounds.maxX[object], bounds.maxY[object], bounds.maxZ[object]));
+                    }
+                } else {
+                    nodeBounds(nodes[node.child[i]], boxMin, boxMax);
+                }
+                setChildBounds(node, i, boxMin, boxMax);
+            }
+        }
+        if (cost() > builtCost * REBUILD_RATIO) {
+            build(bounds);
+        }
+    }
+
+    size_t nodeCount() const { return nodes.size(); }
+
+    // Objects whose box is not entirely outside the frustum, in no particular order
+    void queryFrustum(const std::array<glm::vec4, 6>& planes, const ObjectBounds& bounds, std::vector<uint32_t>& visible) const {
+        visible.clear();
+        if (nodes.empty()) {
+            return;
+        }
+        std::vector<uint32_t> stack{ 0 };
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.back()];
+            stack.pop_back();
+            const Lanes4::Float lo[3] = { Lanes4::load(node.minX), Lanes4::load(node.minY), Lanes4::load(node.minZ) };
+            const Lanes4::Float hi[3] = { Lanes4::load(node.maxX), Lanes4::load(node.maxY), Lanes4::load(node.maxZ) };
+            uint32_t mask = Lanes4::bits(FrustumCuller::boxesInside<Lanes4>(planes, lo, hi));
+            uint32_t contained = Lanes4::bits(FrustumCuller::boxesContained<Lanes4>(planes, lo, hi));
+            for (int i = 0; i < 4; i++) {
+                if (!(mask & (1u << i)) || node.child[i] == EMPTY) {
+                    continue;
+                }
+                if (contained & (1u << i)) {
+                    // Every object below is inside too
+                    visible.insert(visible.end(), objectIndices.begin() + node.first[i], objectIndices.begin() + node.first[i] + node.count[i]);
+                } else if (node.child[i] == LEAF) {
+                    for (uint32_t k = node.first[i]; k < node.first[i] + node.count[i]; k++) {
+                        if (FrustumCuller::isVisible(planes, bounds, FrustumCuller::Test::Box, objectIndices[k])) {
+                            visible.push_back(objectIndices[k]);
+                        }
+                    }
+                } else {
+                    stack.push_back(node.child[i]);
+                }
+            }
+        }
+    }
+
+    // Closest object whose box the ray hits, or NO_HIT. Children are visited
+    // front to back, and skipped once they are further than the best hit.
+    uint32_t raycast(const glm::vec3& origin, const glm::vec3& direction, const ObjectBounds& bounds, float& distance) const {
+        glm::vec3 invDir = 1.0f / safeDirection(direction);
+        uint32_t best = NO_HIT;
+        distance = FLT_MAX;
+        if (nodes.empty()) {
+            return best;
+        }
+
+        const Lanes4::Float o[3] = { Lanes4::splat(origin.x), Lanes4::splat(origin.y), Lanes4::splat(origin.z) };
+        const Lanes4::Float inv[3] = { Lanes4::splat(invDir.x), Lanes4::splat(invDir.y), Lanes4::splat(invDir.z) };
+        std::vector<std::pair<float, uint32_t>> stack{ { 0.0f, 0 } };
+        while (!stack.empty()) {
+            auto entry = stack.back();
+            stack.pop_back();
+            if (entry.first > distance) {
+                continue;
+            }
+            const Node& node = nodes[entry.second];
+            Lanes4::Float tNear = Lanes4::splat(0.0f);
+            Lanes4::Float tFar = Lanes4::splat(distance);
+            const float* lo[3] = { node.minX, node.minY, node.minZ };
+            const float* hi[3] = { node.maxX, node.maxY, node.maxZ };
+            for (int axis = 0; axis < 3; axis++) {
+                Lanes4::Float t1 = Lanes4::mul(Lanes4::sub(Lanes4::load(lo[axis]), o[axis]), inv[axis]);
+                Lanes4::Float t2 = Lanes4::mul(Lanes4::sub(Lanes4::load(hi[axis]), o[axis]), inv[axis]);
+                tNear = Lanes4::max(tNear, Lanes4::min(t1, t2));
+                tFar = Lanes4::min(tFar, Lanes4::max(t1, t2));
+            }
+            uint32_t mask = Lanes4::bits(Lanes4::lessEqual(tNear, tFar));
+            float entryDistance[4];
+            Lanes4::store(entryDistance, tNear);
+
+            // Push the hit children far to near so the nearest is popped first
+            size_t pushed = stack.size();
+            for (int i = 0; i < 4; i++) {
+                if (!(mask & (1u << i)) || node.child[i] == EMPTY) {
+                    continue;
+                }
+                if (node.child[i] == LEAF) {
+                    for (uint32_t k = node.first[i]; k < node.first[i] + node.count[i]; k++) {
+                        float t;
+                        if (rayHitsObject(origin, invDir, bounds, objectIndices[k], distance, t) 
+                            && (t < distance || (t == distance && objectIndices[k] < best))) {
+                            distance = t;
+                            best = objectIndices[k];
+                        }
+                    }
+                } else {
+                    stack.push_back({ entryDistance[i], node.child[i] });
+                }
+            }
+            std::sort(stack.begin() + pushed, stack.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        }
+        return best;
+    }
+
+    // Object whose box is closest to point, or NO_HIT if there are none. 
+    // distance is 0 when point is inside the box.
+    uint32_t nearest(const glm::vec3& point, const ObjectBounds& bounds, float& distance) const {
+        uint32_t best = NO_HIT;
+        float bestSquared = FLT_MAX;
+        if (nodes.empty()) {
+            distance = FLT_MAX;
+            return best;
+        }
+
+        const Lanes4::Float p[3] = { Lanes4::splat(point.x), Lanes4::splat(point.y), Lanes4::splat(point.z) };
+        Lanes4::Float zero = Lanes4::splat(0.0f);
+        std::vector<std::pair<float, uint32_t>> stack{ { 0.0f, 0 } };
+        while (!stack.empty()) {
+            auto entry = stack.back();
+            stack.pop_back();
+            if (entry.first > bestSquared) {
+                continue;
+            }
+            const Node& node = nodes[entry.second];
+            const float* lo[3] = { node.minX, node.minY, node.minZ };
+            const float* hi[3] = { node.maxX, node.maxY, node.maxZ };
+            Lanes4::Float squared = zero;
+            for (int axis = 0; axis < 3; axis++) {
+                Lanes4::Float outside = Lanes4::max(Lanes4::max(Lanes4::sub(Lanes4::load(lo[axis]), p[axis]), Lanes4::sub(p[axis], Lanes4::load(hi[axis]))), zero);
+                squared = Lanes4::add(squared, Lanes4::mul(outside, outside));
+            }
+            float childSquared[4];
+            Lanes4::store(childSquared, squared);
+
+            size_t pushed = stack.size();
+            for (int i = 0; i < 4; i++) {
+                if (node.child[i] == EMPTY || childSquared[i] > bestSquared) {
+                    continue;
+                }
+                if (node.child[i] == LEAF) {
+                    for (uint32_t k = node.first[i]; k < node.first[i] + node.count[i]; k++) {
+                        float d = distanceSquaredToObject(point, bounds, objectIndices[k]);
+                        if (d < bestSquared || (d == bestSquared && objectIndices[k] < best)) {
+                            bestSquared = d;
+                            best = objectIndices[k];
+                        }
+                    }
+                } else {
+                    stack.push_back({ childSquared[i], node.child[i] });
+                }
+            }
+            std::sort(stack.begin() + pushed, stack.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        }
+        distance = sqrt(bestSquared);
+        return best;
+    }
+
+    // Object tests shared by the queries and by brute-force references
+    static glm::vec3 safeDirection(glm::vec3 direction) {
+        // Keeps the inverse finite, so the slab test needs no special cases
+        for (int axis = 0; axis < 3; axis++) {
+            if (fabs(direction[axis]) < 1e-20f) {
+                direction[axis] = direction[axis] < 0.0f ? -1e-20f : 1e-20f;
+            }
+        }
+        return direction;
+    }
+
+    static bool rayHitsObject(const glm::vec3& origin, const glm::vec3& invDir, const ObjectBounds& bounds, uint32_t i, float maxDistance, float& t) {
+        const float lo[3] = { bounds.minX[i], bounds.minY[i], bounds.minZ[i] };
+        const float hi[3] = { bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i] };
+        float tNear = 0.0f;
+        float tFar = maxDistance;
+        for (int axis = 0; axis < 3; axis++) {
+            float t1 = (lo[axis] - origin[axis]) * invDir[axis];
+            float t2 = (hi[axis] - origin[axis]) * invDir[axis];
+            tNear = std::max(tNear, std::min(t1, t2));
+            tFar = std::min(tFar, std::max(t1, t2));
+        }
+        t = tNear;
+        return tNear <= tFar;
+    }
+
+    static float distanceSquaredToObject(const glm::vec3& point, const ObjectBounds& bounds, uint32_t i) {
+        glm::vec3 outside = glm::max(glm::max(glm::vec3(bounds.minX[i], bounds.minY[i], bounds.minZ[i]) - point, 
+            point - glm::vec3(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i])), glm::vec3(0.0f));
+        return glm::dot(outside, outside);
+    }
+
+private:
+    // child[i] is a node index, LEAF, or EMPTY with inverted bounds that no
+    // test passes. Subtrees cover contiguous ranges of objectIndices, so 
+    // first[i] and count[i] give the objects below any non-empty child.
+    static constexpr uint32_t LEAF = 0xFFFFFFFE;
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    struct alignas(16) Node {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+        uint32_t child[4];
+        uint32_t first[4];
+        uint32_t count[4];
+    };
+
+    struct BuildRef {
+        glm::vec3 min;
+        glm::vec3 max;
+        uint32_t index;
+        glm::vec3 centroid() const { return 0.5f * (min + max); }
+    };
+
+    static float surfaceArea(const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        glm::vec3 d = glm::max(boxMax - boxMin, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    static void setChildBounds(Node& node, int i, const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        node.minX[i] = boxMin.x;
+        node.minY[i] = boxMin.y;
+        node.minZ[i] = boxMin.z;
+        node.maxX[i] = boxMax.x;
+        node.maxY[i] = boxMax.y;
+        node.maxZ[i] = boxMax.z;
+    }
+
+    static void nodeBounds(const Node& node, glm::vec3& boxMin, glm::vec3& boxMax) {
+        for (int i = 0; i < 4; i++) {
+            if (node.child[i] != EMPTY) {
+                boxMin = glm::min(boxMin, glm::vec3(node.minX[i], node.minY[i], node.minZ[i]));
+                boxMax = glm::max(boxMax, glm::vec3(node.maxX[i], node.maxY[i], node.maxZ[i]));
+            }
+        }
+    }
+
+    // Split refs [begin, end) where the binned SAH is lowest, falling back 
+    // to the median when all centroids coincide. Returns the split point.
+    size_t splitRange(size_t begin, size_t end) {
+        const int binCount = 16;
+        glm::vec3 centroidMin(FLT_MAX);
+        glm::vec3 centroidMax(-FLT_MAX);
+        for (size_t i = begin; i < end; i++) {
+            centroidMin = glm::min(centroidMin, refs[i].centroid());
+            centroidMax = glm::max(centroidMax, refs[i].centroid());
+        }
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1;
+        int bestBin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            float extent = centroidMax[axis] - centroidMin[axis];
+            if (extent <= 0.0f) {
+                continue;
+            }
+            struct Bin {
+                glm::vec3 min = glm::vec3(FLT_MAX);
+                glm::vec3 max = glm::vec3(-FLT_MAX);
+                size_t count = 0;
+            } bins[binCount];
+            float scale = binCount / extent;
+            for (size_t i = begin; i < end; i++) {
+                int bin = std::min(binCount - 1, static_cast<int>((refs[i].centroid()[axis] - centroidMin[axis]) * scale));
+                bins[bin].min = glm::min(bins[bin].min, refs[i].min);
+                bins[bin].max = glm::max(bins[bin].max, refs[i].max);
+                bins[bin].count++;
+            }
+
+            // Sweep from the right, then evaluate each split from the left
+            float rightArea[binCount];
+            size_t rightCount[binCount];
+            Bin right;
+            for (int bin = binCount - 1; bin > 0; bin--) {
+                right.min = glm::min(right.min, bins[bin].min);
+                right.max = glm::max(right.max, bins[bin].max);
+                right.count += bins[bin].count;
+                rightArea[bin] = surfaceArea(right.min, right.max);
+                rightCount[bin] = right.count;
+            }
+            Bin left;
+            for (int bin = 1; bin < binCount; bin++) {
+                left.min = glm::min(left.min, bins[bin - 1].min);
+                left.max = glm::max(left.max, bins[bin - 1].max);
+                left.count += bins[bin - 1].count;
+                if (left.count == 0 || rightCount[bin] == 0) {
+                    continue;
+                }
+                float splitCost = surfaceArea(left.min, left.max) * left.count + rightArea[bin] * rightCount[bin];
+                if (splitCost < bestCost) {
+                    bestCost = splitCost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+
+        if (bestAxis < 0) {
+            size_t middle = (begin + end) / 2;
+            std::nth_element(refs.begin() + begin, refs.begin() + middle, refs.begin() + end, 
+                [](const BuildRef& a, const BuildRef& b) { return a.index < b.index; });
+            return middle;
+        }
+        float scale = binCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+        auto middle = std::partition(refs.begin() + begin, refs.begin() + end, [&](const BuildRef& ref) {
+            return std::min(binCount - 1, static_cast<int>((ref.centroid()[bestAxis] - centroidMin[bestAxis]) * scale)) < bestBin;
+        });
+        return static_cast<size_t>(middle - refs.begin());
+    }
+
+    uint32_t buildNode(size_t begin, size_t end) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        // Keep splitting the largest range until there are four
+        std::pair<size_t, size_t> ranges[4] = { { begin, end } };
+        int rangeCount = 1;
+        while (rangeCount < 4) {
+            int largest = -1;
+            for (int i = 0; i < rangeCount; i++) {
+                size_t size = ranges[i].second - ranges[i].first;
+                if (size > MAX_LEAF_SIZE && (largest < 0 || size > ranges[largest].second - ranges[largest].first)) {
+                    largest = i;
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            size_t middle = splitRange(ranges[largest].first, ranges[largest].second);
+            ranges[rangeCount++] = { middle, ranges[largest].second };
+            ranges[largest].second = middle;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            glm::vec3 boxMin(FLT_MAX);
+            glm::vec3 boxMax(-FLT_MAX);
+            uint32_t child = EMPTY;
+            uint32_t first = 0;
+            uint32_t count = 0;
+            if (i < rangeCount) {
+                for (size_t r = ranges[i].first; r < ranges[i].second; r++) {
+                    boxMin = glm::min(boxMin, refs[r].min);
+                    boxMax = glm::max(boxMax, refs[r].max);
+                }
+                first = static_cast<uint32_t>(ranges[i].first);
+                count = static_cast<uint32_t>(ranges[i].second - ranges[i].first);
+                // nodes may grow, so the new node is written through its index
+                child = count <= MAX_LEAF_SIZE ? LEAF : buildNode(ranges[i].first, ranges[i].second);
+            }
+            nodes[index].child[i] = child;
+            nodes[index].first[i] = first;
+            nodes[index].count[i] = count;
+            setChildBounds(nodes[index], i, boxMin, boxMax);
+        }
+        return index;
+    }
+
+    // SAH cost of the tree relative to the root area
+    float cost() const {
+        if (nodes.empty()) {
+            return 0.0f;
+        }
+        glm::vec3 rootMin(FLT_MAX);
+        glm::vec3 rootMax(-FLT_MAX);
+        nodeBounds(nodes[0], rootMin, rootMax);
+        float total = 0.0f;
+        for (const auto& node : nodes) {
+            for (int i = 0; i < 4; i++) {
+                if (node.child[i] != EMPTY) {
+                    float area = surfaceArea(glm::vec3(node.minX[i], node.minY[i], node.minZ[i]), glm::vec3(node.maxX[i], node.maxY[i], node.maxZ[i]));
+                    total += area * (node.child[i] == LEAF ? node.count[i] : 1.0f);
+                }
+            }
+        }
+        return total / std::max(surfaceArea(rootMin, rootMax), FLT_MIN);
+    }
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> objectIndices;
+    std::vector<BuildRef> refs;
+    float builtCost = 0.0f;
+};
+
+// Draws of a frame ordered by a packed 64-bit key, so that draws sharing
+// state are recorded next to each other. From the most significant bits:
+// pass (4), pipeline (12), material (16), mesh (12), depth (20).
+class RenderQueue {
+public:
+    struct Entry {
+        uint64_t key;
+        uint32_t item;
+    };
+
+    // Keys are sorted by a single pass per byte, from per-block histograms
+    static constexpr size_t MIN_BLOCK_SIZE = 16384;
+
+    // depth is in [0, 1], front to back
+    static uint64_t makeKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, float depth) {
+        uint64_t depthBucket = static_cast<uint64_t>(glm::clamp(depth, 0.0f, 1.0f) * 0xFFFFF);
+        return static_cast<uint64_t>(pass & 0xF) << 60 
+            | static_cast<uint64_t>(pipeline & 0xFFF) << 48 
+            | static_cast<uint64_t>(material & 0xFFFF) << 32 
+            | static_cast<uint64_t>(mesh & 0xFFF) << 20 
+            | depthBucket;
+    }
+
+    static uint32_t pipelineOf(uint64_t key) { return static_cast<uint32_t>(key >> 48) & 0xFFF; }
+    static uint32_t materialOf(uint64_t key) { return static_cast<uint32_t>(key >> 32) & 0xFFFF; }
+    static uint32_t meshOf(uint64_t key) { return static_cast<uint32_t>(key >> 20) & 0xFFF; }
+
+    void clear() { entries.clear(); }
+    void push(uint64_t key, uint32_t item) { entries.push_back({ key, item }); }
+    size_t size() const { return entries.size(); }
+    // In key order after sort()
+    const std::vector<Entry>& getEntries() const { return entries; }
+
+    // Stable LSD radix sort on bytes. Bytes that are equal in every key are
+    // skipped, so the unused high bits of a small scene cost nothing. Each 
+    // pass counts and scatters blocks of entries in parallel.
+    void sort(WorkerPool* pool = nullptr) {
+        size_t count = entries.size();
+        if (count < 2) {
+            return;
+        }
+        size_t blockCount = 1;
+        if (pool != nullptr) {
+            blockCount = std::max<size_t>(1, std::min(pool->threadCount(), count / MIN_BLOCK_SIZE));
+        }
+        size_t blockSize = (count + blockCount - 1) / blockCount;
+        scratch.resize(count);
+        offsets.resize(blockCount * 256);
+
+        uint64_t varying = 0;
+        for (const auto& entry : entries) {
+            varying |= entry.key ^ entries[0].key;
+        }
+
+        auto forEachBlock = [&](const std::function<void(size_t, size_t, size_t)>& fn) {
+            auto run = [&](size_t begin, size_t end) {
+                for (size_t block = begin; block < end; block++) {
+                    fn(block, block * blockSize, std::min(count, (block + 1) * blockSize));
+                }
+            };
+            if (pool != nullptr) {
+                pool->parallelFor(blockCount, 1, run);
+            } else {
+                run(0, blockCount);
+            }
+        };
+
+        for (int shift = 0; shift < 64; shift += 8) {
+            if (((varying >> shift) & 0xFF) == 0) {
+                continue;
+            }
+            forEachBlock([&](size_t block, size_t begin, size_t end) {
+                size_t* histogram = &offsets[block * 256];
+                std::fill(histogram, histogram + 256, 0);
+                for (size_t i = begin; i < end; i++) {
+                    histogram[(entries[i].key >> shift) & 0xFF]++;
+                }
+            });
+            // Digit-major prefix sum: equal digits keep their block order
+            size_t offset = 0;
+            for (size_t digit = 0; digit < 256; digit++) {
+                for (size_t block = 0; block < blockCount; block++) {
+                    size_t digitCount = offsets[block * 256 + digit];
+                    offsets[block * 256 + digit] = offset;
+                    offset += digitCount;
+                }
+            }
+            forEachBlock([&](size_t block, size_t begin, size_t end) {
+                size_t* next = &offsets[block * 256];
+                for (size_t i = begin; i < end; i++) {
+                    scratch[next[(entries[i].key >> shift) & 0xFF]++] = entries[i];
+                }
+            });
+            entries.swap(scratch);
+        }
+    }
+
+private:
+    std::vector<Entry> entries;
+    std::vector<Entry> scratch;
+    std::vector<size_t> offsets;
+};
+
+// Layout, stages and accesses of one use of an image
+struct ImageUse {
+    VkImageLayout layout;
+    VkPipelineStageFlags2KHR stages;
+    VkAccessFlags2KHR access;
+};
+
+// Layout transition and memory dependency between two uses of an image
+struct ImageBarrier {
+    VkImageLayout oldLayout;
+    VkImageLayout newLayout;
+    VkPipelineStageFlags2KHR srcStages;
+    VkAccessFlags2KHR srcAccess;
+    VkPipelineStageFlags2KHR dstStages;
+    VkAccessFlags2KHR dstAccess;
+
+    VkImageMemoryBarrier2KHR toVulkan(VkImage image, const VkImageSubresourceRange& range) const {
+        VkImageMemoryBarrier2KHR barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+        barrier.srcStageMask = srcStages;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstStageMask = dstStages;
+        barrier.dstAccessMask = dstAccess;
+        barrier.oldLayout = oldLayout;
+        barrier.newLayout = newLayout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange = range;
+        return barrier;
+    }
+};
+
+// What the next use of an image, or of one subresource of it, has to
+// wait for. The render graph and the image state tracker share these rules.
+struct ImageSyncState {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags2KHR writeStages = 0;
+    VkAccessFlags2KHR writeAccess = 0;
+    VkPipelineStageFlags2KHR readStages = 0;
+    // Stages and accesses the last write is already visible to
+    VkPipelineStageFlags2KHR visibleStages = 0;
+    VkAccessFlags2KHR visibleAccess = 0;
+    // The last layout transition came with a read. It is a write of its 
+    // own, ordered only before the stages of that read.
+    bool transitionPending = false;
+
+    static constexpr VkAccessFlags2KHR WRITE_ACCESS = VK_ACCESS_2_SHADER_WRITE_BIT_KHR | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR 
+        | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR | VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR | VK_ACCESS_2_HOST_WRITE_BIT_KHR 
+        | VK_ACCESS_2_MEMORY_WRITE_BIT_KHR | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT_KHR;
+    static constexpr VkAccessFlags2KHR READ_ACCESS = VK_ACCESS_2_SHADER_READ_BIT_KHR | VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT_KHR 
+        | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_TRANSFER_READ_BIT_KHR | VK_ACCESS_2_HOST_READ_BIT_KHR 
+        | VK_ACCESS_2_MEMORY_READ_BIT_KHR | VK_ACCESS_2_INPUT_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR 
+        | VK_ACCESS_2_SHADER_STORAGE_READ_BIT_KHR;
+
+    // Whether use needs a barrier first. The state is updated either way.
+    bool transition(const ImageUse& use, bool write, ImageBarrier& barrier) {
+        bool layoutChange = use.layout != layout;
+        if (write || layoutChange) {
+            // Writes and layout transitions wait for every earlier access
+            bool needed = layoutChange || writeStages != 0 || readStages != 0;
+            barrier = { layout, use.layout, writeStages | readStages, writeAccess, use.stages, use.access };
+            layout = use.layout;
+            writeStages = use.stages;
+            writeAccess = write ? use.access & WRITE_ACCESS : 0;
+            readStages = write ? 0 : use.stages;
+            visibleStages = write ? 0 : use.stages;
+            visibleAccess = write ? 0 : use.access;
+            transitionPending = !write;
+            return needed;
+        }
+        // Reads only need the last write made visible to them
+        bool needed = (writeAccess != 0 || transitionPending) && ((use.stages & ~visibleStages) || (use.access & ~visibleAccess));
+        if (needed) {
+            barrier = { layout, use.layout, writeStages, writeAccess, use.stages, use.access };
+            visibleStages |= use.stages;
+            visibleAccess |= use.access;
+        }
+        readStages |= use.stages;
+        return needed;
+    }
+};
+
+// Frame graph over images. Passes declare how they use each image; 
+// compile() then works out which passes contribute to an output, the 
+// synchronization2 barriers between them, and which transient images can
+// share memory because they are never alive at the same time.
+class RenderGraph {
+public:
+    struct ImageDesc {
+        VkFormat format;
+        VkExtent2D extent;
+        VkImageUsageFlags usage;
+        VkImageAspectFlags aspect;
+        VkSampleCountFlagBits samples;
+    };
+
+    struct Barrier {
+        uint32_t image;
+        ImageBarrier barrier;
+    };
+
+    // Transient images assigned to the same slot share its memory
+    struct MemorySlot {
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+        uint32_t memoryTypeBits;
+        // Only holds transient attachments, see setLazyAllocation
+        bool lazy;
+    };
+
+    struct Stats {
+        uint32_t passes = 0;
+        uint32_t culledPasses = 0;
+        uint32_t barriers = 0;
+        uint32_t barrierBatches = 0;
+        VkDeviceSize transientBytes = 0;
+        VkDeviceSize unaliasedBytes = 0;
+        // Part of transientBytes in lazy slots
+        VkDeviceSize lazyBytes = 0;
+    };
+
+    static constexpr uint32_t NO_SLOT = 0xFFFFFFFF;
+
+    void clear() {
+        images.clear();
+        passes.clear();
+        schedule.clear();
+        finalBarriers.clear();
+        slots.clear();
+        stats = Stats{};
+    }
+
+    // An image owned outside the graph, e.g. a swap chain image. It is in
+    // the initial state when the frame starts and is left in the final one;
+    // writing it is what keeps passes from being culled.
+    uint32_t importImage(const std::string& name, VkImageAspectFlags aspect, const ImageUse& initialUse, const ImageUse& finalUse) {
+        Image image{};
+        image.name = name;
+        image.imported = true;
+        image.desc.aspect = aspect;
+        image.initialUse = initialUse;
+        image.finalUse = finalUse;
+        images.push_back(image);
+        return static_cast<uint32_t>(images.size() - 1);
+    }
+
+    // An image only used within the frame. Its contents are undefined 
+    // when its first pass starts.
+    uint32_t createImage(const std::string& name, const ImageDesc& desc) {
+        Image image{};
+        image.name = name;
+        image.desc = desc;
+        images.push_back(image);
+        return static_cast<uint32_t>(images.size() - 1);
+    }
+
+    uint32_t addPass(const std::string& name, std::function<void(VkCommandBuffer)> execute) {
+        passes.push_back({ name, std::move(execute), {}, false, false });
+        return static_cast<uint32_t>(passes.size() - 1);
+    }
+
+    void read(uint32_t pass, uint32_t image, const ImageUse& use) { addUse(pass, image, use, false); }
+    void write(uint32_t pass, uint32_t image, const ImageUse& use) { addUse(pass, image, use, true); }
+    // Kept even if nothing it writes is used, e.g. for readbacks
+    void setSideEffects(uint32_t pass) { passes[pass].sideEffects = true; }
+    // When the device has lazily allocated memory, transient images that
+    // are only attachments of a single pass get TRANSIENT_ATTACHMENT usage
+    // and slots of their own. Their contents never leave the tile memory
+    // of a tiler, which then needs no backing memory for them.
+    void setLazyAllocation(bool enabled) { lazyAllocation = enabled; }
+
+    // Cull, allocate and schedule. requirements is called once for every 
+    // transient image that survives culling.
+    void compile(const std::function<VkMemoryRequirements(uint32_t image)>& requirements) {
+        schedule.clear();
+        finalBarriers.clear();
+        slots.clear();
+        stats = Stats{};
+        cullPasses();
+        assignMemory(requirements);
+
+        // Transient images start the frame as the last image in their slot
+        // left it the frame before, so simulate the frame once to find that
+        std::vector<ImageSyncState> states = initialStates(nullptr);
+        simulate(states, false);
+        states = initialStates(&states);
+        simulate(states, true);
+
+        stats.passes = static_cast<uint32_t>(passes.size());
+        for (const auto& pass : passes) {
+            stats.culledPasses += pass.alive ? 0 : 1;
+        }
+        for (const auto& scheduled : schedule) {
+            stats.barriers += static_cast<uint32_t>(scheduled.second.size());
+            stats.barrierBatches += scheduled.second.empty() ? 0 : 1;
+        }
+        stats.barriers += static_cast<uint32_t>(finalBarriers.size());
+        stats.barrierBatches += finalBarriers.empty() ? 0 : 1;
+    }
+
+    // Record the passes that survived culling with their barriers. 
+    // vkImages holds the handle of every image of the graph for this frame.
+    void execute(VkCommandBuffer commandBuffer, const std::vector<VkImage>& vkImages, PFN_vkCmdPipelineBarrier2KHR cmdPipelineBarrier2) const {
+        std::vector<VkImageMemoryBarrier2KHR> batch;
+        for (const auto& scheduled : schedule) {
+            recordBarriers(commandBuffer, scheduled.second, vkImages, cmdPipelineBarrier2, batch);
+            passes[scheduled.first].execute(commandBuffer);
+        }
+        recordBarriers(commandBuffer, finalBarriers, vkImages, cmdPipelineBarrier2, batch);
+    }
+
+    const ImageDesc& getDesc(uint32_t image) const { return images[image].desc; }
+    bool isImported(uint32_t image) const { return images[image].imported; }
+    // NO_SLOT for imported images and for images only used by culled passes
+    uint32_t getSlot(uint32_t image) const { return images[image].slot; }
+    const std::vector<MemorySlot>& getSlots() const { return slots; }
+    size_t imageCount() const { return images.size(); }
+    const Stats& getStats() const { return stats; }
+
+private:
+    struct Use {
+        uint32_t image;
+        ImageUse use;
+        bool write;
+    };
+
+    struct Pass {
+        std::string name;
+        std::function<void(VkCommandBuffer)> execute;
+        std::vector<Use> uses;
+        bool sideEffects;
+        bool alive;
+    };
+
+    struct Image {
+        std::string name;
+        ImageDesc desc;
+        bool imported;
+        ImageUse initialUse;
+        ImageUse finalUse;
+        // Alive passes using it, in submission order
+        uint32_t firstPass;
+        uint32_t lastPass;
+        uint32_t slot;
+    };
+
+    void addUse(uint32_t pass, uint32_t image, const ImageUse& use, bool write) {
+        // One use per image and pass, so that a pass needs one barrier per image at most
+        for (auto& existing : passes[pass].uses) {
+            if (existing.image == image) {
+                if (existing.use.layout != use.layout) {
+                    throw std::runtime_error("render graph pass uses an image in two layouts!");
+                }
+                existing.use.stages |= use.stages;
+                existing.use.access |= use.access;
+                existing.write = existing.write || write;
+                return;
+            }
+        }
+        passes[pass].uses.push_back({ image, use, write });
+    }
+
+    // Walking backwards from the outputs, a pass is needed if it has side
+    // effects or writes an image that a later needed pass reads
+    void cullPasses() {
+        std::vector<bool> needed(images.size(), false);
+        for (size_t i = 0; i < images.size(); i++) {
+            needed[i] = images[i].imported;
+        }
+        for (size_t p = passes.size(); p-- > 0;) {
+            Pass& pass = passes[p];
+            pass.alive = pass.sideEffects;
+            for (const auto& use : pass.uses) {
+                pass.alive = pass.alive || (use.write && needed[use.image]);
+            }
+            if (!pass.alive) {
+                continue;
+            }
+            // Anything it writes without reading is overwritten, so earlier
+            // writers are only needed if they are read in between
+            for (const auto& use : pass.uses) {
+                if (use.write && !(use.use.access & ImageSyncState::READ_ACCESS)) {
+                    needed[use.image] = images[use.image].imported;
+                }
+            }
+            for (const auto& use : pass.uses) {
+                if (use.use.access & ImageSyncState::READ_ACCESS) {
+                    needed[use.image] = true;
+                }
+            }
+        }
+    }
+
+    // Greedy interval packing: images in order of first use go into the 
+    // best-fitting slot whose last image is no longer alive
+    void assignMemory(const std::function<VkMemoryRequirements(uint32_t image)>& requirements) {
+        std::vector<uint32_t> transients;
+        for (uint32_t i = 0; i < images.size(); i++) {
+            images[i].firstPass = NO_SLOT;
+            images[i].lastPass = 0;
+            images[i].slot = NO_SLOT;
+        }
+        for (uint32_t p = 0; p < passes.size(); p++) {
+            if (!passes[p].alive) {
+                continue;
+            }
+            for (const auto& use : passes[p].uses) {
+                Image& image = images[use.image];
+                if (image.firstPass == NO_SLOT) {
+                    image.firstPass = p;
+                    if (!image.imported) {
+                        transients.push_back(use.image);
+                    }
+                }
+                image.lastPass = p;
+            }
+        }
+
+        std::vector<uint32_t> slotLastPass;
+        for (uint32_t index : transients) {
+            Image& image = images[index];
+            const VkImageUsageFlags attachmentUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT 
+                | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+            bool lazy = lazyAllocation && image.firstPass == image.lastPass && !(image.desc.usage & ~attachmentUsage);
+            if (lazy) {
+                image.desc.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+            }
+            VkMemoryRequirements req = requirements(index);
+            stats.unaliasedBytes += req.size;
+
+            uint32_t best = NO_SLOT;
+            for (uint32_t s = 0; s < slots.size(); s++) {
+                if (slotLastPass[s] >= image.firstPass || slots[s].lazy != lazy || !(slots[s].memoryTypeBits & req.memoryTypeBits)) {
+                    continue;
+                }
+                // Prefer the smallest slot that fits, then the largest that doesn't
+                bool fits = slots[s].size >= req.size;
+                if (best == NO_SLOT) {
+                    best = s;
+                } else {
+                    bool bestFits = slots[best].size >= req.size;
+                    if ((fits && (!bestFits || slots[s].size < slots[best].size)) || (!fits && !bestFits && slots[s].size > slots[best].size)) {
+                        best = s;
+                    }
+                }
+            }
+            if (best == NO_SLOT) {
+                best = static_cast<uint32_t>(slots.size());
+                slots.push_back({ 0, 1, req.memoryTypeBits, lazy });
+                slotLastPass.push_back(0);
+            }
+            MemorySlot& slot = slots[best];
+            slot.size = std::max(slot.size, req.size);
+            slot.alignment = std::max(slot.alignment, req.alignment);
+            slot.memoryTypeBits &= req.memoryTypeBits;
+            slotLastPass[best] = image.lastPass;
+            image.slot = best;
+        }
+        for (const auto& slot : slots) {
+            stats.transientBytes += slot.size;
+            stats.lazyBytes += slot.lazy ? slot.size : 0;
+        }
+    }
+
+    // Imported images start as declared. A transient starts undefined, but
+    // must wait for whatever last used its memory: in this frame the 
+    // previous image of its slot, otherwise the slot's last image in the 
+    // previous frame, taken from the end states of a first simulation.
+    std::vector<ImageSyncState> initialStates(const std::vector<ImageSyncState>* endStates) const {
+        std::vector<ImageSyncState> states(images.size());
+        std::vector<uint32_t> lastInSlot(slots.size(), NO_SLOT);
+        for (uint32_t i = 0; i < images.size(); i++) {
+            const Image& image = images[i];
+            if (image.slot != NO_SLOT && (lastInSlot[image.slot] == NO_SLOT || images[lastInSlot[image.slot]].lastPass < image.lastPass)) {
+                lastInSlot[image.slot] = i;
+            }
+        }
+        for (uint32_t i = 0; i < images.size(); i++) {
+            const Image& image = images[i];
+            ImageSyncState& state = states[i];
+            if (image.imported) {
+                state.layout = image.initialUse.layout;
+                state.writeStages = image.initialUse.stages;
+                state.writeAccess = image.initialUse.access & ImageSyncState::WRITE_ACCESS;
+            } else if (endStates != nullptr && image.slot != NO_SLOT) {
+                const ImageSyncState& last = (*endStates)[lastInSlot[image.slot]];
+                state.writeStages = last.writeStages | last.readStages;
+                state.writeAccess = last.writeAccess;
+            }
+        }
+        return states;
+    }
+
+    void simulate(std::vector<ImageSyncState>& states, bool record) {
+        // Previous image in the same slot within the frame
+        std::vector<uint32_t> slotOwner(slots.size(), NO_SLOT);
+        for (uint32_t p = 0; p < passes.size(); p++) {
+            if (!passes[p].alive) {
+                continue;
+            }
+            std::vector<Barrier> barriers;
+            for (const auto& use : passes[p].uses) {
+                ImageSyncState& state = states[use.image];
+                const Image& image = images[use.image];
+                if (image.slot != NO_SLOT && image.firstPass == p) {
+                    uint32_t previous = slotOwner[image.slot];
+                    if (previous != NO_SLOT) {
+                        state.writeStages = states[previous].writeStages | states[previous].readStages;
+                        state.writeAccess = states[previous].writeAccess;
+                    }
+                    slotOwner[image.slot] = use.image;
+                }
+                ImageBarrier barrier;
+                if (state.transition(use.use, use.write, barrier)) {
+                    barriers.push_back({ use.image, barrier });
+                }
+            }
+            if (record) {
+                schedule.push_back({ p, std::move(barriers) });
+            }
+        }
+        for (uint32_t i = 0; i < images.size(); i++) {
+            if (images[i].imported) {
+                const ImageUse& finalUse = images[i].finalUse;
+                ImageBarrier barrier;
+                if (states[i].transition(finalUse, finalUse.layout != states[i].layout, barrier) && record) {
+                    finalBarriers.push_back({ i, barrier });
+                }
+            }
+        }
+    }
+
+    void recordBarriers(VkCommandBuffer commandBuffer, const std::vector<Barrier>& barriers, const std::vector<VkImage>& vkImages, 
+        PFN_vkCmdPipelineBarrier2KHR cmdPipelineBarrier2, std::vector<VkImageMemoryBarrier2KHR>& batch) const {
+        if (barriers.empty()) {
+            return;
+        }
+        batch.clear();
+        for (const auto& barrier : barriers) {
+            VkImageSubresourceRange range = { images[barrier.image].desc.aspect, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+            batch.push_back(barrier.barrier.toVulkan(vkImages[barrier.image], range));
+        }
+        VkDependencyInfoKHR dependencyInfo{};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(batch.size());
+        dependencyInfo.pImageMemoryBarriers = batch.data();
+        cmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+    }
+
+    std::vector<Image> images;
+    std::vector<Pass> passes;
+    std::vector<MemorySlot> slots;
+    // Alive passes in submission order, each with the barriers before it
+    std::vector<std::pair<uint32_t, std::vector<Barrier>>> schedule;
+    // Imported images back to their final state
+    std::vector<Barrier> finalBarriers;
+    bool lazyAllocation = false;
+    Stats stats;
+};
+
+// Layout and access state of every subresource of the images it tracks.
+// require() queues the barriers a use needs, or none when the state
+// already allows it; flush() records everything queued as one batch.
+// State is updated at record time, so command buffers must be submitted
+// in the order they were recorded in.
+class ImageStateTracker {
+public:
+    struct Stats {
+        uint32_t requests = 0;
+        uint32_t barriers = 0;
+        uint32_t skipped = 0;
+        uint32_t batches = 0;
+    };
+
+    void track(VkImage image, VkImageAspectFlags aspect, uint32_t mipLevels, uint32_t arrayLayers, 
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED) {
+        Image& tracked = images[image];
+        tracked.aspect = aspect;
+        tracked.mipLevels = mipLevels;
+        tracked.arrayLayers = arrayLayers;
+        tracked.states.assign(static_cast<size_t>(mipLevels) * arrayLayers, ImageSyncState{});
+        tracked.queuedIn.assign(tracked.states.size(), 0);
+        for (auto& state : tracked.states) {
+            state.layout = layout;
+        }
+    }
+
+    void forget(VkImage image) {
+        images.erase(image);
+    }
+
+    // Every mip level and array layer
+    void require(VkImage image, VkImageLayout layout, VkPipelineStageFlags2KHR stages, VkAccessFlags2KHR access) {
+        require(image, { 0, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS }, layout, stages, access);
+    }
+
+    // The aspect mask of range is ignored; barriers cover the aspects the 
+    // image was tracked with
+    void require(VkImage image, const VkImageSubresourceRange& range, VkImageLayout layout, 
+        VkPipelineStageFlags2KHR stages, VkAccessFlags2KHR access) {
+        auto it = images.find(image);
+        if (it == images.end()) {
+            throw std::runtime_error("image layout required for an untracked image!");
+        }
+        Image& tracked = it->second;
+        uint32_t levelEnd = range.levelCount == VK_REMAINING_MIP_LEVELS ? tracked.mipLevels : range.baseMipLevel + range.levelCount;
+        uint32_t layerEnd = range.layerCount == VK_REMAINING_ARRAY_LAYERS ? tracked.arrayLayers : range.baseArrayLayer + range.layerCount;
+        if (levelEnd > tracked.mipLevels || layerEnd > tracked.arrayLayers) {
+            throw std::runtime_error("image subresource range out of bounds!");
+        }
+        ImageUse use = { layout, stages, access };
+        bool write = (access & ImageSyncState::WRITE_ACCESS) != 0;
+        stats.requests++;
+
+        size_t firstNew = pending.size();
+        for (uint32_t level = range.baseMipLevel; level < levelEnd; level++) {
+            for (uint32_t layer = range.baseArrayLayer; layer < layerEnd; layer++) {
+                size_t index = static_cast<size_t>(level) * tracked.arrayLayers + layer;
+                ImageBarrier barrier;
+                if (!tracked.states[index].transition(use, write, barrier)) {
+                    stats.skipped++;
+                    continue;
+                }
+                // Barriers of one batch are unordered among themselves
+                if (tracked.queuedIn[index] == flushes + 1) {
+                    throw std::runtime_error("image subresource transitioned twice without a flush!");
+                }
+                tracked.queuedIn[index] = flushes + 1;
+                // Neighbouring layers of a level that need the same barrier share one
+                if (pending.size() > firstNew) {
+                    Pending& last = pending.back();
+                    if (sameBarrier(last.barrier, barrier) && last.range.baseMipLevel == level 
+                        && last.range.baseArrayLayer + last.range.layerCount == layer) {
+                        last.range.layerCount++;
+                        continue;
+                    }
+                }
+                mergeLevels(firstNew);
+                pending.push_back({ image, barrier, { tracked.aspect, level, 1, layer, 1 } });
+            }
+        }
+        mergeLevels(firstNew);
+    }
+
+    // Record the queued barriers, if any
+    void flush(VkCommandBuffer commandBuffer, PFN_vkCmdPipelineBarrier2KHR cmdPipelineBarrier2) {
+        if (pending.empty()) {
+            return;
+        }
+        batch.clear();
+        for (const auto& barrier : pending) {
+            batch.push_back(barrier.barrier.toVulkan(barrier.image, barrier.range));
+        }
+        VkDependencyInfoKHR dependencyInfo{};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(batch.size());
+        dependencyInfo.pImageMemoryBarriers = batch.data();
+        cmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+        stats.barriers += static_cast<uint32_t>(pending.size());
+        stats.batches++;
+        flushes++;
+        pending.clear();
+    }
+
+    VkImageLayout getLayout(VkImage image, uint32_t mipLevel = 0, uint32_t arrayLayer = 0) const {
+        const Image& tracked = images.at(image);
+        return tracked.states[mipLevel * tracked.arrayLayers + arrayLayer].layout;
+    }
+
+    const Stats& getStats() const { return stats; }
+    void resetStats() { stats = Stats{}; }
+
+private:
+    struct Image {
+        VkImageAspectFlags aspect;
+        uint32_t mipLevels;
+        uint32_t arrayLayers;
+        // Indexed by mipLevel * arrayLayers + arrayLayer
+        std::vector<ImageSyncState> states;
+        // Flush that will record a barrier queued for the subresource
+        std::vector<uint64_t> queuedIn;
+    };
+
+    struct Pending {
+        VkImage image;
+        ImageBarrier barrier;
+        VkImageSubresourceRange range;
+    };
+
+    static bool sameBarrier(const ImageBarrier& a, const ImageBarrier& b) {
+        return a.oldLayout == b.oldLayout && a.newLayout == b.newLayout && a.srcStages == b.srcStages 
+            && a.srcAccess == b.srcAccess && a.dstStages == b.dstStages && a.dstAccess == b.dstAccess;
+    }
+
+    // Fold the last run of layers queued into the one before it when it 
+    // covers the same layers of the next level
+    void mergeLevels(size_t firstNew) {
+        if (pending.size() < firstNew + 2) {
+            return;
+        }
+        const Pending& run = pending.back();
+        Pending& before = pending[pending.size() - 2];
+        if (sameBarrier(before.barrier, run.barrier) && before.range.baseArrayLayer == run.range.baseArrayLayer 
+            && before.range.layerCount == run.range.layerCount 
+            && before.range.baseMipLevel + before.range.levelCount == run.range.baseMipLevel) {
+            before.range.levelCount += run.range.levelCount;
+            pending.pop_back();
+        }
+    }
+
+    std::unordered_map<VkImage, Image> images;
+    std::vector<Pending> pending;
+    std::vector<VkImageMemoryBarrier2KHR> batch;
+    uint64_t flushes = 0;
+    Stats stats;
+};
+
+// Picks the render scale from measured GPU frame times. The cost of a 
+// frame is mostly per pixel, i.e. proportional to the square of the scale,
+// so the scale is corrected by the square root of budget / time. It drops
+// as soon as the smoothed time is over budget, and only grows back once
+// there is clear headroom, so it does not oscillate around the budget.
+class ResolutionScaler {
+public:
+    struct Settings {
+        float minScale = MIN_RENDER_SCALE;
+        float maxScale = MAX_RENDER_SCALE;
+        double budgetMs = 1000.0 / TARGET_FPS;
+        // Fraction of the budget aimed for, leaving room for the CPU side 
+        // and for noise
+        double targetFraction = 0.9;
+        // Grow only below this fraction of the target
+        double growThreshold = 0.85;
+        // Largest increase of the scale per update
+        float maxGrowth = 0.02f;
+        // Weight of a new sample in the smoothed time. Samples over the 
+        // smoothed time weigh more, so load spikes are caught quickly.
+        double smoothing = 0.1;
+        double spikeSmoothing = 0.5;
+        // The scale is kept on a grid, so tiny corrections do not change 
+        // the viewport every frame
+        float step = 1.0f / 64.0f;
+    };
+
+    ResolutionScaler() = default;
+    explicit ResolutionScaler(const Settings& settings) : settings(settings) {
+        reset();
+    }
+
+    void reset() {
+        scale = settings.maxScale;
+        smoothedMs = 0.0;
+        samples = 0;
+    }
+
+    // Feed the GPU time of a completed frame, return the scale to render 
+    // the next frame at
+    float update(double gpuMs) {
+        if (gpuMs <= 0.0) {
+            return scale;
+        }
+        if (samples == 0) {
+            smoothedMs = gpuMs;
+        } else {
+            double weight = gpuMs > smoothedMs ? settings.spikeSmoothing : settings.smoothing;
+            smoothedMs += (gpuMs - smoothedMs) * weight;
+        }
+        samples++;
+
+        // Measured at the scale frames were rendered at, which may lag 
+        // behind the current one by the frames in flight. Correcting from 
+        // the current scale may undershoot a little, and is then caught up 
+        // by the next updates.
+        double target = settings.budgetMs * settings.targetFraction;
+        float wanted = scale;
+        if (smoothedMs > target) {
+            wanted = static_cast<float>(scale * std::sqrt(target / smoothedMs));
+        } else if (smoothedMs < target * settings.growThreshold) {
+            wanted = std::min(static_cast<float>(scale * std::sqrt(target / smoothedMs)), scale + settings.maxGrowth);
+        }
+        wanted = std::round(wanted / settings.step) * settings.step;
+        scale = std::clamp(wanted, settings.minScale, settings.maxScale);
+        return scale;
+    }
+
+    float getScale() const {
+        return scale;
+    }
+
+    double getSmoothedMs() const {
+        return smoothedMs;
+    }
+
+    const Settings& getSettings() const {
+        return settings;
+    }
+
+private:
+    Settings settings;
+    float scale = MAX_RENDER_SCALE;
+    double smoothedMs = 0.0;
+    uint64_t samples = 0;
+};
+
+// Packs rectangles into an atlas by keeping the skyline, the top edge of 
+// what has been placed so far, and putting each new rectangle where its 
+// top ends lowest. Rectangles cannot be freed one by one: the atlas is 
+// reset and packed again when the set of shadow maps changes.
+class SkylineAllocator {
+public:
+    struct Rect {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    void reset(uint32_t newWidth, uint32_t newHeight) {
+        width = newWidth;
+        height = newHeight;
+        usedArea = 0;
+        skyline.assign(1, { 0, 0, width });
+    }
+
+    // Empty when the rectangle does not fit anywhere
+    std::optional<Rect> allocate(uint32_t rectWidth, uint32_t rectHeight) {
+        size_t best = skyline.size();
+        uint32_t bestTop = UINT32_MAX;
+        uint32_t bestY = 0;
+        for (size_t i = 0; i < skyline.size(); i++) {
+            uint32_t y;
+            if (fits(i, rectWidth, rectHeight, y) && y + rectHeight < bestTop) {
+                best = i;
+                bestTop = y + rectHeight;
+                bestY = y;
+            }
+        }
+        if (best == skyline.size()) {
+            return std::nullopt;
+        }
+        Rect rect = { skyline[best].x, bestY, rectWidth, rectHeight };
+
+        // The new segment covers the rectangle's top, the ones it spans 
+        // shrink or go
+        skyline.insert(skyline.begin() + best, { rect.x, rect.y + rect.height, rect.width });
+        size_t next = best + 1;
+        uint32_t right = rect.x + rect.width;
+        while (next < skyline.size() && skyline[next].x < right) {
+            Segment& segment = skyline[next];
+            uint32_t segmentRight = segment.x + segment.width;
+            if (segmentRight <= right) {
+                skyline.erase(skyline.begin() + next);
+                continue;
+            }
+            segment.width = segmentRight - right;
+            segment.x = right;
+            break;
+        }
+        // Neighbours at the same height become one segment
+        for (size_t i = 0; i + 1 < skyline.size();) {
+            if (skyline[i].y == skyline[i + 1].y) {
+                skyline[i].width += skyline[i + 1].width;
+                skyline.erase(skyline.begin() + i + 1);
+            } else {
+                i++;
+            }
+        }
+        usedArea += static_cast<uint64_t>(rectWidth) * rectHeight;
+        return rect;
+    }
+
+    uint64_t getUsedArea() const { return usedArea; }
+
+private:
+    struct Segment {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+    };
+
+    // Whether a rectangle with its left edge at segment index fits, and 
+    // the height it would be placed at: the highest segment below it
+    bool fits(size_t index, uint32_t rectWidth, uint32_t rectHeight, uint32_t& y) const {
+        if (skyline[index].x + rectWidth > width) {
+            return false;
+        }
+        y = 0;
+        uint32_t covered = 0;
+        for (size_t i = index; covered < rectWidth; i++) {
+            y = std::max(y, skyline[i].y);
+            if (y + rectHeight > height) {
+                return false;
+            }
+            covered += skyline[i].width;
+        }
+        return true;
+    }
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint64_t usedArea = 0;
+    std::vector<Segment> skyline;
+};
+
+// View depth at which each cascade ends: a blend of uniform and 
+// logarithmic splits, the last one at distance
+std::array<float, SHADOW_CASCADE_COUNT> shadowCascadeSplits(float zNear, float distance) {
+    std::array<float, SHADOW_CASCADE_COUNT> splits;
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        float fraction = static_cast<float>(i + 1) / SHADOW_CASCADE_COUNT;
+        float logarithmic = zNear * std::pow(distance / zNear, fraction);
+        float uniform = zNear + (distance - zNear) * fraction;
+        splits[i] = SHADOW_SPLIT_LAMBDA * logarithmic + (1.0f - SHADOW_SPLIT_LAMBDA) * uniform;
+    }
+    return splits;
+}
+
+// World to light clip space of the cascade covering the view depths 
+// [nearDepth, farDepth]. It is fitted to the bounding sphere of that slice
+// of the frustum, whose size does not change as the camera turns, and its
+// center moves in steps of snapTexels texels, so that the matrix only 
+// changes when the camera has moved by about that much.
+glm::mat4 fitShadowCascade(const glm::mat4& invView, float fovy, float aspect, float nearDepth, float farDepth, 
+    const glm::vec3& sunDirection, uint32_t resolution, uint32_t snapTexels) {
+    float tanY = std::tan(fovy * 0.5f);
+    float tanX = tanY * aspect;
+    glm::vec3 center(0.0f, 0.0f, -0.5f * (nearDepth + farDepth));
+    float radius = 0.0f;
+    for (float depth : { nearDepth, farDepth }) {
+        glm::vec3 corner(tanX * depth, tanY * depth, -depth);
+        radius = std::max(radius, glm::length(corner - center));
+    }
+    // Rounded up, so that float noise does not change it
+    radius = std::ceil(radius * 64.0f) / 64.0f;
+    // Padded by half a snapping step on each side, so the sphere stays 
+    // covered wherever the snapped center ends up
+    radius *= resolution / static_cast<float>(resolution - snapTexels);
+    float step = snapTexels * 2.0f * radius / resolution;
+
+    glm::vec3 up = std::abs(sunDirection.z) > 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+    glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), sunDirection, up);
+    glm::vec3 lightCenter = glm::vec3(lightView * invView * glm::vec4(center, 1.0f));
+    lightCenter = glm::floor(lightCenter / step + 0.5f) * step;
+    // Towards the sun is +z in light view space
+    glm::mat4 lightProj = glm::ortho(lightCenter.x - radius, lightCenter.x + radius, lightCenter.y - radius, lightCenter.y + radius, 
+        -(lightCenter.z + radius + SHADOW_CASTER_DEPTH), -(lightCenter.z - radius));
+    return lightProj * lightView;
+}
+
+// Live device memory by category and heap. Every vkAllocateMemory and 
+// vkFreeMemory of the application goes through it, so whatever is left 
+// after cleanup has leaked.
+class MemoryTracker {
+public:
+    struct Usage {
+        VkDeviceSize bytes = 0;
+        VkDeviceSize peakBytes = 0;
+        uint32_t allocations = 0;
+    };
+
+    void add(VkDeviceMemory memory, MemoryCategory category, uint32_t heap, VkDeviceSize size) {
+        if (heap >= VK_MAX_MEMORY_HEAPS || !live.emplace(memory, Allocation{ category, heap, size }).second) {
+            throw std::runtime_error("failed to track memory allocation!");
+        }
+        Usage& entry = usage[static_cast<size_t>(category)][heap];
+        entry.bytes += size;
+        entry.peakBytes = std::max(entry.peakBytes, entry.bytes);
+        entry.allocations++;
+    }
+
+    // Null handles are ignored, as by vkFreeMemory
+    void remove(VkDeviceMemory memory) {
+        if (memory == VK_NULL_HANDLE) {
+            return;
+        }
+        auto it = live.find(memory);
+        if (it == live.end()) {
+            throw std::runtime_error("freeing untracked memory!");
+        }
+        Usage& entry = usage[static_cast<size_t>(it->second.category)][it->second.heap];
+        entry.bytes -= it->second.size;
+        entry.allocations--;
+        live.erase(it);
+    }
+
+    const Usage& get(MemoryCategory category, uint32_t heap) const {
+        return usage[static_cast<size_t>(category)][heap];
+    }
+
+    VkDeviceSize heapBytes(uint32_t heap) const {
+        VkDeviceSize bytes = 0;
+        for (const auto& category : usage) {
+            bytes += category[heap].bytes;
+        }
+        return bytes;
+    }
+
+    size_t liveAllocations() const { return live.size(); }
+
+    VkDeviceSize liveBytes() const {
+        VkDeviceSize bytes = 0;
+        for (const auto& [memory, allocation] : live) {
+            bytes += allocation.size;
+        }
+        return bytes;
+    }
+
+private:
+    struct Allocation {
+        MemoryCategory category;
+        uint32_t heap;
+        VkDeviceSize size;
+    };
+    std::unordered_map<VkDeviceMemory, Allocation> live;
+    std::array<std::array<Usage, VK_MAX_MEMORY_HEAPS>, MEMORY_CATEGORY_COUNT> usage{};
+};
+
+// Named results of a --benchmark run, written out as JSON
+class BenchmarkReport {
+public:
+    void add(const std::string& name, double value, const std::string& unit) {
+        results.push_back({ name, value, unit });
+        std::cout << name << ": " << value << ' ' << unit << '\n';
+    }
+
+    void write(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open benchmark output!");
+        }
+        file << "{\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            file << "    { \"name\": \"" << results[i].name << "\", \"value\": " << results[i].value 
+                << ", \"unit\": \"" << results[i].unit << "\" }" << (i + 1 < results.size() ? "," : "") << '\n';
+        }
+        file << "  ]\n}\n";
+    }
+
+private:
+    struct Result {
+        std::string name;
+        double value;
+        std::string unit;
+    };
+    std::vector<Result> results;
+};
+
+// CPU-side benchmarks, run with --benchmark before any window is created
+void runCpuBenchmarks(BenchmarkReport& report);
+void benchmarkCamera(BenchmarkReport& report);
+void benchmarkTransforms(BenchmarkReport& report);
+void benchmarkCulling(BenchmarkReport& report);
+void benchmarkBvh(BenchmarkReport& report);
+void benchmarkRenderQueue(BenchmarkReport& report);
+void benchmarkRenderGraph(BenchmarkReport& report);
+void benchmarkImageStates(BenchmarkReport& report);
+void benchmarkLazyAttachments(BenchmarkReport& report);
+void benchmarkResolutionScaling(BenchmarkReport& report);
+void benchmarkDeferredShading(BenchmarkReport& report);
+void benchmarkClusteredShading(BenchmarkReport& report);
+void benchmarkShadows(BenchmarkReport& report);
+void benchmarkDepthPrepass(BenchmarkReport& report);
+void benchmarkReverseZ(BenchmarkReport& report);
+void benchmarkProfiler(BenchmarkReport& report);
+void benchmarkMemoryTracker(BenchmarkReport& report);
+
+// A page copy recorded into the next frame's command buffer
+struct VirtualTextureUpload {
+    uint32_t slot;
+    VkDeviceSize stagingOffset;
+};
+
+class Application {
+public:
+    void run() {
+        initWindow();
+        initVulkan();
+        mainLoop();
+#if ENABLE_CPU_PROFILER
+        // Still capturing when the window was closed
+        if (Profiler::instance().capturing()) {
+            writeCpuTrace();
+        }
+#endif
+        writeDrawGroupReport("draw_groups.json");
+        writeMemoryReport("memory.json");
+        cleanup();
+    }
+
+private:
+    GLFWwindow* window;
+    // Instance: connect application and Vulkan library
+    VkInstance instance;
+    // The graphics card that we select to use
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    // logical device
+    VkDevice device;
+    // A queue family only stores a part of commands.
+    // The struct stores indices to different queue families that the 
+    // physical device supports, and that we need.
+    struct QueueFamilyIndices;
+    // handle to the graphics queue
+    // the queue itself is automatically created and destroyed with the 
+    // logical device, but we need a handle to it.
+    VkQueue graphicsQueue;
+    // Abstract type of surface to present rendered images to.
+    VkSurfaceKHR surface;
+    // Handle to the presentation queue
+    VkQueue presentQueue;
+    struct SwapChainSupportDetails;
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+    std::vector<VkImage> swapChainImages;
+    VkFormat swapChainImageFormat;
+    VkExtent2D swapChainExtent;
+    std::vector<VkImageView> swapChainImageViews;
+    VkRenderPass renderPass;
+    VkDescriptorSetLayout descriptorSetLayout;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline graphicsPipeline;
+    std::vector<VkFramebuffer> swapChainFramebuffers;
+    // Command pools manage the memory that is used to store 
+    // the buffers and command buffers are allocated from them
+    VkCommandPool commandPool;
+    std::vector<VkCommandBuffer> commandBuffers;
+
+    VkBuffer vertexBuffer;
+    VkDeviceMemory vertexBufferMemory;
+    VkBuffer positionBuffer;
+    VkDeviceMemory positionBufferMemory;
+    VkBuffer indexBuffer;
+    VkDeviceMemory indexBufferMemory;
+    std::vector<VkBuffer> uniformBuffers;
+    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    std::vector<void*> uniformBuffersMapped;
+    std::vector<DrawItem> drawItems;
+    // Recording order of drawItems
+    RenderQueue renderQueue;
+    std::vector<VkPipeline> pipelines;
+    std::vector<Mesh> meshes;
+    // Per-frame state change report (key R)
+    bool showRenderStats = false;
+    RenderStats renderStats;
+    RenderStats renderStatsSum;
+    uint32_t renderStatsFrames = 0;
+    std::chrono::steady_clock::time_point renderStatsReportTime;
+    // Every draw of the scene, before culling
+    std::vector<DrawItem> sceneDraws;
+    ObjectBounds drawBounds;
+    Bvh4 drawBvh;
+    std::vector<uint32_t> visibleDraws;
+    glm::dvec2 cursorPosition{ 0.0 };
+
+    std::vector<VkSemaphore> imageAvailableSemaphores;
+    std::vector<VkSemaphore> renderFinishedSemaphores;
+    // Frame n signals the value n + 1 when its commands have completed, 
+    // so the counter value is the number of completed frames.
+    VkSemaphore frameTimeline;
+    // Frames the CPU may record ahead of the GPU, 1 to MAX_FRAMES_IN_FLIGHT.
+    // Lower values trade throughput for input latency.
+    uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+
+    // Latency measurement (key L): input to GPU completion always, input 
+    // to display where display timing reports when frames were shown
+    bool measureLatency = false;
+    // When the input the current frame reacts to was polled
+    std::chrono::steady_clock::time_point inputSampleTime;
+    // Submitted frames whose completion has not been observed yet
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> latencyPending;
+    double latencySumMs = 0.0;
+    double latencyMaxMs = 0.0;
+    uint32_t latencySamples = 0;
+    // Present ids whose display time has not been reported yet
+    std::deque<std::pair<uint32_t, std::chrono::steady_clock::time_point>> displayLatencyPending;
+    double displayLatencySumMs = 0.0;
+    double displayLatencyMaxMs = 0.0;
+    uint32_t displayLatencySamples = 0;
+    std::chrono::steady_clock::time_point latencyReportTime;
+
+    PresentPolicy presentPolicy = DEFAULT_PRESENT_POLICY;
+    // Set when the policy needs a different present mode
+    bool presentPolicyChanged = false;
+    // When the frame limiter lets the next frame start
+    std::chrono::steady_clock::time_point nextFrameTime;
+    // Latency-optimized pacing: how long to sleep before sampling input,
+    // and how long the last frame blocked on the GPU or presentation engine
+    double latencySleepMs = 0.0;
+    double frameBlockedMs = 0.0;
+
+    MemoryTracker memoryTracker;
+    // VK_EXT_memory_budget, when available
+    bool memoryBudgetSupported = false;
+    std::chrono::steady_clock::time_point memoryBudgetCheckTime;
+    // Bit per heap that was last seen near its budget
+    uint32_t memoryBudgetWarnedHeaps = 0;
+
+    // VK_GOOGLE_display_timing, when available
+    bool displayTimingSupported = false;
+    PFN_vkGetRefreshCycleDurationGOOGLE pfnGetRefreshCycleDuration = nullptr;
+    PFN_vkGetPastPresentationTimingGOOGLE pfnGetPastPresentationTiming = nullptr;
+    uint32_t presentId = 0;
+    uint64_t lastActualPresentTime = 0;
+    // Measured (or reported) time between vblanks
+    double refreshIntervalMs = 1000.0 / 60.0;
+    // CPU-side fallback for present intervals
+    std::chrono::steady_clock::time_point lastPresentCallTime;
+    double presentIntervalSumMs = 0.0;
+    uint32_t presentIntervalSamples = 0;
+
+    VkDescriptorPool descriptorPool;
+    std::vector<VkDescriptorSet> descriptorSets;
+
+    // Layouts of the images outside the render graph
+    ImageStateTracker imageStates;
+
+    VkImage textureImage;
+    VkDeviceMemory textureImageMemory;
+    VkImageView textureImageView;
+    VkSampler textureSampler;
+
+    // Virtual texture: CPU-side mip levels, the physical page cache,
+    // and per-frame page tables and feedback buffers.
+    std::vector<VirtualTextureLevel> vtLevels;
+    uint32_t vtPageCount = 0;
+    VirtualTextureCache vtCache;
+    VkImage vtCacheImage;
+    VkDeviceMemory vtCacheImageMemory;
+    VkImageView vtCacheImageView;
+    VkSampler vtCacheSampler;
+    std::vector<VkBuffer> vtPageTableBuffers;
+    std::vector<VkDeviceMemory> vtPageTableBuffersMemory;
+    std::vector<void*> vtPageTableBuffersMapped;
+    std::vector<VkBuffer> vtFeedbackBuffers;
+    std::vector<VkDeviceMemory> vtFeedbackBuffersMemory;
+    std::vector<void*> vtFeedbackBuffersMapped;
+    std::vector<VkBuffer> vtStagingBuffers;
+    std::vector<VkDeviceMemory> vtStagingBuffersMemory;
+    std::vector<void*> vtStagingBuffersMapped;
+    std::vector<VirtualTextureUpload> vtPendingUploads;
+
+    // Passes and attachments of a frame, rebuilt with the swap chain.
+    // Images, views and memory slots of the graph are indexed like the 
+    // graph's images and slots; imported images have no view or memory here.
+    RenderGraph renderGraph;
+    uint32_t backbufferResource;
+    uint32_t depthResource;
+    std::vector<VkImage> renderGraphImages;
+    std::vector<VkImageView> renderGraphImageViews;
+    std::vector<VkDeviceMemory> renderGraphMemory;
+    PFN_vkCmdPipelineBarrier2KHR pfnCmdPipelineBarrier2 = nullptr;
+    // Swap chain image the graph is being recorded for
+    uint32_t recordImageIndex = 0;
+
+    // MSAA: the current sample count, and the highest one both the color 
+    // and the depth attachments support (at most 8x)
+    VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+    VkSampleCountFlagBits maxMsaaSamples = VK_SAMPLE_COUNT_1_BIT;
+    uint32_t msaaColorResource;
+
+    // GPU time of each frame, from timestamps at the start and the end of 
+    // its command buffer. Two queries per frame slot.
+    bool gpuTimingSupported = false;
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+    double timestampPeriodNs = 1.0;
+    uint64_t timestampMask = UINT64_MAX;
+    std::vector<bool> timestampsWritten;
+    std::vector<VkSampleCountFlagBits> timestampSamples;
+    double gpuFrameMs = 0.0;
+    // Indexed by log2 of the sample count
+    std::array<double, 4> msaaGpuTimeSumMs{};
+    std::array<uint32_t, 4> msaaGpuTimeFrames{};
+
+    // Depth pre-pass. Its own subpass lays down the depth of the scene 
+    // with a position-only stream, then the color subpass tests EQUAL 
+    // with writes off and shades only the visible fragment of each pixel.
+    bool enableDepthPrepass = false;
+    VkPipeline depthPrepassPipeline = VK_NULL_HANDLE;
+    // One pipeline statistics and one occlusion query per draw group and 
+    // frame slot, read back once the slot's frame has completed. Pipeline
+    // statistics need the pipelineStatisticsQuery feature, occlusion 
+    // queries are always available.
+    bool pipelineStatisticsSupported = false;
+    bool occlusionQueryPrecise = false;
+    VkQueryPool statisticsQueryPool = VK_NULL_HANDLE;
+    VkQueryPool occlusionQueryPool = VK_NULL_HANDLE;
+    // Bit per draw group recorded by each frame slot
+    std::vector<uint32_t> drawGroupsWritten;
+    std::vector<bool> statisticsPrepass;
+    // Of the last frame read back, with the groups it recorded, and 
+    // summed over the run
+    std::array<DrawGroupStats, DRAW_GROUP_COUNT> drawGroupStats{};
+    uint32_t drawGroupsRead = 0;
+    std::array<DrawGroupStats, DRAW_GROUP_COUNT> drawGroupStatsSum{};
+    std::array<uint32_t, DRAW_GROUP_COUNT> drawGroupFrames{};
+    // Fragment shader invocations of the scene group, indexed by whether 
+    // the pre-pass was on
+    std::array<double, 2> fragmentInvocationSum{};
+    std::array<uint32_t, 2> fragmentInvocationFrames{};
+
+    // Dynamic resolution. The scene color target is allocated at the full
+    // swap chain size and the scene is rendered into its top-left 
+    // renderExtent, so a new scale only changes the viewport and never 
+    // reallocates. An upscale pass then fills the swap chain image.
+    UpscaleMode upscaleMode = UpscaleMode::Off;
+    ResolutionScaler resolutionScaler{ ResolutionScaler::Settings{} };
+    VkExtent2D renderExtent{};
+    uint32_t sceneColorResource;
+    VkRenderPass upscaleRenderPass;
+    VkDescriptorSetLayout upscaleDescriptorSetLayout;
+    VkPipelineLayout upscalePipelineLayout;
+    VkPipeline upscalePipeline;
+    VkSampler upscaleSampler;
+    std::vector<VkFramebuffer> upscaleFramebuffers;
+    // One set per frame slot, pointed at the scene color view when the 
+    // slot is recorded. The view a set currently holds is kept so that it 
+    // is only written after the view was recreated.
+    std::vector<VkDescriptorSet> upscaleDescriptorSets;
+    std::vector<VkImageView> upscaleDescriptorViews;
+
+    // Lighting. The light buffer holds the largest count at rest, the 
+    // first LIGHT_COUNTS[lightCountIndex] of its lights are used.
+    ShadingPath shadingPath = ShadingPath::Forward;
+    uint32_t lightCountIndex = DEFAULT_LIGHT_COUNT_INDEX;
+    VkBuffer lightBuffer;
+    VkDeviceMemory lightBufferMemory;
+    // Written each frame by the light culling compute pass: the animated
+    // lights, read by every path, and the clusters' light lists. One of 
+    // each per frame slot.
+    std::vector<VkBuffer> frameLightBuffers;
+    std::vector<VkDeviceMemory> frameLightBuffersMemory;
+    std::vector<VkBuffer> clusterBuffers;
+    std::vector<VkDeviceMemory> clusterBuffersMemory;
+    VkDescriptorSetLayout lightCullingDescriptorSetLayout;
+    VkPipelineLayout lightCullingPipelineLayout;
+    VkPipeline lightCullingPipeline;
+    std::vector<VkDescriptorSet> lightCullingDescriptorSets;
+
+    // Sun shadows. The atlas is sampled by the scene pass; the cache keeps
+    // the static casters' depth of every cascade, along with the matrix 
+    // and the static scene version it was rendered with.
+    SkylineAllocator shadowAtlasAllocator;
+    std::array<SkylineAllocator::Rect, SHADOW_CASCADE_COUNT> cascadeRects;
+    std::array<glm::mat4, SHADOW_CASCADE_COUNT> cascadeViewProj;
+    std::array<float, SHADOW_CASCADE_COUNT> cascadeSplits;
+    std::array<glm::mat4, SHADOW_CASCADE_COUNT> cachedCascadeViewProj;
+    std::array<uint64_t, SHADOW_CASCADE_COUNT> cachedStaticVersion{};
+    // Incremented when a static draw changes
+    uint64_t staticSceneVersion = 1;
+    // Camera version the cascades were fitted to
+    uint64_t shadowCascadeVersion = 0;
+    VkFormat shadowFormat;
+    VkImage shadowAtlasImage;
+    VkDeviceMemory shadowAtlasImageMemory;
+    VkImageView shadowAtlasImageView;
+    VkImage shadowCacheImage;
+    VkDeviceMemory shadowCacheImageMemory;
+    VkImageView shadowCacheImageView;
+    VkRenderPass shadowRenderPass;
+    VkFramebuffer shadowAtlasFramebuffer;
+    VkFramebuffer shadowCacheFramebuffer;
+    VkPipelineLayout shadowPipelineLayout;
+    VkPipeline shadowPipeline = VK_NULL_HANDLE;
+    VkSampler shadowSampler;
+    // Deferred: G-buffer attachments of the render graph, and the second 
+    // subpass's pipelines, which add an ambient term and then one screen 
+    // rectangle per light. Their descriptor sets are written like the 
+    // upscale pass's.
+    uint32_t gbufferAlbedoResource;
+    uint32_t gbufferNormalResource;
+    VkDescriptorSetLayout deferredDescriptorSetLayout;
+    VkPipelineLayout deferredPipelineLayout;
+    VkPipeline deferredAmbientPipeline = VK_NULL_HANDLE;
+    VkPipeline deferredLightPipeline = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> deferredDescriptorSets;
+    std::vector<VkImageView> deferredDescriptorViews;
+    // GPU time per shading path and light count
+    std::vector<uint32_t> timestampShading;
+    std::array<double, 3 * LIGHT_COUNTS.size()> shadingGpuTimeSumMs{};
+    std::array<uint32_t, 3 * LIGHT_COUNTS.size()> shadingGpuTimeFrames{};
+
+    // Written by the GLFW callbacks on the main thread, read by the render thread
+    std::atomic<bool> framebufferResized{ false };
+    std::atomic<int> framebufferWidth{ 0 };
+    std::atomic<int> framebufferHeight{ 0 };
+    SpscQueue<InputEvent, INPUT_QUEUE_CAPACITY> inputEvents;
+
+    // Render thread only
+    Camera camera;
+    CameraController cameraController;
+    std::chrono::steady_clock::time_point lastFrameTime;
+    // Camera version last written to each frame's uniform buffer
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> uniformBufferVersions{};
+    WorkerPool workers;
+    TransformHierarchy sceneTransforms;
+    uint32_t sceneRoot;
+    // One node per quad of the index buffer
+    std::array<uint32_t, 2> quadNodes;
+    // Cleared to stop the render thread, or by it when it fails
+    std::atomic<bool> running{ false };
+
+    uint32_t currentFrame = 0;
+    // Number of frames submitted so far
+    uint64_t frameCount = 0;
+    DeletionQueue deletionQueue;
+
+    static void framebufferResizeCallback(GLFWwindow* window, int width, int height);
+    static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+    static void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+    static void cursorPosCallback(GLFWwindow* window, double x, double y);
+    static void scrollCallback(GLFWwindow* window, double xOffset, double yOffset);
+
+    void initWindow();
+    void initVulkan();
+    // The main thread only waits for window events, as GLFW requires.
+    // Frames are recorded and submitted on a render thread, so a slow event
+    // batch does not stall rendering and a slow frame does not delay input.
+    void mainLoop();
+    void renderLoop();
+    // Render thread: drain the input queue
+    void processInputEvents();
+    void handleKey(int key, int action, int mods);
+    void pickDraw(double x, double y);
+    void cleanup();
+    // REQUIRES: Null.
+    // Check and set up layers and (non-GPU-related) extension support.
+    // Layers are manually specified (e.g., validation layers), and compared 
+    // with vkEnumerateInstanceLayerProperties, which returns 
+    // global layer properties.
+    // Extension are manually specified (e.g., those required by glfw), and 
+    // compared with vkEnumerateInstanceExtensionProperties, which 
+    // typically returns extentions proviede by Vulkan implementation and 
+    // implicitly enabled layers.
+    void createInstance();
+    // Check if all required validations layers are available
+    bool checkValidationLayerSupport();
+    // Enumerate over physical devices and find a suitable one
+    // Checked by isDeviceSuitable()
+    // REQUIRES: Specific instance. We only select among GPUs that 
+    // are accessible to the previously created instance.
+    void pickPhysicsDevice();
+    // Check whether device supports required queue families,  
+    // required (device-related) extensions, and adequate swap chains.
+    bool isDeviceSuitable(VkPhysicalDevice device);
+    // Find the indices that correspond to the queue families specified in the 
+    // QueueFamilyIndices struct. It iterates over all queue families 
+    // supported by the device, and check whether they cover our requirements.
+    // For example, it should be able to not only do graphics operation, but also 
+    // present images.
+    // If all covered, isComplete on the returned struct would evaluate to true.
+    QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
+    // Create logical device and get queue handles.
+    // For each queue family, creates a queue. 
+    // Enabling (device-related) extensions.
+    void createLogicalDevice();
+    // Create surface: the (abstract) target to render images to.
+    void createSurface();
+    bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+    // We have checked the swap chain availability when choosing a physical 
+    // device. However, it may not be COMPATIBLE with our surface. 
+    // So we additionally query the physical device for its
+    //  the swap chain support details.
+    SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
+    // Choosing among supported swap chain settings. The choice is hard-coded.
+    VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats);
+    VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes);
+    VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities);
+    void createSwapChain();
+    // Create image views for each image in the swap chain
+    void createImageViews();
+    // 1. Load and create shader modules, put them in shader stages
+    // 2. Specify vertex input state
+    // 3. Describe input assembly state: What kind of geometry to draw, 
+    //    and whether to enable primitive restart: reutilization of 
+    //    vertex data by restart primitive assembly.
+    // 4. Specify viewport and scissors dimensions. Note that these are often 
+    //    set as dynamic states, and we only need to specify the count
+    //    in this scenario.
+    // 5. Set up rasterizer, who breaks vertices into fragments, plus 
+    //    depth testing, face cullinggit , and scissor test. We set depth clamp, 
+    //    polygonMode (fill polygons or just lines or points), line width, 
+    //    and cullMode. Special settings typically require enabling specific 
+    //    GPU features.
+    // 6. Set up multisampling state, which performs anti-aliasing. 
+    // 7. Set up depth and stencil testing.
+    // 8. Set up color blending.
+    // 9. Set up pipeline layout who specifies uniform values in shaders and 
+    //    push constants.
+    void createGraphicsPipeline();
+    void createPipelineLayout();
+    // Atlas and cache images, the depth-only render pass drawing into 
+    // them, the layout of the depth-only pipeline and the comparison 
+    // sampler. The pipeline is a variant built by createGraphicsPipeline.
+    void createShadowAtlas();
+    void cleanupShadowAtlas();
+    // Fit the cascades to the camera, when it changed
+    void updateShadowCascades();
+    // Static casters into the cache where a cascade moved, then the cache
+    // copied into the atlas and the dynamic casters drawn on top
+    void recordShadowPasses(VkCommandBuffer commandBuffer);
+    void drawShadowCasters(VkCommandBuffer commandBuffer, uint32_t cascade, bool staticCasters);
+    static std::vector<char> readFile(const std::string& filename);
+    VkShaderModule createShaderModule(const std::vector<char>& code);
+    // Render pass describes the resources a render pipeline will use
+    // It contains one or more subpasses, and the attachments that will be used 
+    // in these subpasses.
+    void createRenderPass();
+    // Highest sample count usable for both color and depth, up to 8x
+    VkSampleCountFlagBits getMaxUsableSampleCount();
+    // Rebuild what depends on the sample count: the render pass, the 
+    // pipelines, the render graph and the framebuffers. Objects in use by 
+    // frames in flight are retired, so the device is not drained.
+    void setSampleCount(VkSampleCountFlagBits samples);
+    // Rebuild the render pass, pipelines and targets for another path
+    void setShadingPath(ShadingPath path);
+    // Rebuild the render pass, pipelines and targets with or without the
+    // depth pre-pass subpass
+    void setDepthPrepass(bool enable);
+    void setLightCount(uint32_t index);
+    // Retire the render pass and every pipeline built for it
+    void retireRenderPassObjects();
+    // Pipelines of the deferred lighting subpass
+    void createDeferredPipelines();
+    void createDeferredDescriptorSets();
+    // The lights at rest, and the buffers the light culling pass writes
+    void createLightBuffer();
+    // Compute pipeline that animates the lights and bins them into the 
+    // clusters. It does not depend on the render pass.
+    void createLightCullingPipeline();
+    void createLightCullingDescriptorSets();
+    // Clear the clusters, dispatch the light culling pass and make its 
+    // results visible to the scene pass
+    void recordLightCulling(VkCommandBuffer commandBuffer);
+    void reportShadingFrameTimes();
+    // Switching dynamic resolution on or off changes the passes of the 
+    // graph, and so its images and the framebuffers
+    void setUpscaleMode(UpscaleMode mode);
+    // Retire and recreate the render graph images and the framebuffers
+    void rebuildRenderTargets();
+    void retireRenderTargets();
+    // Render pass, pipeline and sampler of the upscale pass. They only 
+    // depend on the swap chain format.
+    void createUpscalePipeline();
+    void createUpscaleDescriptorSets();
+    // Size of the scene viewport, from the current render scale
+    void updateRenderExtent();
+    void createFramebuffers();
+    void createCommandPool();
+    void createCommandBuffer();
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+    // Body of the scene pass of the render graph
+    void recordScenePass(VkCommandBuffer commandBuffer);
+    // Depth of every draw of the render queue, in the pre-pass subpass
+    void recordDepthPrepass(VkCommandBuffer commandBuffer);
+    void recordUpscalePass(VkCommandBuffer commandBuffer);
+    /*
+    Steps to render a frame:
+        Wait for the previous frame to finish
+        Acquire an image from the swap chain
+        Record a command buffer which draws the scene onto that image
+        Submit the recorded command buffer
+        Present the swap chain image
+    */
+    void drawFrame();
+    void createSyncObjects();
+    void createTimestampQueries();
+    // Read the GPU time of the frame that last used the current slot.
+    // Returns whether a new time was read.
+    bool readGpuFrameTime();
+    void createStatisticsQueries();
+    // Queries around the draws of a group. Queries begun in a render pass
+    // must end in the same subpass.
+    void beginDrawGroup(VkCommandBuffer commandBuffer, DrawGroup group);
+    void endDrawGroup(VkCommandBuffer commandBuffer, DrawGroup group);
+    // Read the queries of the frame that last used the current slot
+    void readPipelineStatistics();
+    void reportFragmentInvocations();
+    // Averages per draw group over the run, in the --benchmark JSON format
+    void writeDrawGroupReport(const std::string& filename);
+#if ENABLE_CPU_PROFILER
+    // Ends the capture started with T and writes it to cpu_trace.json
+    void writeCpuTrace();
+#endif
+    void reportMsaaFrameTimes();
+    // Drain the GPU and switch to a different frame queue depth
+    void setFramesInFlight(uint32_t count);
+    // Match completed frames with the time their input was sampled
+    void trackLatency();
+    // Sleep before sampling input, as required by the present policy
+    void paceFrame();
+    // Record the interval between this present and the last one, from 
+    // display timing when available, else from CPU timestamps. With display
+    // timing, also match displayed frames with their input sample time.
+    void trackPresentTiming();
+    void setPresentPolicy(PresentPolicy policy);
+    bool isDeviceExtensionAvailable(VkPhysicalDevice device, const char* extensionName);
+    // Create a new swap chain from the old one without waiting for the device.
+    // The old swap chain and everything built on it are retired to the 
+    // deletion queue, so frames in flight keep rendering to them.
+    void recreateSwapChain();
+    // Move the swap chain image views, framebuffers and depth resources into
+    // the deletion queue. swapChain itself stays valid until createSwapChain
+    // has passed it as oldSwapchain.
+    void retireSwapChain();
+    // Frame-delayed destruction. These may be called at any time, including
+    // while the object is used by frames in flight: it is destroyed once 
+    // every frame submitted before the call has completed.
+    void retireImage(VkImage image, VkImageView imageView, VkDeviceMemory memory);
+    void retirePipeline(VkPipeline pipeline);
+    void retireFramebuffer(VkFramebuffer framebuffer);
+    void retireRenderPass(VkRenderPass pass);
+    // Number of submitted frames the GPU has finished
+    uint64_t completedFrameCount();
+    void cleanupSwapChain();
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory, MemoryCategory category);
+    // All device memory is allocated and freed through these, so that 
+    // memoryTracker sees every allocation
+    VkResult allocateMemory(VkDeviceSize size, uint32_t memoryTypeIndex, MemoryCategory category, VkDeviceMemory& memory);
+    void freeMemory(VkDeviceMemory memory);
+    // Heap sizes, plus budget and usage if VK_EXT_memory_budget is enabled
+    void queryMemoryBudget(VkPhysicalDeviceMemoryProperties& properties, VkPhysicalDeviceMemoryBudgetPropertiesEXT& budget);
+    // Tracked bytes per heap and category next to the budget, in the 
+    // --benchmark JSON format
+    void writeMemoryReport(const std::string& filename);
+    // At most once a second. Warns once per heap when it nears its budget.
+    void checkMemoryBudget();
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
+    void createVertexBuffer();
+    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags = VK_IMAGE_ASPECT_COLOR_BIT);
+    VkCommandBuffer beginSingleTimeCommands();
+    void endSingleTimeCommands(VkCommandBuffer commandBuffer);
+    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+    void copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+    void createIndexBuffer();
+    void createDescriptorSetLayout();
+    void createUniformBuffers();
+    void updateUniformBuffer(uint32_t currentImage);
+    // Per-object transforms for this frame, recorded as push constants
+    void createSceneTransforms();
+    void updateDrawItems();
+    void reportRenderStats();
+    void createDescriptorPool();
+    void createDescriptorSets();
+    void createImage(uint32_t width, uint32_t height, 
+        VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, 
+        VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, MemoryCategory category);
+    void createTextureImage();
+    void createTextureImageView();
+    void createTextureSampler();
+    // Build the mip chain of the texture on the CPU, cut it into pages, and
+    // create the physical page cache with the coarsest page pinned in it.
+    // The page table maps every page to a cache slot; the fragment shader
+    // walks up the mips until it finds a resident page, and records the
+    // page it wanted in a feedback buffer.
+    void createVirtualTexture();
+    // Read back the feedback written by the frame that last used this slot,
+    // update the LRU cache and stage the missing pages for upload.
+    // Must run after the frame's fence has been waited on.
+    void updateVirtualTexture(uint32_t currentImage);
+    void recordVirtualTextureUploads(VkCommandBuffer commandBuffer);
+    // Copy the texels of a page into dst (VT_PAGE_SIZE^2 RGBA8 texels),
+    // clamping to the edge of the level for partial pages.
+    void readVirtualTexturePage(uint32_t page, stbi_uc* dst);
+    void copyPageToCache(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, uint32_t slot);
+    void cleanupVirtualTexture();
+    // Declare the frame's passes, compile the graph and create its 
+    // transient images. Depends on the swap chain extent.
+    void createRenderGraph();
+    void destroyRenderGraphImages(bool retire);
+    VkFormat findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
+    VkFormat findDepthFormat();
+    bool hasStencilComponent(VkFormat format);
+};
+
+int main(int argc, char* argv[]) {
+    bool benchmark = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = true;
+        }
+    }
+
+    if (benchmark) {
+        try {
+            BenchmarkReport report;
+            runCpuBenchmarks(report);
+            report.write("benchmark.json");
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    Application app;
+
+    try {
+        app.run();
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+
+struct Application::QueueFamilyIndices {
+    // optional: evaluate to false until assigned any value
+    std::optional<uint32_t> graphicsFamily;
+    std::optional<uint32_t> presentFamily;
+
+    bool isComplete() {
+        return graphicsFamily.has_value() && presentFamily.has_value();
+    }
+};
+
+struct Application:: SwapChainSupportDetails {
+    // Min/max number of images in the swap chain, and w/h limits of images.
+    VkSurfaceCapabilitiesKHR capabilities;
+    // The surface format
+    std::vector<VkSurfaceFormatKHR> formats;
+    // Available presentation modes
+    std::vector<VkPresentModeKHR> presentModes;
+};
+
+void Application::framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
+    app->framebufferWidth = width;
+    app->framebufferHeight = height;
+    app->framebufferResized = true;
+}
+
+void Application::keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
+    // Dropped if the render thread is too far behind
+    app->inputEvents.push({ InputEvent::Type::Key, key, action, mods, 0.0, 0.0 });
+}
+
+void Application::mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
+    app->inputEvents.push({ InputEvent::Type::MouseButton, button, action, mods, 0.0, 0.0 });
+}
+
+void Application::cursorPosCallback(GLFWwindow* window, double x, double y) {
+    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
+    app->inputEvents.push({ InputEvent::Type::CursorPosition, 0, 0, 0, x, y });
+}
+
+void Application::scrollCallback(GLFWwindow* window, double xOffset, double yOffset) {
+    auto app = reinterpret_cast<Application*>(glfwGetWindowUserPointer(window));
+    app->inputEvents.push({ InputEvent::Type::Scroll, 0, 0, 0, xOffset, yOffset });
+}
+
+void Application::processInputEvents() {
+    PROFILE_ZONE("processInputEvents");
+    InputEvent event;
+    while (inputEvents.pop(event)) {
+        switch (event.type) {
+        case InputEvent::Type::Key:
+            cameraController.onKey(event.code, event.action);
+            handleKey(event.code, event.action, event.mods);
+            break;
+        case InputEvent::Type::MouseButton:
+            cameraController.onMouseButton(event.code, event.action);
+            if (event.code == GLFW_MOUSE_BUTTON_LEFT && event.action == GLFW_PRESS) {
+                pickDraw(cursorPosition.x, cursorPosition.y);
+            }
+            break;
+        case InputEvent::Type::CursorPosition:
+            cameraController.onCursor(event.x, event.y);
+            cursorPosition = glm::dvec2(event.x, event.y);
+            break;
+        case InputEvent::Type::Scroll:
+            cameraController.onScroll(event.y);
+            break;
+        }
+    }
+}
+
+void Application::handleKey(int key, int action, int mods) {
+    if (action != GLFW_PRESS) {
+        return;
+    }
+    if (key >= GLFW_KEY_1 && key <= GLFW_KEY_4) {
+        setFramesInFlight(static_cast<uint32_t>(key - GLFW_KEY_1 + 1));
+    } else if (key == GLFW_KEY_P) {
+        setPresentPolicy(static_cast<PresentPolicy>((static_cast<int>(presentPolicy) + 1) % 4));
+    } else if (key == GLFW_KEY_L) {
+        measureLatency = !measureLatency;
+        latencyPending.clear();
+        latencySumMs = latencyMaxMs = 0.0;
+        latencySamples = 0;
+        displayLatencyPending.clear();
+        displayLatencySumMs = displayLatencyMaxMs = 0.0;
+        displayLatencySamples = 0;
+        presentIntervalSumMs = 0.0;
+        presentIntervalSamples = 0;
+        latencyReportTime = std::chrono::steady_clock::now();
+        std::cout << "latency measurement " << (measureLatency ? "on" : "off") << '\n';
+    } else if (key == GLFW_KEY_M) {
+        // 1x, 2x, 4x, 8x, back to 1x
+        uint32_t next = static_cast<uint32_t>(msaaSamples) * 2;
+        setSampleCount(next > static_cast<uint32_t>(maxMsaaSamples) ? VK_SAMPLE_COUNT_1_BIT : static_cast<VkSampleCountFlagBits>(next));
+    } else if (key == GLFW_KEY_G) {
+        // Forward, clustered, deferred, back to forward
+        setShadingPath(static_cast<ShadingPath>((static_cast<int>(shadingPath) + 1) % 3));
+    } else if (key == GLFW_KEY_Z) {
+        setDepthPrepass(!enableDepthPrepass);
+    } else if (key == GLFW_KEY_K) {
+        setLightCount((lightCountIndex + 1) % LIGHT_COUNTS.size());
+    } else if (key == GLFW_KEY_U) {
+        setUpscaleMode(static_cast<UpscaleMode>((static_cast<int>(upscaleMode) + 1) % 3));
+    } else if (key == GLFW_KEY_R) {
+        showRenderStats = !showRenderStats;
+        renderStatsSum = RenderStats{};
+        renderStatsFrames = 0;
+        renderStatsReportTime = std::chrono::steady_clock::now();
+        std::cout << "render stats " << (showRenderStats ? "on" : "off") << '\n';
+    } else if (key == GLFW_KEY_B) {
+        writeMemoryReport("memory.json");
+    } else if (key == GLFW_KEY_T) {
+#if ENABLE_CPU_PROFILER
+        if (Profiler::instance().capturing()) {
+            writeCpuTrace();
+        } else {
+            Profiler::instance().beginCapture();
+            std::cout << "cpu trace started\n";
+        }
+#endif
+    }
+}
+
+// Report the draw under the cursor, by casting a ray from the near plane 
+// through the BVH of the last frame's draws
+void Application::pickDraw(double x, double y) {
+    if (swapChainExtent.width == 0 || swapChainExtent.height == 0) {
+        return;
+    }
+    // The y flip in the projection makes NDC y point down, like the cursor
+    glm::vec2 ndc(2.0 * x / swapChainExtent.width - 1.0, 2.0 * y / swapChainExtent.height - 1.0);
+    glm::mat4 inverseViewProj = glm::inverse(camera.getViewProj());
+    // Reverse-Z: the near plane is at depth 1, and depth 0 is at infinity,
+    // so the direction is taken to a point at twice the near distance
+    glm::vec4 nearPoint = inverseViewProj * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProj * glm::vec4(ndc, 0.5f, 1.0f);
+    glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+    float distance;
+    uint32_t hit = drawBvh.raycast(origin, direction, drawBounds, distance);
+    if (hit == Bvh4::NO_HIT) {
+        std::cout << "picked nothing" << std::endl;
+    } else {
+        std::cout << "picked draw " << hit << " at distance " << distance << std::endl;
+    }
+}
+
+void Application::initWindow() {
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+
+    window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+    glfwSetWindowUserPointer(window, this);
+    glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+    glfwSetKeyCallback(window, keyCallback);
+    glfwSetMouseButtonCallback(window, mouseButtonCallback);
+    glfwSetCursorPosCallback(window, cursorPosCallback);
+    glfwSetScrollCallback(window, scrollCallback);
+    if (!window) {
+        std::cout << "Creating glfw window error!\n";
+    }
+    // Only the main thread may query GLFW, so the size is tracked for the 
+    // render thread from here on
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    framebufferWidth = width;
+    framebufferHeight = height;
+}
+
+void Application::initVulkan() {
+    createInstance();
+    createSurface();
+    pickPhysicsDevice();
     createLogicalDevice();
     createSwapChain();
     createImageViews();
     createRenderPass();
     createDescriptorSetLayout();
+    createPipelineLayout();
+    createShadowAtlas();
     createGraphicsPipeline();
+    createUpscalePipeline();
+    createLightCullingPipeline();
     createCommandPool();
-    createDepthResources();
+    createRenderGraph();
     createFramebuffers();
     createTextureImage();
     createTextureImageView();
     createTextureSampler();
+    createVirtualTexture();
     createVertexBuffer();
     createIndexBuffer();
+    createLightBuffer();
     createUniformBuffers();
     createDescriptorPool();
     createDescriptorSets();
+    createUpscaleDescriptorSets();
+    createDeferredDescriptorSets();
+    createLightCullingDescriptorSets();
     createCommandBuffer();
+    createTimestampQueries();
+    createStatisticsQueries();
     createSyncObjects();
+    createSceneTransforms();
 }
 
 void Application::mainLoop() {
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        drawFrame();
+    running = true;
+    std::exception_ptr renderError;
+    std::thread renderThread([this, &renderError]() {
+        try {
+            renderLoop();
+        } catch (...) {
+            renderError = std::current_exception();
+        }
+        running = false;
+        // Wake the main thread up from glfwWaitEvents
+        glfwPostEmptyEvent();
+    });
+
+    while (running && !glfwWindowShouldClose(window)) {
+        glfwWaitEvents();
     }
+    running = false;
+    renderThread.join();
 
     vkDeviceWaitIdle(device);
+    if (renderError) {
+        std::rethrow_exception(renderError);
+    }
+}
+
+void Application::renderLoop() {
+    PROFILE_THREAD("render");
+    lastFrameTime = std::chrono::steady_clock::now();
+    while (running) {
+        paceFrame();
+        processInputEvents();
+        auto now = std::chrono::steady_clock::now();
+        cameraController.update(camera, std::chrono::duration<float>(now - lastFrameTime).count());
+        lastFrameTime = now;
+        inputSampleTime = std::chrono::steady_clock::now();
+        drawFrame();
+    }
 }
 
 void Application::cleanup() {
+    if (gpuTimingSupported) {
+        reportMsaaFrameTimes();
+        reportShadingFrameTimes();
+    }
+    // The device is idle at this point
+    deletionQueue.flush(UINT64_MAX);
     cleanupSwapChain();
 
+    cleanupVirtualTexture();
+    cleanupShadowAtlas();
     vkDestroySampler(device, textureSampler, nullptr);
     vkDestroyImageView(device, textureImageView, nullptr);
+    vkDestroySampler(device, upscaleSampler, nullptr);
 
+    imageStates.forget(textureImage);
     vkDestroyImage(device, textureImage, nullptr);
-    vkFreeMemory(device, textureImageMemory, nullptr);
+    freeMemory(textureImageMemory);
 
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-        vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
+        freeMemory(uniformBuffersMemory[i]);
     }
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
     vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, upscaleDescriptorSetLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, deferredDescriptorSetLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, lightCullingDescriptorSetLayout, nullptr);
+    vkDestroyBuffer(device, lightBuffer, nullptr);
+    freeMemory(lightBufferMemory);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        vkDestroyBuffer(device, frameLightBuffers[i], nullptr);
+        freeMemory(frameLightBuffersMemory[i]);
+        vkDestroyBuffer(device, clusterBuffers[i], nullptr);
+        freeMemory(clusterBuffersMemory[i]);
+    }
     vkDestroyBuffer(device, indexBuffer, nullptr);
-    vkFreeMemory(device, indexBufferMemory, nullptr);
+    freeMemory(indexBufferMemory);
     vkDestroyBuffer(device, vertexBuffer, nullptr);
-    vkFreeMemory(device, vertexBufferMemory, nullptr);
+    freeMemory(vertexBufferMemory);
+    vkDestroyBuffer(device, positionBuffer, nullptr);
+    freeMemory(positionBufferMemory);
 
     vkDestroyPipeline(device, graphicsPipeline, nullptr);
+    vkDestroyPipeline(device, depthPrepassPipeline, nullptr);
+    vkDestroyPipeline(device, deferredAmbientPipeline, nullptr);
+    vkDestroyPipeline(device, deferredLightPipeline, nullptr);
+    vkDestroyPipeline(device, shadowPipeline, nullptr);
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyPipelineLayout(device, deferredPipelineLayout, nullptr);
+    vkDestroyPipeline(device, lightCullingPipeline, nullptr);
+    vkDestroyPipelineLayout(device, lightCullingPipelineLayout, nullptr);
     vkDestroyRenderPass(device, renderPass, nullptr);
+    vkDestroyPipeline(device, upscalePipeline, nullptr);
+    vkDestroyPipelineLayout(device, upscalePipelineLayout, nullptr);
+    vkDestroyRenderPass(device, upscaleRenderPass, nullptr);
 
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
         vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-        vkDestroyFence(device, inFlightFences[i], nullptr);
     }
+    vkDestroySemaphore(device, frameTimeline, nullptr);
+    if (gpuTimingSupported) {
+        vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+    }
+    if (pipelineStatisticsSupported) {
+        vkDestroyQueryPool(device, statisticsQueryPool, nullptr);
+    }
+    vkDestroyQueryPool(device, occlusionQueryPool, nullptr);
     vkDestroyCommandPool(device, commandPool, nullptr);
+    if (memoryTracker.liveAllocations() > 0) {
+        std::cerr << "leaked " << memoryTracker.liveAllocations() << " device memory allocations, " 
+            << memoryTracker.liveBytes() / (1024.0 * 1024.0) << " MiB\n";
+    }
     vkDestroyDevice(device, nullptr);
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
@@ -447,7 +4378,8 @@ void Application::createInstance() {
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    // 1.2 for timeline semaphores
+    appInfo.apiVersion = VK_API_VERSION_1_2;
 
     // Required, specify global extensions and validation layers to use
     VkInstanceCreateInfo createInfo{};
@@ -554,6 +4486,20 @@ void Application::pickPhysicsDevice() {
     VkPhysicalDeviceProperties deviceProperties;
     vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
     std::cout << "Graphcics card selected: " << deviceProperties.deviceName << '\n';
+    maxMsaaSamples = getMaxUsableSampleCount();
+}
+
+VkSampleCountFlagBits Application::getMaxUsableSampleCount() {
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+    VkSampleCountFlags counts = deviceProperties.limits.framebufferColorSampleCounts & 
+        deviceProperties.limits.framebufferDepthSampleCounts;
+    for (VkSampleCountFlagBits samples : { VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT }) {
+        if (counts & samples) {
+            return samples;
+        }
+    }
+    return VK_SAMPLE_COUNT_1_BIT;
 }
 
 bool Application::isDeviceSuitable(VkPhysicalDevice device) {
@@ -567,8 +4513,23 @@ bool Application::isDeviceSuitable(VkPhysicalDevice device) {
 
     VkPhysicalDeviceFeatures supportedFeatures;
     vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
-    QueueFamilyIndices indices = findQueueFamilies(device);
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(device, &deviceProperties);
+    VkPhysicalDeviceVulkan12Features supportedFeatures12{};
+    supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceSynchronization2FeaturesKHR supportedSynchronization2{};
+    supportedSynchronization2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+    supportedFeatures12.pNext = &supportedSynchronization2;
+    VkPhysicalDeviceFeatures2 supportedFeatures2{};
+    supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures2.pNext = &supportedFeatures12;
     bool extensionsSupported = checkDeviceExtensionSupport(device);
+    // The synchronization2 feature struct may only be queried when the 
+    // extension is there
+    if (deviceProperties.apiVersion >= VK_API_VERSION_1_2 && extensionsSupported) {
+        vkGetPhysicalDeviceFeatures2(device, &supportedFeatures2);
+    }
+    QueueFamilyIndices indices = findQueueFamilies(device);
 
     bool swapChainAdequate = false;
     if (extensionsSupported) {
@@ -576,7 +4537,12 @@ bool Application::isDeviceSuitable(VkPhysicalDevice device) {
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
     }
 
-    return indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy;;
+    // The virtual texture feedback is written from the fragment shader
+    bool featuresSupported = supportedFeatures.samplerAnisotropy && 
+        (!enableVirtualTexturing || supportedFeatures.fragmentStoresAndAtomics) &&
+        supportedFeatures12.timelineSemaphore && supportedSynchronization2.synchronization2;
+
+    return indices.isComplete() && extensionsSupported && swapChainAdequate && featuresSupported;
 }
 
 Application::QueueFamilyIndices
@@ -624,6 +4590,15 @@ void Application::createLogicalDevice() {
     }
     VkPhysicalDeviceFeatures deviceFeatures{};
     deviceFeatures.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.fragmentStoresAndAtomics = enableVirtualTexturing ? VK_TRUE : VK_FALSE;
+    // Optional, only the draw group instrumentation needs them. Without 
+    // precise occlusion queries any nonzero sample count may read as 1.
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+    pipelineStatisticsSupported = supportedFeatures.pipelineStatisticsQuery == VK_TRUE;
+    deviceFeatures.pipelineStatisticsQuery = pipelineStatisticsSupported ? VK_TRUE : VK_FALSE;
+    occlusionQueryPrecise = supportedFeatures.occlusionQueryPrecise == VK_TRUE;
+    deviceFeatures.occlusionQueryPrecise = occlusionQueryPrecise ? VK_TRUE : VK_FALSE;
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
@@ -631,6 +4606,16 @@ void Application::createLogicalDevice() {
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
+    // Features added after 1.0 are enabled through the pNext chain
+    VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+    deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    deviceFeatures12.timelineSemaphore = VK_TRUE;
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+    synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+    synchronization2Features.synchronization2 = VK_TRUE;
+    deviceFeatures12.pNext = &synchronization2Features;
+    createInfo.pNext = &deviceFeatures12;
+
     // There is no longer a need to create device specific validation layers 
     // in addition to instance specific ones, but we keep it here for learning 
     // purpose. The same code appeared in createInstance, which really takes 
@@ -645,14 +4630,50 @@ void Application::createLogicalDevice() {
     }
 
     // Enabling device-related extensions
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    std::vector<const char*> enabledExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    for (const char* extension : optionalDeviceExtensions) {
+        if (isDeviceExtensionAvailable(physicalDevice, extension)) {
+            enabledExtensions.push_back(extension);
+        }
+    }
+    displayTimingSupported = isDeviceExtensionAvailable(physicalDevice, VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME);
+    memoryBudgetSupported = isDeviceExtensionAvailable(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+    createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
     if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &device) != VK_SUCCESS) {
         throw std::runtime_error("failed to create logical device!");
     }
     vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
     vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+    pfnCmdPipelineBarrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(
+        vkGetDeviceProcAddr(device, "vkCmdPipelineBarrier2KHR"));
+    if (!pfnCmdPipelineBarrier2) {
+        throw std::runtime_error("failed to load vkCmdPipelineBarrier2KHR!");
+    }
+
+    if (displayTimingSupported) {
+        pfnGetRefreshCycleDuration = reinterpret_cast<PFN_vkGetRefreshCycleDurationGOOGLE>(
+            vkGetDeviceProcAddr(device, "vkGetRefreshCycleDurationGOOGLE"));
+        pfnGetPastPresentationTiming = reinterpret_cast<PFN_vkGetPastPresentationTimingGOOGLE>(
+            vkGetDeviceProcAddr(device, "vkGetPastPresentationTimingGOOGLE"));
+        displayTimingSupported = pfnGetRefreshCycleDuration && pfnGetPastPresentationTiming;
+    }
+    std::cout << "present timing: " << (displayTimingSupported ? "VK_GOOGLE_display_timing" : "CPU timestamps") << '\n';
+}
+
+bool Application::isDeviceExtensionAvailable(VkPhysicalDevice device, const char* extensionName) {
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+    for (const auto& extension : availableExtensions) {
+        if (strcmp(extension.extensionName, extensionName) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void Application::createSurface() {
@@ -732,9 +4753,26 @@ VkSurfaceFormatKHR Application::chooseSwapSurfaceFormat(const std::vector<VkSurf
 }
 
 VkPresentModeKHR Application::chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
-    for (const auto & availablePresentMode : availablePresentModes) {
-        if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
-            return availablePresentMode;
+    // In order of preference. FIFO is always available and ends every list.
+    std::vector<VkPresentModeKHR> preferred;
+    switch (presentPolicy) {
+    case PresentPolicy::VSync:
+    case PresentPolicy::LatencyOptimized:
+        // The latency-optimized pacing relies on FIFO blocking once per vblank
+        preferred = { VK_PRESENT_MODE_FIFO_KHR };
+        break;
+    case PresentPolicy::Uncapped:
+        preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_KHR };
+        break;
+    case PresentPolicy::FixedFps:
+        // The limiter paces the frames, so the present mode should not block
+        preferred = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_FIFO_KHR };
+        break;
+    }
+
+    for (auto presentMode : preferred) {
+        if (std::find(availablePresentModes.begin(), availablePresentModes.end(), presentMode) != availablePresentModes.end()) {
+            return presentMode;
         }
     }
 
@@ -747,11 +4785,12 @@ VkExtent2D Application::chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabil
     if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
         return capabilities.currentExtent;
     } else {
-        int width, height;
         // Vulkan works with pixels, but 
         // screen coordinates may not correspond to pixels.
-        // This queries the actual resolution of the window in pixel.
-        glfwGetFramebufferSize(window, &width, &height);
+        // This is the actual resolution of the window in pixel, as last
+        // reported to the main thread.
+        int width = framebufferWidth;
+        int height = framebufferHeight;
 
         VkExtent2D actualExtent = {
             static_cast<uint32_t>(width),
@@ -804,56 +4843,477 @@ void Application::createSwapChain() {
         createInfo.pQueueFamilyIndices = nullptr; // Optional
     }
 
-    createInfo.preTransform = swapChainSupport.capabilities.currentTransform;
-    createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    createInfo.presentMode = presentMode;
-    createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    createInfo.preTransform = swapChainSupport.capabilities.currentTransform;
+    createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    createInfo.presentMode = presentMode;
+    createInfo.clipped = VK_TRUE;
+    // Handing over the old swap chain lets the implementation reuse its
+    // resources and keep presenting the images already queued on it
+    createInfo.oldSwapchain = swapChain;
+
+    if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create swap chain!");
+    }
+
+    vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
+    swapChainImages.resize(imageCount);
+    vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
+    swapChainImageFormat = surfaceFormat.format;
+    swapChainExtent = extent;
+    camera.setAspect(extent.width / (float)extent.height);
+
+    if (displayTimingSupported) {
+        VkRefreshCycleDurationGOOGLE refreshCycle{};
+        if (pfnGetRefreshCycleDuration(device, swapChain, &refreshCycle) == VK_SUCCESS && refreshCycle.refreshDuration > 0) {
+            refreshIntervalMs = refreshCycle.refreshDuration / 1e6;
+        }
+    }
+    // Timings of the old swap chain are not comparable
+    lastActualPresentTime = 0;
+}
+
+void Application::createImageViews() {
+    swapChainImageViews.resize(swapChainImages.size());
+
+    for (uint32_t i = 0; i < swapChainImages.size(); i++) {
+        swapChainImageViews[i] = createImageView(swapChainImages[i], swapChainImageFormat);
+    }
+}
+
+void Application::createGraphicsPipeline() {
+    auto vertShaderCode = readFile("shaders/vert.spv");
+    auto fragShaderCode = readFile("shaders/frag.spv");
+    VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
+    VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vertShaderStageInfo.module = vertShaderModule;
+    vertShaderStageInfo.pName = "main";
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    fragShaderStageInfo.module = fragShaderModule;
+    fragShaderStageInfo.pName = "main";
+    // Specialization constants are fixed at pipeline creation, so the
+    // fragment shader compiles out the texturing and shading paths that 
+    // are not in use.
+    bool deferred = shadingPath == ShadingPath::Deferred;
+    bool clustered = shadingPath == ShadingPath::Clustered;
+    std::array<VkBool32, 3> specializationData = { enableVirtualTexturing ? VK_TRUE : VK_FALSE, 
+        deferred ? VK_TRUE : VK_FALSE, clustered ? VK_TRUE : VK_FALSE };
+    std::array<VkSpecializationMapEntry, 3> specializationEntries{};
+    for (uint32_t i = 0; i < specializationEntries.size(); i++) {
+        specializationEntries[i].constantID = i;
+        specializationEntries[i].offset = i * sizeof(VkBool32);
+        specializationEntries[i].size = sizeof(VkBool32);
+    }
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+    specializationInfo.pMapEntries = specializationEntries.data();
+    specializationInfo.dataSize = sizeof(specializationData);
+    specializationInfo.pData = specializationData.data();
+    fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
+    VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    auto bindingDescription = Vertex::getBindingDescription();
+    auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    VkPipelineViewportStateCreateInfo viewportState{};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterizer.depthBiasEnable = VK_FALSE;
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    // Reverse-Z: nearer is greater. After a pre-pass the depth buffer 
+    // already holds the nearest surface, so only the fragment of that 
+    // surface passes and nothing is written.
+    depthStencil.depthWriteEnable = enableDepthPrepass ? VK_FALSE : VK_TRUE;
+    depthStencil.depthCompareOp = enableDepthPrepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_GREATER;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.minDepthBounds = 0.0f; // Optional
+    depthStencil.maxDepthBounds = 1.0f; // Optional
+    depthStencil.stencilTestEnable = VK_FALSE;
+    depthStencil.front = {}; // Optional
+    depthStencil.back = {}; // Optional
+
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = msaaSamples;
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = VK_FALSE;
+    // The G-buffer subpass writes albedo and normal
+    std::array<VkPipelineColorBlendAttachmentState, 2> colorBlendAttachments = { colorBlendAttachment, colorBlendAttachment };
+
+    VkPipelineColorBlendStateCreateInfo colorBlending{};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.logicOp = VK_LOGIC_OP_COPY;
+    colorBlending.attachmentCount = deferred ? 2 : 1;
+    colorBlending.pAttachments = colorBlendAttachments.data();
+    colorBlending.blendConstants[0] = 0.0f;
+    colorBlending.blendConstants[1] = 0.0f;
+    colorBlending.blendConstants[2] = 0.0f;
+    colorBlending.blendConstants[3] = 0.0f;
+
+    std::vector<VkDynamicState> dynamicStates = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = nullptr; // Optional
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+
+    pipelineInfo.layout = pipelineLayout;
+
+    pipelineInfo.renderPass = renderPass;
+    // The pre-pass comes first when enabled
+    pipelineInfo.subpass = enableDepthPrepass ? 1 : 0;
+
+    pipelineInfo.pDepthStencilState = &depthStencil;
+
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
+    pipelineInfo.basePipelineIndex = -1; // Optional
+
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create graphics pipeline!");
+    }
+    pipelines.push_back(graphicsPipeline);
+
+    // The depth-only variants read the position stream and write depth, 
+    // and have no fragment shader and no color
+    auto positionBindingDescription = Vertex::getPositionBindingDescription();
+    auto positionAttributeDescription = Vertex::getPositionAttributeDescription();
+    vertexInputInfo.pVertexBindingDescriptions = &positionBindingDescription;
+    vertexInputInfo.vertexAttributeDescriptionCount = 1;
+    vertexInputInfo.pVertexAttributeDescriptions = &positionAttributeDescription;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_GREATER;
+    colorBlending.attachmentCount = 0;
+
+    // Depth pre-pass: same transform and culling as the color pass, so 
+    // that EQUAL matches exactly
+    if (enableDepthPrepass) {
+        auto prepassShaderCode = readFile("shaders/depth_prepass_vert.spv");
+        VkShaderModule prepassShaderModule = createShaderModule(prepassShaderCode);
+        VkPipelineShaderStageCreateInfo prepassStageInfo = vertShaderStageInfo;
+        prepassStageInfo.module = prepassShaderModule;
+        pipelineInfo.stageCount = 1;
+        pipelineInfo.pStages = &prepassStageInfo;
+        pipelineInfo.subpass = 0;
+        if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &depthPrepassPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create depth pre-pass pipeline!");
+        }
+        vkDestroyShaderModule(device, prepassShaderModule, nullptr);
+    }
+
+    // Shadow passes: both faces, and a slope-scaled bias against shadow 
+    // acne. Their orthographic depth is linear, so it stays standard Z.
+    // Built once: the shadow render pass outlives the scene's, and neither
+    // the shading path nor MSAA changes this variant.
+    if (shadowPipeline == VK_NULL_HANDLE) {
+        auto shadowShaderCode = readFile("shaders/shadow_vert.spv");
+        VkShaderModule shadowShaderModule = createShaderModule(shadowShaderCode);
+        VkPipelineShaderStageCreateInfo shadowStageInfo = vertShaderStageInfo;
+        shadowStageInfo.module = shadowShaderModule;
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.depthBiasEnable = VK_TRUE;
+        rasterizer.depthBiasConstantFactor = 1.0f;
+        rasterizer.depthBiasSlopeFactor = 1.5f;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        pipelineInfo.stageCount = 1;
+        pipelineInfo.pStages = &shadowStageInfo;
+        pipelineInfo.layout = shadowPipelineLayout;
+        pipelineInfo.renderPass = shadowRenderPass;
+        pipelineInfo.subpass = 0;
+        if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &shadowPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create shadow pipeline!");
+        }
+
+        vkDestroyShaderModule(device, shadowShaderModule, nullptr);
+    }
+    vkDestroyShaderModule(device, fragShaderModule, nullptr);
+    vkDestroyShaderModule(device, vertShaderModule, nullptr);
+
+    if (deferred) {
+        createDeferredPipelines();
+    }
+}
+
+void Application::createDeferredPipelines() {
+    auto fullscreenShaderCode = readFile("shaders/fullscreen_vert.spv");
+    auto ambientShaderCode = readFile("shaders/deferred_ambient_frag.spv");
+    auto lightVertShaderCode = readFile("shaders/deferred_light_vert.spv");
+    auto lightFragShaderCode = readFile("shaders/deferred_light_frag.spv");
+    VkShaderModule fullscreenShaderModule = createShaderModule(fullscreenShaderCode);
+    VkShaderModule ambientShaderModule = createShaderModule(ambientShaderCode);
+    VkShaderModule lightVertShaderModule = createShaderModule(lightVertShaderCode);
+    VkShaderModule lightFragShaderModule = createShaderModule(lightFragShaderCode);
+    VkPipelineShaderStageCreateInfo shaderStages[2]{};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].pName = "main";
+
+    // Both generate their vertices from the vertex and instance indices
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    VkPipelineViewportStateCreateInfo viewportState{};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    // Lights add up on top of the ambient term. The color attachment is 
+    // cleared, so the ambient pass blends the same way.
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = VK_TRUE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending{};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
+
+    // No depth test: the light pass reads depth as an input attachment
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = deferredPipelineLayout;
+    pipelineInfo.renderPass = renderPass;
+    // After the G-buffer subpass, and the pre-pass when enabled
+    pipelineInfo.subpass = enableDepthPrepass ? 2 : 1;
+
+    shaderStages[0].module = fullscreenShaderModule;
+    shaderStages[1].module = ambientShaderModule;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &deferredAmbientPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create deferred ambient pipeline!");
+    }
+    shaderStages[0].module = lightVertShaderModule;
+    shaderStages[1].module = lightFragShaderModule;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &deferredLightPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create deferred light pipeline!");
+    }
+
+    vkDestroyShaderModule(device, lightFragShaderModule, nullptr);
+    vkDestroyShaderModule(device, lightVertShaderModule, nullptr);
+    vkDestroyShaderModule(device, ambientShaderModule, nullptr);
+    vkDestroyShaderModule(device, fullscreenShaderModule, nullptr);
+}
+
+// Independent of the render pass, so it survives pipeline rebuilds
+void Application::createPipelineLayout() {
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    // Per-draw model matrix and material index
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(PushConstants);
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline layout!");
+    }
+
+    VkPushConstantRange deferredPushConstantRange{};
+    deferredPushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    deferredPushConstantRange.offset = 0;
+    deferredPushConstantRange.size = sizeof(DeferredPushConstants);
+    VkPipelineLayoutCreateInfo deferredLayoutInfo{};
+    deferredLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    deferredLayoutInfo.setLayoutCount = 1;
+    deferredLayoutInfo.pSetLayouts = &deferredDescriptorSetLayout;
+    deferredLayoutInfo.pushConstantRangeCount = 1;
+    deferredLayoutInfo.pPushConstantRanges = &deferredPushConstantRange;
+    if (vkCreatePipelineLayout(device, &deferredLayoutInfo, nullptr, &deferredPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create deferred pipeline layout!");
+    }
+}
 
-    if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create swap chain!");
+// A fragment pass rather than a compute one: swap chain images are usually
+// sRGB, and sRGB formats rarely support storage writes
+void Application::createUpscalePipeline() {
+    // Every pixel is written, so the previous contents are not loaded
+    VkAttachmentDescription colorAttachment{};
+    colorAttachment.format = swapChainImageFormat;
+    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    // Transitions are left to the render graph
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colorAttachmentRef{};
+    colorAttachmentRef.attachment = 0;
+    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorAttachmentRef;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = 1;
+    renderPassInfo.pAttachments = &colorAttachment;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &upscaleRenderPass) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upscale render pass!");
     }
 
-    vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
-    swapChainImages.resize(imageCount);
-    vkGetSwapchainImagesKHR(device, swapChain, &imageCount, swapChainImages.data());
-    swapChainImageFormat = surfaceFormat.format;
-    swapChainExtent = extent;
-}
+    VkDescriptorSetLayoutBinding sceneColorBinding{};
+    sceneColorBinding.binding = 0;
+    sceneColorBinding.descriptorCount = 1;
+    sceneColorBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sceneColorBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &sceneColorBinding;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &upscaleDescriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upscale descriptor set layout!");
+    }
 
-void Application::createImageViews() {
-    swapChainImageViews.resize(swapChainImages.size());
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(UpscalePushConstants);
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &upscaleDescriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &upscalePipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upscale pipeline layout!");
+    }
 
-    for (uint32_t i = 0; i < swapChainImages.size(); i++) {
-        swapChainImageViews[i] = createImageView(swapChainImages[i], swapChainImageFormat);
+    // Bilinear filtering does the upscale. The shader keeps coordinates 
+    // inside the rendered part of the target.
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.anisotropyEnable = VK_FALSE;
+    samplerInfo.maxAnisotropy = 1.0f;
+    samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+    samplerInfo.unnormalizedCoordinates = VK_FALSE;
+    samplerInfo.compareEnable = VK_FALSE;
+    samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = 0.0f;
+    if (vkCreateSampler(device, &samplerInfo, nullptr, &upscaleSampler) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upscale sampler!");
     }
-}
 
-void Application::createGraphicsPipeline() {
-    auto vertShaderCode = readFile("shaders/vert.spv");
-    auto fragShaderCode = readFile("shaders/frag.spv");
+    auto vertShaderCode = readFile("shaders/fullscreen_vert.spv");
+    auto fragShaderCode = readFile("shaders/upscale_frag.spv");
     VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
     VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertShaderModule;
-    vertShaderStageInfo.pName = "main";
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShaderModule;
-    fragShaderStageInfo.pName = "main";
-    VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
-
+    VkPipelineShaderStageCreateInfo shaderStages[2]{};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = vertShaderModule;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = fragShaderModule;
+    shaderStages[1].pName = "main";
+
+    // The fullscreen triangle has no vertex buffer
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
     inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -867,29 +5327,13 @@ void Application::createGraphicsPipeline() {
 
     VkPipelineRasterizationStateCreateInfo rasterizer{};
     rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
     rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
     rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
     rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-
-    VkPipelineDepthStencilStateCreateInfo depthStencil{};
-    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
-    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-    depthStencil.depthBoundsTestEnable = VK_FALSE;
-    depthStencil.minDepthBounds = 0.0f; // Optional
-    depthStencil.maxDepthBounds = 1.0f; // Optional
-    depthStencil.stencilTestEnable = VK_FALSE;
-    depthStencil.front = {}; // Optional
-    depthStencil.back = {}; // Optional
 
     VkPipelineMultisampleStateCreateInfo multisampling{};
     multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
     multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment{};
@@ -898,60 +5342,30 @@ void Application::createGraphicsPipeline() {
 
     VkPipelineColorBlendStateCreateInfo colorBlending{};
     colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
     colorBlending.attachmentCount = 1;
     colorBlending.pAttachments = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.0f;
-    colorBlending.blendConstants[1] = 0.0f;
-    colorBlending.blendConstants[2] = 0.0f;
-    colorBlending.blendConstants[3] = 0.0f;
 
-    std::vector<VkDynamicState> dynamicStates = {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR
-    };
     VkPipelineDynamicStateCreateInfo dynamicState{};
     dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
     dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
     dynamicState.pDynamicStates = dynamicStates.data();
 
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-
-    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create pipeline layout!");
-    }
-
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipelineInfo.stageCount = 2;
     pipelineInfo.pStages = shaderStages;
-
     pipelineInfo.pVertexInputState = &vertexInputInfo;
     pipelineInfo.pInputAssemblyState = &inputAssembly;
     pipelineInfo.pViewportState = &viewportState;
     pipelineInfo.pRasterizationState = &rasterizer;
     pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pDepthStencilState = nullptr; // Optional
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = &dynamicState;
-
-    pipelineInfo.layout = pipelineLayout;
-
-    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.layout = upscalePipelineLayout;
+    pipelineInfo.renderPass = upscaleRenderPass;
     pipelineInfo.subpass = 0;
-
-    pipelineInfo.pDepthStencilState = &depthStencil;
-
-    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
-    pipelineInfo.basePipelineIndex = -1; // Optional
-
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create graphics pipeline!");
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &upscalePipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upscale pipeline!");
     }
 
     vkDestroyShaderModule(device, fragShaderModule, nullptr);
@@ -964,7 +5378,8 @@ std::vector<char> Application::readFile(const std::string& filename) {
     std::ifstream file(filename, std::ios::ate | std::ios::binary);
 
     if (!file.is_open()) {
-        throw std::runtime_error("failed to open file!");
+        // Shaders are compiled into shaders/ by the build, or CompileShader.bat
+        throw std::runtime_error("failed to open " + filename + "!");
     }
     size_t fileSize = (size_t)file.tellg();
     std::vector<char> buffer(fileSize);
@@ -992,20 +5407,23 @@ void Application::createRenderPass() {
     colorAttachment.format = swapChainImageFormat;
     // Related to multisampling
     // If not doing multisampling, set to count 1 bit
-    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.samples = msaaSamples;
+    bool multisampled = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
     // LoadOp and storeOp apply to color and depth data
     // Clear the values in the attachment to a constant at the start of rendering
     // Here, it is to clear the framebuffer to black before drawing a new frame
     colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    // Store rendered contents to be read later
-    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    // Store rendered contents to be read later. A multisampled image is
+    // resolved at the end of the subpass and never needs to be written out.
+    colorAttachment.storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
     // Not using the stencil buffer
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    // Layout of pixels that the image will transition to
-    // We want it to be ready for presentation using the swap chain after rendering
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // The render graph transitions the attachments with barriers before 
+    // the pass and to the present layout after it, so the pass itself 
+    // keeps them in the attachment layouts
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -1013,12 +5431,12 @@ void Application::createRenderPass() {
 
     VkAttachmentDescription depthAttachment{};
     depthAttachment.format = findDepthFormat();
-    depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depthAttachment.samples = msaaSamples;
     depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
     depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     VkAttachmentReference depthAttachmentRef{};
@@ -1031,26 +5449,121 @@ void Application::createRenderPass() {
     subpass.pColorAttachments = &colorAttachmentRef;
     subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
-    VkSubpassDependency dependency{};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    // With MSAA the swap chain image is the resolve target. The resolve 
+    // happens in the subpass, where tilers read the samples straight from
+    // tile memory.
+    VkAttachmentDescription resolveAttachment{};
+    resolveAttachment.format = swapChainImageFormat;
+    resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolveAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolveAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolveAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    resolveAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    resolveAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference resolveAttachmentRef{};
+    resolveAttachmentRef.attachment = 2;
+    resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    std::vector<VkAttachmentDescription> attachments = { colorAttachment, depthAttachment };
+    if (multisampled) {
+        subpass.pResolveAttachments = &resolveAttachmentRef;
+        attachments.push_back(resolveAttachment);
+    }
+
+    // Deferred: the first subpass writes albedo and normal (attachments 2
+    // and 3) and depth, the second reads all three back at the same pixel
+    // as input attachments and writes the lit color. Neither the G-buffer
+    // nor depth is stored: on tilers they stay in tile memory.
+    VkAttachmentDescription gbufferAttachment{};
+    gbufferAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    gbufferAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    gbufferAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    gbufferAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    gbufferAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    gbufferAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    gbufferAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    std::array<VkAttachmentReference, 2> gbufferAttachmentRefs{};
+    gbufferAttachmentRefs[0] = { 2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    gbufferAttachmentRefs[1] = { 3, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    // Same order as the input_attachment_index of the lighting shaders
+    std::array<VkAttachmentReference, 3> inputAttachmentRefs{};
+    inputAttachmentRefs[0] = { 2, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    inputAttachmentRefs[1] = { 3, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+    inputAttachmentRefs[2] = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL };
+
+    std::array<VkSubpassDescription, 2> deferredSubpasses{};
+    deferredSubpasses[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    deferredSubpasses[0].colorAttachmentCount = static_cast<uint32_t>(gbufferAttachmentRefs.size());
+    deferredSubpasses[0].pColorAttachments = gbufferAttachmentRefs.data();
+    deferredSubpasses[0].pDepthStencilAttachment = &depthAttachmentRef;
+    deferredSubpasses[1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    deferredSubpasses[1].colorAttachmentCount = 1;
+    deferredSubpasses[1].pColorAttachments = &colorAttachmentRef;
+    deferredSubpasses[1].inputAttachmentCount = static_cast<uint32_t>(inputAttachmentRefs.size());
+    deferredSubpasses[1].pInputAttachments = inputAttachmentRefs.data();
+
+    // BY_REGION: a pixel of the lighting subpass only waits for the same
+    // pixel of the G-buffer subpass, not for the whole G-buffer
+    VkSubpassDependency gbufferDependency{};
+    gbufferDependency.srcSubpass = 0;
+    gbufferDependency.dstSubpass = 1;
+    // Depth is written in early or late fragment tests, depending on the 
+    // fragment shader
+    gbufferDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT 
+        | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    gbufferDependency.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    gbufferDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    gbufferDependency.dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+    gbufferDependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+    // Depth pre-pass: a depth-only subpass ahead of the others. The next 
+    // subpass's depth tests wait for the same pixel's depth writes.
+    VkSubpassDescription prepassSubpass{};
+    prepassSubpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    prepassSubpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+    VkSubpassDependency prepassDependency{};
+    prepassDependency.srcSubpass = 0;
+    prepassDependency.dstSubpass = 1;
+    // Without a fragment shader, depth is written in early fragment tests
+    prepassDependency.srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    prepassDependency.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    prepassDependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    prepassDependency.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+    prepassDependency.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+    // No external subpass dependencies: the render graph's barriers 
+    // order the pass against the acquire and against the previous frame
+    std::vector<VkSubpassDescription> subpasses;
+    std::vector<VkSubpassDependency> dependencies;
+    if (enableDepthPrepass) {
+        subpasses.push_back(prepassSubpass);
+        dependencies.push_back(prepassDependency);
+    }
+    if (shadingPath == ShadingPath::Deferred) {
+        gbufferAttachment.format = GBUFFER_ALBEDO_FORMAT;
+        attachments.push_back(gbufferAttachment);
+        gbufferAttachment.format = GBUFFER_NORMAL_FORMAT;
+        attachments.push_back(gbufferAttachment);
+        gbufferDependency.srcSubpass = static_cast<uint32_t>(subpasses.size());
+        gbufferDependency.dstSubpass = gbufferDependency.srcSubpass + 1;
+        subpasses.insert(subpasses.end(), deferredSubpasses.begin(), deferredSubpasses.end());
+        dependencies.push_back(gbufferDependency);
+    } else {
+        subpasses.push_back(subpass);
+    }
 
-    std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.subpassCount = static_cast<uint32_t>(subpasses.size());
+    renderPassInfo.pSubpasses = subpasses.data();
+    renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+    renderPassInfo.pDependencies = dependencies.data();
     renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
     renderPassInfo.pAttachments = attachments.data();
-    renderPassInfo.subpassCount = 1;
-    renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
-
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
         throw std::runtime_error("failed to create render pass!");
@@ -1060,10 +5573,22 @@ void Application::createRenderPass() {
 void Application::createFramebuffers() {
     swapChainFramebuffers.resize(swapChainImageViews.size());
     for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-        std::array<VkImageView, 2> attachments = {
-            swapChainImageViews[i],
-            depthImageView
+        // With dynamic resolution the scene goes to the scene color target
+        // instead. Its format is the swap chain's, so the render pass is 
+        // the same.
+        VkImageView target = upscaleMode != UpscaleMode::Off ? renderGraphImageViews[sceneColorResource] : swapChainImageViews[i];
+        // Same order as the attachments of the render pass
+        std::vector<VkImageView> attachments = {
+            target,
+            renderGraphImageViews[depthResource]
         };
+        if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+            attachments = { renderGraphImageViews[msaaColorResource], renderGraphImageViews[depthResource], target };
+        }
+        if (shadingPath == ShadingPath::Deferred) {
+            attachments.push_back(renderGraphImageViews[gbufferAlbedoResource]);
+            attachments.push_back(renderGraphImageViews[gbufferNormalResource]);
+        }
 
         VkFramebufferCreateInfo framebufferInfo{};
         framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
@@ -1078,6 +5603,25 @@ void Application::createFramebuffers() {
             throw std::runtime_error("failed to create framebuffer!");
         }
     }
+
+    if (upscaleMode == UpscaleMode::Off) {
+        return;
+    }
+    upscaleFramebuffers.resize(swapChainImageViews.size());
+    for (size_t i = 0; i < swapChainImageViews.size(); i++) {
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = upscaleRenderPass;
+        framebufferInfo.attachmentCount = 1;
+        framebufferInfo.pAttachments = &swapChainImageViews[i];
+        framebufferInfo.width = swapChainExtent.width;
+        framebufferInfo.height = swapChainExtent.height;
+        framebufferInfo.layers = 1;
+
+        if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &upscaleFramebuffers[i]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upscale framebuffer!");
+        }
+    }
 }
 
 void Application::createCommandPool() {
@@ -1103,7 +5647,7 @@ void Application::createVertexBuffer() {
     VkDeviceMemory stagingBufferMemory;
     createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-        stagingBuffer, stagingBufferMemory);
+        stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
 
     void* data;
     vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
@@ -1112,11 +5656,32 @@ void Application::createVertexBuffer() {
     // created on device local, cannot directly map memory to it
     createBuffer(bufferSize, 
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory, MemoryCategory::Vertex);
     copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    freeMemory(stagingBufferMemory);
+
+    // The positions again, on their own for the depth-only passes
+    std::vector<glm::vec3> positions;
+    positions.reserve(vertices.size());
+    for (const auto& vertex : vertices) {
+        positions.push_back(vertex.pos);
+    }
+    bufferSize = sizeof(positions[0]) * positions.size();
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+        stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
+    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+    memcpy(data, positions.data(), (size_t)bufferSize);
+    vkUnmapMemory(device, stagingBufferMemory);
+    createBuffer(bufferSize, 
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, positionBuffer, positionBufferMemory, MemoryCategory::Vertex);
+    copyBuffer(stagingBuffer, positionBuffer, bufferSize);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    freeMemory(stagingBufferMemory);
 }
 
 VkImageView Application::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags) {
@@ -1182,61 +5747,7 @@ void Application::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSiz
     endSingleTimeCommands(commandBuffer);
 }
 
-void Application::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-    barrier.image = image;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    VkPipelineStageFlags sourceStage;
-    VkPipelineStageFlags destinationStage;
-
-    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    } else {
-        throw std::invalid_argument("unsupported layout transition!");
-    }
-
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        sourceStage, destinationStage,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    endSingleTimeCommands(commandBuffer);
-}
-
-void Application::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+void Application::copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
     VkBufferImageCopy region{};
     region.bufferOffset = 0;
     region.bufferRowLength = 0;
@@ -1261,7 +5772,6 @@ void Application::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t wid
         1,
         &region
     );
-    endSingleTimeCommands(commandBuffer);
 }
 
 void Application::createIndexBuffer() {
@@ -1269,19 +5779,246 @@ void Application::createIndexBuffer() {
 
     VkBuffer stagingBuffer;
     VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
 
     void* data;
     vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
     memcpy(data, indices.data(), (size_t)bufferSize);
     vkUnmapMemory(device, stagingBufferMemory);
 
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory, MemoryCategory::Index);
 
     copyBuffer(stagingBuffer, indexBuffer, bufferSize);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    freeMemory(stagingBufferMemory);
+
+    meshes.push_back({ vertexBuffer, positionBuffer, indexBuffer, VK_INDEX_TYPE_UINT16 });
+}
+
+void Application::createLightBuffer() {
+    std::vector<Light> lights = generateLights(LIGHT_COUNTS.back(), 1);
+    VkDeviceSize bufferSize = sizeof(Light) * lights.size();
+
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
+
+    void* data;
+    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+    memcpy(data, lights.data(), (size_t)bufferSize);
+    vkUnmapMemory(device, stagingBufferMemory);
+
+    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, lightBuffer, lightBufferMemory, MemoryCategory::Storage);
+
+    copyBuffer(stagingBuffer, lightBuffer, bufferSize);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    freeMemory(stagingBufferMemory);
+
+    // Counts, then the light lists of all clusters
+    VkDeviceSize clusterBufferSize = sizeof(uint32_t) * (CLUSTER_COUNT + static_cast<VkDeviceSize>(CLUSTER_COUNT) * MAX_LIGHTS_PER_CLUSTER);
+    frameLightBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    frameLightBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    clusterBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    clusterBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frameLightBuffers[i], frameLightBuffersMemory[i], MemoryCategory::Storage);
+        // The counts are cleared with vkCmdFillBuffer
+        createBuffer(clusterBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, clusterBuffers[i], clusterBuffersMemory[i], MemoryCategory::Storage);
+    }
+}
+
+void Application::createLightCullingPipeline() {
+    // The frame's uniforms, the lights at rest, the animated lights and 
+    // the clusters
+    std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+    for (uint32_t i = 0; i < bindings.size(); i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorCount = 1;
+        bindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &lightCullingDescriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create light culling descriptor set layout!");
+    }
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(LightCullingPushConstants);
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &lightCullingDescriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &lightCullingPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create light culling pipeline layout!");
+    }
+
+    auto shaderCode = readFile("shaders/cluster_lights_comp.spv");
+    VkShaderModule shaderModule = createShaderModule(shaderCode);
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = lightCullingPipelineLayout;
+    if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &lightCullingPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create light culling pipeline!");
+    }
+    vkDestroyShaderModule(device, shaderModule, nullptr);
+}
+
+void Application::createShadowAtlas() {
+    shadowAtlasAllocator.reset(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+    for (auto& rect : cascadeRects) {
+        auto allocation = shadowAtlasAllocator.allocate(SHADOW_CASCADE_RESOLUTION, SHADOW_CASCADE_RESOLUTION);
+        if (!allocation) {
+            throw std::runtime_error("shadow cascades do not fit in the shadow atlas!");
+        }
+        rect = *allocation;
+    }
+
+    // Sampled through the linear comparison sampler below, which not every
+    // depth format supports. Shadow depth is linear, so 16 bits will do.
+    shadowFormat = findSupportedFormat(
+        { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D16_UNORM },
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT
+    );
+    VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT | (hasStencilComponent(shadowFormat) ? VK_IMAGE_ASPECT_STENCIL_BIT : 0);
+    createImage(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, shadowFormat, VK_IMAGE_TILING_OPTIMAL, 
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, shadowAtlasImage, shadowAtlasImageMemory, MemoryCategory::Attachment);
+    createImage(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, shadowFormat, VK_IMAGE_TILING_OPTIMAL, 
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, 
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, shadowCacheImage, shadowCacheImageMemory, MemoryCategory::Attachment);
+    shadowAtlasImageView = createImageView(shadowAtlasImage, shadowFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+    shadowCacheImageView = createImageView(shadowCacheImage, shadowFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+    imageStates.track(shadowAtlasImage, aspect, 1, 1);
+    imageStates.track(shadowCacheImage, aspect, 1, 1);
+
+    // Loaded, so that a pass can redraw some cascades and keep the others
+    VkAttachmentDescription depthAttachment{};
+    depthAttachment.format = shadowFormat;
+    depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    // Transitions are left to the image state tracker
+    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference depthAttachmentRef{};
+    depthAttachmentRef.attachment = 0;
+    depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass{};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 0;
+    subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+    VkRenderPassCreateInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = 1;
+    renderPassInfo.pAttachments = &depthAttachment;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &shadowRenderPass) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shadow render pass!");
+    }
+
+    VkFramebufferCreateInfo framebufferInfo{};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = shadowRenderPass;
+    framebufferInfo.attachmentCount = 1;
+    framebufferInfo.width = SHADOW_ATLAS_SIZE;
+    framebufferInfo.height = SHADOW_ATLAS_SIZE;
+    framebufferInfo.layers = 1;
+    framebufferInfo.pAttachments = &shadowAtlasImageView;
+    if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &shadowAtlasFramebuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shadow atlas framebuffer!");
+    }
+    framebufferInfo.pAttachments = &shadowCacheImageView;
+    if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &shadowCacheFramebuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shadow cache framebuffer!");
+    }
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(ShadowPushConstants);
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 0;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &shadowPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shadow pipeline layout!");
+    }
+
+    // Hardware 2x2 percentage-closer filtering: each fetch compares the 
+    // reference depth with four texels and blends the results
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.anisotropyEnable = VK_FALSE;
+    samplerInfo.maxAnisotropy = 1.0f;
+    samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+    samplerInfo.unnormalizedCoordinates = VK_FALSE;
+    samplerInfo.compareEnable = VK_TRUE;
+    samplerInfo.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = 0.0f;
+    if (vkCreateSampler(device, &samplerInfo, nullptr, &shadowSampler) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shadow sampler!");
+    }
+}
+
+void Application::cleanupShadowAtlas() {
+    vkDestroySampler(device, shadowSampler, nullptr);
+    vkDestroyPipelineLayout(device, shadowPipelineLayout, nullptr);
+    vkDestroyFramebuffer(device, shadowAtlasFramebuffer, nullptr);
+    vkDestroyFramebuffer(device, shadowCacheFramebuffer, nullptr);
+    vkDestroyRenderPass(device, shadowRenderPass, nullptr);
+    vkDestroyImageView(device, shadowAtlasImageView, nullptr);
+    vkDestroyImageView(device, shadowCacheImageView, nullptr);
+    imageStates.forget(shadowAtlasImage);
+    imageStates.forget(shadowCacheImage);
+    vkDestroyImage(device, shadowAtlasImage, nullptr);
+    freeMemory(shadowAtlasImageMemory);
+    vkDestroyImage(device, shadowCacheImage, nullptr);
+    freeMemory(shadowCacheImageMemory);
+}
+
+void Application::updateShadowCascades() {
+    PROFILE_ZONE("updateShadowCascades");
+    uint64_t version = camera.getVersion();
+    if (version == shadowCascadeVersion) {
+        return;
+    }
+    shadowCascadeVersion = version;
+    glm::mat4 invView = glm::inverse(camera.getView());
+    cascadeSplits = shadowCascadeSplits(camera.getNear(), std::min(SHADOW_DISTANCE, camera.getFar()));
+    float nearDepth = camera.getNear();
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        cascadeViewProj[i] = fitShadowCascade(invView, camera.getFovy(), camera.getAspect(), nearDepth, cascadeSplits[i], 
+            SUN_DIRECTION, cascadeRects[i].width, SHADOW_SNAP_TEXELS);
+        nearDepth = cascadeSplits[i];
+    }
 }
 
 void Application::createDescriptorSetLayout() {
@@ -1290,7 +6027,7 @@ void Application::createDescriptorSetLayout() {
     uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     uboLayoutBinding.descriptorCount = 1;
     // In which shader stage will this layout be referenced
-    uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 
     VkDescriptorSetLayoutBinding samplerLayoutBinding{};
     samplerLayoutBinding.binding = 1;
@@ -1299,7 +6036,51 @@ void Application::createDescriptorSetLayout() {
     samplerLayoutBinding.pImmutableSamplers = nullptr;
     samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-    std::array<VkDescriptorSetLayoutBinding, 2> bindings = { uboLayoutBinding, samplerLayoutBinding };
+    // Virtual texture: page table, feedback and the physical page cache
+    VkDescriptorSetLayoutBinding pageTableLayoutBinding{};
+    pageTableLayoutBinding.binding = 2;
+    pageTableLayoutBinding.descriptorCount = 1;
+    pageTableLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pageTableLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorSetLayoutBinding feedbackLayoutBinding{};
+    feedbackLayoutBinding.binding = 3;
+    feedbackLayoutBinding.descriptorCount = 1;
+    feedbackLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    feedbackLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorSetLayoutBinding pageCacheLayoutBinding{};
+    pageCacheLayoutBinding.binding = 4;
+    pageCacheLayoutBinding.descriptorCount = 1;
+    pageCacheLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pageCacheLayoutBinding.pImmutableSamplers = nullptr;
+    pageCacheLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // Lights, for forward and clustered shading
+    VkDescriptorSetLayoutBinding lightLayoutBinding{};
+    lightLayoutBinding.binding = 5;
+    lightLayoutBinding.descriptorCount = 1;
+    lightLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    lightLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // Light lists of the clusters, for clustered shading
+    VkDescriptorSetLayoutBinding clusterLayoutBinding{};
+    clusterLayoutBinding.binding = 6;
+    clusterLayoutBinding.descriptorCount = 1;
+    clusterLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    clusterLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // Sun shadow atlas
+    VkDescriptorSetLayoutBinding shadowLayoutBinding{};
+    shadowLayoutBinding.binding = 7;
+    shadowLayoutBinding.descriptorCount = 1;
+    shadowLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    shadowLayoutBinding.pImmutableSamplers = nullptr;
+    shadowLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    std::array<VkDescriptorSetLayoutBinding, 8> bindings = { uboLayoutBinding, samplerLayoutBinding, 
+        pageTableLayoutBinding, feedbackLayoutBinding, pageCacheLayoutBinding, lightLayoutBinding, clusterLayoutBinding, 
+        shadowLayoutBinding };
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
@@ -1308,6 +6089,29 @@ void Application::createDescriptorSetLayout() {
     if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor set layout!");
     }
+
+    // Deferred lighting subpass: the frame's uniforms, the G-buffer 
+    // albedo, normal and depth as input attachments, the lights and the
+    // shadow atlas
+    std::array<VkDescriptorSetLayoutBinding, 6> deferredBindings{};
+    deferredBindings[0] = uboLayoutBinding;
+    deferredBindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    for (uint32_t i = 1; i <= 3; i++) {
+        deferredBindings[i].binding = i;
+        deferredBindings[i].descriptorCount = 1;
+        deferredBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        deferredBindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    }
+    deferredBindings[4] = lightLayoutBinding;
+    deferredBindings[4].binding = 4;
+    deferredBindings[4].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    deferredBindings[5] = shadowLayoutBinding;
+    deferredBindings[5].binding = 5;
+    layoutInfo.bindingCount = static_cast<uint32_t>(deferredBindings.size());
+    layoutInfo.pBindings = deferredBindings.data();
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &deferredDescriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create deferred descriptor set layout!");
+    }
 }
 
 void Application::createUniformBuffers() {
@@ -1318,45 +6122,286 @@ void Application::createUniformBuffers() {
     uniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
 
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i]);
+        createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i], MemoryCategory::Uniform);
 
         vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
     }
 }
 
 void Application::updateUniformBuffer(uint32_t currentImage) {
+    PROFILE_ZONE("updateUniformBuffer");
+    // Each frame has its own buffer, so it is rewritten only if the camera
+    // changed since that buffer was last filled, or setLightCount reset it
+    uint64_t version = camera.getVersion();
+    if (uniformBufferVersions[currentImage] == version) {
+        return;
+    }
+    uniformBufferVersions[currentImage] = version;
+
+    UniformBufferObject ubo{};
+    ubo.view = camera.getView();
+    ubo.proj = camera.getProj();
+    ubo.viewProj = camera.getViewProj();
+    ubo.invViewProj = glm::inverse(ubo.viewProj);
+    ubo.lightCount = LIGHT_COUNTS[lightCountIndex];
+    // About as bright with any number of lights
+    ubo.lightIntensity = ubo.lightCount > 0 ? std::min(1.0f, 200.0f / ubo.lightCount) : 0.0f;
+    ubo.zNear = camera.getNear();
+    ubo.zFar = camera.getFar();
+    // The cascades follow the camera, so they change with its version
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        const SkylineAllocator::Rect& rect = cascadeRects[i];
+        ubo.shadowViewProj[i] = cascadeViewProj[i];
+        ubo.shadowRects[i] = glm::vec4(rect.x, rect.y, rect.width, rect.height) / static_cast<float>(SHADOW_ATLAS_SIZE);
+        ubo.cascadeSplits[i] = cascadeSplits[i];
+    }
+    ubo.sun = glm::vec4(SUN_DIRECTION, SUN_INTENSITY);
+    memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+}
+
+void Application::createSceneTransforms() {
+    sceneRoot = sceneTransforms.create();
+    for (auto& node : quadNodes) {
+        node = sceneTransforms.create(sceneRoot);
+    }
+}
+
+void Application::updateDrawItems() {
+    PROFILE_ZONE("updateDrawItems");
     static auto startTime = std::chrono::high_resolution_clock::now();
 
     auto currentTime = std::chrono::high_resolution_clock::now();
     float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
 
-    UniformBufferObject ubo{};
-    ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-    ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-    ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 10.0f);
-    // glm is originally for OpenGL, whose y coord of the clip space is inverted
-    ubo.proj[1][1] *= -1;
-    memcpy(uniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+    sceneTransforms.setRotation(sceneRoot, glm::angleAxis(time * glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f)));
+    sceneTransforms.update(&workers);
+
+    // Each quad of the index buffer is its own draw
+    sceneDraws.clear();
+    sceneDraws.push_back({ sceneTransforms.getWorld(quadNodes[0]), 0, 0, 0, 0, 6 });
+    sceneDraws.push_back({ sceneTransforms.getWorld(quadNodes[1]), 0, 0, 0, 6, 6 });
+    sceneDraws.push_back({ glm::mat4(1.0f), 0, 0, 0, 12, 6, true });
+
+    drawBounds.resize(sceneDraws.size());
+    for (size_t i = 0; i < sceneDraws.size(); i++) {
+        const auto& draw = sceneDraws[i];
+        glm::vec3 localMin = vertices[indices[draw.firstIndex]].pos;
+        glm::vec3 localMax = localMin;
+        for (uint32_t j = draw.firstIndex; j < draw.firstIndex + draw.indexCount; j++) {
+            localMin = glm::min(localMin, vertices[indices[j]].pos);
+            localMax = glm::max(localMax, vertices[indices[j]].pos);
+        }
+        drawBounds.setTransformed(i, draw.model, localMin, localMax);
+    }
+    // Rebuilt when the number of draws changes, otherwise refit
+    drawBvh.refit(drawBounds);
+    drawBvh.queryFrustum(camera.getFrustumPlanes(), drawBounds, visibleDraws);
+
+    drawItems.clear();
+    renderQueue.clear();
+    for (uint32_t index : visibleDraws) {
+        const auto& draw = sceneDraws[index];
+        glm::vec3 center(drawBounds.centerX[index], drawBounds.centerY[index], drawBounds.centerZ[index]);
+        float depth = glm::distance(camera.getPosition(), center) / camera.getFar();
+        renderQueue.push(RenderQueue::makeKey(0, draw.pipelineIndex, draw.materialIndex, draw.meshIndex, depth), 
+            static_cast<uint32_t>(drawItems.size()));
+        drawItems.push_back(draw);
+    }
+    renderQueue.sort(&workers);
+}
+
+void Application::reportRenderStats() {
+    renderStatsSum.draws += renderStats.draws;
+    renderStatsSum.pipelineBinds += renderStats.pipelineBinds;
+    renderStatsSum.descriptorSetBinds += renderStats.descriptorSetBinds;
+    renderStatsSum.vertexBufferBinds += renderStats.vertexBufferBinds;
+    renderStatsSum.indexBufferBinds += renderStats.indexBufferBinds;
+    renderStatsSum.barriers += renderStats.barriers;
+    renderStatsSum.skippedBarriers += renderStats.skippedBarriers;
+    renderStatsSum.staticShadowRenders += renderStats.staticShadowRenders;
+    renderStatsSum.shadowDraws += renderStats.shadowDraws;
+    renderStatsSum.prepassDraws += renderStats.prepassDraws;
+    renderStatsFrames++;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - renderStatsReportTime >= std::chrono::seconds(1)) {
+        double frames = renderStatsFrames;
+        std::cout << "per frame: " << renderStatsSum.draws / frames << " draws, " 
+            << renderStatsSum.pipelineBinds / frames << " pipeline binds, " 
+            << renderStatsSum.descriptorSetBinds / frames << " descriptor set binds, " 
+            << renderStatsSum.vertexBufferBinds / frames << " vertex buffer binds, " 
+            << renderStatsSum.indexBufferBinds / frames << " index buffer binds, " 
+            << renderStatsSum.barriers / frames << " image barriers (" 
+            << renderStatsSum.skippedBarriers / frames << " skipped), " 
+            << renderStatsSum.shadowDraws / frames << " shadow draws, " 
+            << renderStatsSum.staticShadowRenders / frames << " static cascade renders";
+        if (enableDepthPrepass) {
+            std::cout << ", " << renderStatsSum.prepassDraws / frames << " pre-pass draws";
+        }
+        if (upscaleMode != UpscaleMode::Off) {
+            std::cout << ", rendering at " << renderExtent.width << 'x' << renderExtent.height 
+                << " (" << resolutionScaler.getSmoothedMs() << " ms GPU)";
+        }
+        std::cout << '\n';
+        // Of the last frame read back
+        for (uint32_t i = 0; i < DRAW_GROUP_COUNT; i++) {
+            const DrawGroupStats& stats = drawGroupStats[i];
+            if (!(drawGroupsRead & (1u << i))) {
+                continue;
+            }
+            std::cout << "  " << DRAW_GROUP_NAMES[i] << ": ";
+            if (pipelineStatisticsSupported) {
+                std::cout << stats.vertexInvocations << " vertex invocations, " << stats.clippingPrimitives << " clipping primitives, " 
+                    << stats.fragmentInvocations << " fragment invocations, ";
+            }
+            std::cout << stats.samplesPassed << " samples passed\n";
+        }
+        renderStatsSum = RenderStats{};
+        renderStatsFrames = 0;
+        renderStatsReportTime = now;
+    }
 }
 
 void Application::createDescriptorPool() {
-    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    std::array<VkDescriptorPoolSize, 4> poolSizes{};
+    // scene, deferred lighting and light culling sets
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 3);
+    // texture, virtual texture page cache, the upscale pass's scene color,
+    // and the shadow atlas of the scene and deferred lighting sets
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 5);
+    // virtual texture page table and feedback, the lights and clusters of
+    // the scene set, the lights of the deferred set, and the light culling
+    // pass's lights and clusters
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[2].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 8);
+    // G-buffer albedo, normal and depth
+    poolSizes[3].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    poolSizes[3].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 3);
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    // Scene, upscale, deferred lighting and light culling sets
+    poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 4);
 
     if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor pool!");
     }
 }
 
+void Application::createUpscaleDescriptorSets() {
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, upscaleDescriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    allocInfo.pSetLayouts = layouts.data();
+
+    upscaleDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+    if (vkAllocateDescriptorSets(device, &allocInfo, upscaleDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate upscale descriptor sets!");
+    }
+    // Written when a frame is recorded with the upscale pass
+    upscaleDescriptorViews.assign(MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+}
+
+void Application::createDeferredDescriptorSets() {
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, deferredDescriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    allocInfo.pSetLayouts = layouts.data();
+
+    deferredDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+    if (vkAllocateDescriptorSets(device, &allocInfo, deferredDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate deferred descriptor sets!");
+    }
+    // The input attachments are written when a frame is recorded with the
+    // deferred path
+    deferredDescriptorViews.assign(MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        VkDescriptorBufferInfo bufferInfo{};
+        bufferInfo.buffer = uniformBuffers[i];
+        bufferInfo.offset = 0;
+        bufferInfo.range = sizeof(UniformBufferObject);
+
+        VkDescriptorBufferInfo lightInfo{};
+        lightInfo.buffer = frameLightBuffers[i];
+        lightInfo.offset = 0;
+        lightInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorImageInfo shadowInfo{};
+        shadowInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        shadowInfo.imageView = shadowAtlasImageView;
+        shadowInfo.sampler = shadowSampler;
+
+        std::array<VkWriteDescriptorSet, 3> descriptorWrites{};
+        descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[0].dstSet = deferredDescriptorSets[i];
+        descriptorWrites[0].dstBinding = 0;
+        descriptorWrites[0].dstArrayElement = 0;
+        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptorWrites[0].descriptorCount = 1;
+        descriptorWrites[0].pBufferInfo = &bufferInfo;
+
+        descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[1].dstSet = deferredDescriptorSets[i];
+        descriptorWrites[1].dstBinding = 4;
+        descriptorWrites[1].dstArrayElement = 0;
+        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[1].descriptorCount = 1;
+        descriptorWrites[1].pBufferInfo = &lightInfo;
+
+        descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[2].dstSet = deferredDescriptorSets[i];
+        descriptorWrites[2].dstBinding = 5;
+        descriptorWrites[2].dstArrayElement = 0;
+        descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrites[2].descriptorCount = 1;
+        descriptorWrites[2].pImageInfo = &shadowInfo;
+
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+    }
+}
+
+void Application::createLightCullingDescriptorSets() {
+    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, lightCullingDescriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    allocInfo.pSetLayouts = layouts.data();
+
+    lightCullingDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+    if (vkAllocateDescriptorSets(device, &allocInfo, lightCullingDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate light culling descriptor sets!");
+    }
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        // Same order as the bindings
+        std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+        bufferInfos[0] = { uniformBuffers[i], 0, sizeof(UniformBufferObject) };
+        bufferInfos[1] = { lightBuffer, 0, VK_WHOLE_SIZE };
+        bufferInfos[2] = { frameLightBuffers[i], 0, VK_WHOLE_SIZE };
+        bufferInfos[3] = { clusterBuffers[i], 0, VK_WHOLE_SIZE };
+
+        std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+        for (uint32_t j = 0; j < descriptorWrites.size(); j++) {
+            descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[j].dstSet = lightCullingDescriptorSets[i];
+            descriptorWrites[j].dstBinding = j;
+            descriptorWrites[j].dstArrayElement = 0;
+            descriptorWrites[j].descriptorType = j == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrites[j].descriptorCount = 1;
+            descriptorWrites[j].pBufferInfo = &bufferInfos[j];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+    }
+}
+
 void Application::createDescriptorSets() {
     std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
     VkDescriptorSetAllocateInfo allocInfo{};
@@ -1381,7 +6426,37 @@ void Application::createDescriptorSets() {
         imageInfo.imageView = textureImageView;
         imageInfo.sampler = textureSampler;
 
-        std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+        VkDescriptorBufferInfo pageTableInfo{};
+        pageTableInfo.buffer = vtPageTableBuffers[i];
+        pageTableInfo.offset = 0;
+        pageTableInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo feedbackInfo{};
+        feedbackInfo.buffer = vtFeedbackBuffers[i];
+        feedbackInfo.offset = 0;
+        feedbackInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorImageInfo pageCacheInfo{};
+        pageCacheInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        pageCacheInfo.imageView = vtCacheImageView;
+        pageCacheInfo.sampler = vtCacheSampler;
+
+        VkDescriptorBufferInfo lightInfo{};
+        lightInfo.buffer = frameLightBuffers[i];
+        lightInfo.offset = 0;
+        lightInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo clusterInfo{};
+        clusterInfo.buffer = clusterBuffers[i];
+        clusterInfo.offset = 0;
+        clusterInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorImageInfo shadowInfo{};
+        shadowInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        shadowInfo.imageView = shadowAtlasImageView;
+        shadowInfo.sampler = shadowSampler;
+
+        std::array<VkWriteDescriptorSet, 8> descriptorWrites{};
 
         descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         descriptorWrites[0].dstSet = descriptorSets[i];
@@ -1399,11 +6474,59 @@ void Application::createDescriptorSets() {
         descriptorWrites[1].descriptorCount = 1;
         descriptorWrites[1].pImageInfo = &imageInfo;
 
+        descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[2].dstSet = descriptorSets[i];
+        descriptorWrites[2].dstBinding = 2;
+        descriptorWrites[2].dstArrayElement = 0;
+        descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[2].descriptorCount = 1;
+        descriptorWrites[2].pBufferInfo = &pageTableInfo;
+
+        descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[3].dstSet = descriptorSets[i];
+        descriptorWrites[3].dstBinding = 3;
+        descriptorWrites[3].dstArrayElement = 0;
+        descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[3].descriptorCount = 1;
+        descriptorWrites[3].pBufferInfo = &feedbackInfo;
+
+        descriptorWrites[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[4].dstSet = descriptorSets[i];
+        descriptorWrites[4].dstBinding = 4;
+        descriptorWrites[4].dstArrayElement = 0;
+        descriptorWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrites[4].descriptorCount = 1;
+        descriptorWrites[4].pImageInfo = &pageCacheInfo;
+
+        descriptorWrites[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[5].dstSet = descriptorSets[i];
+        descriptorWrites[5].dstBinding = 5;
+        descriptorWrites[5].dstArrayElement = 0;
+        descriptorWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[5].descriptorCount = 1;
+        descriptorWrites[5].pBufferInfo = &lightInfo;
+
+        descriptorWrites[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[6].dstSet = descriptorSets[i];
+        descriptorWrites[6].dstBinding = 6;
+        descriptorWrites[6].dstArrayElement = 0;
+        descriptorWrites[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[6].descriptorCount = 1;
+        descriptorWrites[6].pBufferInfo = &clusterInfo;
+
+        descriptorWrites[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[7].dstSet = descriptorSets[i];
+        descriptorWrites[7].dstBinding = 7;
+        descriptorWrites[7].dstArrayElement = 0;
+        descriptorWrites[7].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrites[7].descriptorCount = 1;
+        descriptorWrites[7].pImageInfo = &shadowInfo;
+
         vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
     }
 }
 
-void Application::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
+void Application::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, MemoryCategory category) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1426,12 +6549,8 @@ void Application::createImage(uint32_t width, uint32_t height, VkFormat format,
     VkMemoryRequirements memRequirements;
     vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
+    uint32_t memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+    if (allocateMemory(memRequirements.size, memoryTypeIndex, category, imageMemory) != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate image memory!");
     }
 
@@ -1451,7 +6570,7 @@ void Application::createTextureImage() {
     VkDeviceMemory stagingBufferMemory;
     createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-        stagingBuffer, stagingBufferMemory);
+        stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
 
     void* data;
     vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
@@ -1462,16 +6581,23 @@ void Application::createTextureImage() {
 
     createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, 
         VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, 
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), 
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory, MemoryCategory::Texture);
+    imageStates.track(textureImage, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+
+    // Both transitions and the copy go in one submission
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    imageStates.require(textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    copyBufferToImage(commandBuffer, stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), 
         static_cast<uint32_t>(texHeight));
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, 
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    imageStates.require(textureImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    endSingleTimeCommands(commandBuffer);
 
     vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    freeMemory(stagingBufferMemory);
 }
 
 void Application::createTextureImageView() {
@@ -1505,16 +6631,430 @@ void Application::createTextureSampler() {
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
         throw std::runtime_error("failed to create texture sampler!");
     }
+
+    // The page cache is an atlas of unrelated pages: the shader picks the 
+    // mip level itself and keeps coordinates half a texel inside each page,
+    // so the sampler only filters bilinearly and never wraps.
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.anisotropyEnable = VK_FALSE;
+    samplerInfo.maxAnisotropy = 1.0f;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    if (vkCreateSampler(device, &samplerInfo, nullptr, &vtCacheSampler) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create page cache sampler!");
+    }
+}
+
+void Application::createVirtualTexture() {
+    int texWidth, texHeight, texChannels;
+    stbi_uc* pixels = stbi_load("textures/texture.jpg", &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+    if (!pixels) {
+        throw std::runtime_error("failed to load texture image!");
+    }
+
+    // Sparse residency would let the driver map pages of one large image,
+    // but it is optional and its granularity is implementation defined.
+    // The page table path below works everywhere.
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+    std::cout << "sparse residency (2D images): " 
+        << (supportedFeatures.sparseResidencyImage2D ? "supported" : "not supported") 
+        << ", using page table\n";
+
+    // Mip chain down to the first level that fits in a single page
+    vtLevels.clear();
+    VirtualTextureLevel level0{};
+    level0.width = static_cast<uint32_t>(texWidth);
+    level0.height = static_cast<uint32_t>(texHeight);
+    level0.pixels.assign(pixels, pixels + static_cast<size_t>(texWidth) * texHeight * 4);
+    stbi_image_free(pixels);
+    vtLevels.push_back(std::move(level0));
+
+    while (vtLevels.back().width > VT_PAGE_SIZE || vtLevels.back().height > VT_PAGE_SIZE) {
+        if (vtLevels.size() == VT_MAX_LEVELS) {
+            throw std::runtime_error("virtual texture has too many mip levels!");
+        }
+        const VirtualTextureLevel& src = vtLevels.back();
+        VirtualTextureLevel dst{};
+        dst.width = std::max(src.width / 2, 1u);
+        dst.height = std::max(src.height / 2, 1u);
+        dst.pixels.resize(static_cast<size_t>(dst.width) * dst.height * 4);
+        // 2x2 box filter, clamping at the edge for odd sizes
+        for (uint32_t y = 0; y < dst.height; y++) {
+            for (uint32_t x = 0; x < dst.width; x++) {
+                uint32_t x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                uint32_t y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                for (uint32_t c = 0; c < 4; c++) {
+                    uint32_t sum = src.pixels[(y0 * src.width + x0) * 4 + c] + src.pixels[(y0 * src.width + x1) * 4 + c] 
+                        + src.pixels[(y1 * src.width + x0) * 4 + c] + src.pixels[(y1 * src.width + x1) * 4 + c];
+                    dst.pixels[(y * dst.width + x) * 4 + c] = static_cast<stbi_uc>((sum + 2) / 4);
+                }
+            }
+        }
+        vtLevels.push_back(std::move(dst));
+    }
+
+    vtPageCount = 0;
+    for (auto& level : vtLevels) {
+        level.pagesX = (level.width + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+        level.pagesY = (level.height + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE;
+        level.firstPage = vtPageCount;
+        vtPageCount += level.pagesX * level.pagesY;
+    }
+    vtCache.init(vtPageCount, VT_CACHE_PAGES_PER_SIDE * VT_CACHE_PAGES_PER_SIDE);
+
+    uint32_t cacheSize = VT_PAGE_SIZE * VT_CACHE_PAGES_PER_SIDE;
+    createImage(cacheSize, cacheSize, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, 
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vtCacheImage, vtCacheImageMemory, MemoryCategory::Texture);
+    vtCacheImageView = createImageView(vtCacheImage, VK_FORMAT_R8G8B8A8_SRGB);
+    imageStates.track(vtCacheImage, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+
+    VkDeviceSize pageBytes = VT_PAGE_SIZE * VT_PAGE_SIZE * 4;
+    VkDeviceSize pageTableSize = sizeof(VirtualTextureHeader) + sizeof(uint32_t) * vtPageCount;
+    VkDeviceSize feedbackSize = sizeof(uint32_t) * vtPageCount;
+    VkDeviceSize stagingSize = pageBytes * VT_MAX_UPLOADS_PER_FRAME;
+
+    VirtualTextureHeader header{};
+    header.info = glm::uvec4(vtLevels.size(), vtLevels[0].width, vtLevels[0].height, 0);
+    header.cache = glm::uvec4(VT_PAGE_SIZE, VT_CACHE_PAGES_PER_SIDE, 0, 0);
+    for (size_t i = 0; i < vtLevels.size(); i++) {
+        header.levels[i] = glm::uvec4(vtLevels[i].firstPage, vtLevels[i].pagesX, vtLevels[i].pagesY, 0);
+    }
+
+    // The coarsest level is a single page. It is pinned in the cache so that
+    // every lookup has something to fall back to.
+    uint32_t coarsestPage = vtPageCount - 1;
+    uint32_t coarsestSlot = vtCache.allocate(coarsestPage, true);
+
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    createBuffer(pageBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+        stagingBuffer, stagingBufferMemory, MemoryCategory::Staging);
+    void* data;
+    vkMapMemory(device, stagingBufferMemory, 0, pageBytes, 0, &data);
+    readVirtualTexturePage(coarsestPage, static_cast<stbi_uc*>(data));
+    vkUnmapMemory(device, stagingBufferMemory);
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    imageStates.require(vtCacheImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    copyPageToCache(commandBuffer, stagingBuffer, 0, coarsestSlot);
+    // The cache stays in SHADER_READ_ONLY_OPTIMAL, and uploads 
+    // transition it back and forth within the frame
+    imageStates.require(vtCacheImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    endSingleTimeCommands(commandBuffer);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    freeMemory(stagingBufferMemory);
+
+    // Host visible, so that the CPU can update the page table and read 
+    // the feedback of a frame once its fence has been signaled.
+    vtPageTableBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    vtPageTableBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    vtPageTableBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+    vtFeedbackBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    vtFeedbackBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    vtFeedbackBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+    vtStagingBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    vtStagingBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+    vtStagingBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createBuffer(pageTableSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+            vtPageTableBuffers[i], vtPageTableBuffersMemory[i], MemoryCategory::Storage);
+        vkMapMemory(device, vtPageTableBuffersMemory[i], 0, pageTableSize, 0, &vtPageTableBuffersMapped[i]);
+        memcpy(vtPageTableBuffersMapped[i], &header, sizeof(header));
+        memcpy(static_cast<char*>(vtPageTableBuffersMapped[i]) + sizeof(header), 
+            vtCache.pageTable.data(), sizeof(uint32_t) * vtPageCount);
+
+        createBuffer(feedbackSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+            vtFeedbackBuffers[i], vtFeedbackBuffersMemory[i], MemoryCategory::Storage);
+        vkMapMemory(device, vtFeedbackBuffersMemory[i], 0, feedbackSize, 0, &vtFeedbackBuffersMapped[i]);
+        memset(vtFeedbackBuffersMapped[i], 0, static_cast<size_t>(feedbackSize));
+
+        createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+            vtStagingBuffers[i], vtStagingBuffersMemory[i], MemoryCategory::Staging);
+        vkMapMemory(device, vtStagingBuffersMemory[i], 0, stagingSize, 0, &vtStagingBuffersMapped[i]);
+    }
+}
+
+void Application::updateVirtualTexture(uint32_t currentImage) {
+    // The feedback was written by the frame that used this slot 
+    // framesInFlight frames ago, so reading it never stalls.
+    auto requests = static_cast<uint32_t*>(vtFeedbackBuffersMapped[currentImage]);
+    std::vector<uint32_t> missing;
+    vtCache.beginFrame();
+    for (uint32_t page = 0; page < vtPageCount; page++) {
+        if (!requests[page]) {
+            continue;
+        }
+        requests[page] = 0;
+        if (vtCache.isResident(page)) {
+            vtCache.touch(page);
+        } else {
+            missing.push_back(page);
+        }
+    }
+
+    // Pages are stored from the finest level to the coarsest, so loading 
+    // higher indices first brings in coarse pages before the fine ones 
+    // they are the fallback for.
+    std::sort(missing.begin(), missing.end(), std::greater<uint32_t>());
+
+    VkDeviceSize pageBytes = VT_PAGE_SIZE * VT_PAGE_SIZE * 4;
+    vtPendingUploads.clear();
+    for (uint32_t page : missing) {
+        if (vtPendingUploads.size() == VT_MAX_UPLOADS_PER_FRAME) {
+            break;
+        }
+        uint32_t slot = vtCache.allocate(page);
+        if (slot == VT_NOT_RESIDENT) {
+            // Every slot is needed by this frame. The rest keeps falling
+            // back to coarser levels.
+            break;
+        }
+        VkDeviceSize offset = pageBytes * vtPendingUploads.size();
+        readVirtualTexturePage(page, static_cast<stbi_uc*>(vtStagingBuffersMapped[currentImage]) + offset);
+        vtPendingUploads.push_back({ slot, offset });
+    }
+
+    memcpy(static_cast<char*>(vtPageTableBuffersMapped[currentImage]) + sizeof(VirtualTextureHeader), 
+        vtCache.pageTable.data(), sizeof(uint32_t) * vtPageCount);
+}
+
+void Application::recordVirtualTextureUploads(VkCommandBuffer commandBuffer) {
+    if (vtPendingUploads.empty()) {
+        return;
+    }
+
+    // Slots being overwritten may still be sampled by the previous frame.
+    // The tracker knows the cache was last read by fragment shaders, so
+    // the barrier waits for those reads.
+    imageStates.require(vtCacheImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+
+    for (const auto& upload : vtPendingUploads) {
+        copyPageToCache(commandBuffer, vtStagingBuffers[currentFrame], upload.stagingOffset, upload.slot);
+    }
+
+    imageStates.require(vtCacheImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+}
+
+void Application::readVirtualTexturePage(uint32_t page, stbi_uc* dst) {
+    size_t levelIndex = 0;
+    while (levelIndex + 1 < vtLevels.size() && vtLevels[levelIndex + 1].firstPage <= page) {
+        levelIndex++;
+    }
+    const VirtualTextureLevel& level = vtLevels[levelIndex];
+    uint32_t pageInLevel = page - level.firstPage;
+    uint32_t originX = (pageInLevel % level.pagesX) * VT_PAGE_SIZE;
+    uint32_t originY = (pageInLevel / level.pagesX) * VT_PAGE_SIZE;
+
+    for (uint32_t y = 0; y < VT_PAGE_SIZE; y++) {
+        uint32_t srcY = std::min(originY + y, level.height - 1);
+        for (uint32_t x = 0; x < VT_PAGE_SIZE; x++) {
+            uint32_t srcX = std::min(originX + x, level.width - 1);
+            memcpy(dst + (y * VT_PAGE_SIZE + x) * 4, &level.pixels[(srcY * level.width + srcX) * 4], 4);
+        }
+    }
+}
+
+void Application::copyPageToCache(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, uint32_t slot) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+
+    region.imageOffset = { 
+        static_cast<int32_t>((slot % VT_CACHE_PAGES_PER_SIDE) * VT_PAGE_SIZE), 
+        static_cast<int32_t>((slot / VT_CACHE_PAGES_PER_SIDE) * VT_PAGE_SIZE), 
+        0 
+    };
+    region.imageExtent = { VT_PAGE_SIZE, VT_PAGE_SIZE, 1 };
+    vkCmdCopyBufferToImage(commandBuffer, buffer, vtCacheImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
+
+void Application::cleanupVirtualTexture() {
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        vkDestroyBuffer(device, vtPageTableBuffers[i], nullptr);
+        freeMemory(vtPageTableBuffersMemory[i]);
+        vkDestroyBuffer(device, vtFeedbackBuffers[i], nullptr);
+        freeMemory(vtFeedbackBuffersMemory[i]);
+        vkDestroyBuffer(device, vtStagingBuffers[i], nullptr);
+        freeMemory(vtStagingBuffersMemory[i]);
+    }
+    vkDestroySampler(device, vtCacheSampler, nullptr);
+    vkDestroyImageView(device, vtCacheImageView, nullptr);
+    imageStates.forget(vtCacheImage);
+    vkDestroyImage(device, vtCacheImage, nullptr);
+    freeMemory(vtCacheImageMemory);
+}
+
+void Application::createRenderGraph() {
+    renderGraph.clear();
+    // Mostly found on tilers. Desktop GPUs have no such memory type, and 
+    // there the attachments stay in plain device local memory.
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+    uint32_t lazyMemoryTypes = 0;
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+        if (memProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) {
+            lazyMemoryTypes |= 1u << i;
+        }
+    }
+    renderGraph.setLazyAllocation(lazyMemoryTypes != 0);
+    // The acquire semaphore is waited on at the color attachment output 
+    // stage, so the first barrier on the swap chain image chains to it
+    backbufferResource = renderGraph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT,
+        { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, 0 },
+        { VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_NONE_KHR, 0 });
+    bool deferred = shadingPath == ShadingPath::Deferred;
+    // Deferred lighting reads depth back as an input attachment
+    depthResource = renderGraph.createImage("depth", { findDepthFormat(), swapChainExtent, 
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (deferred ? VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT : 0), 
+        VK_IMAGE_ASPECT_DEPTH_BIT, msaaSamples });
+    const ImageUse colorWrite = { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR };
+
+    uint32_t scenePass = renderGraph.addPass("scene", [this](VkCommandBuffer commandBuffer) {
+        recordScenePass(commandBuffer);
+    });
+    // The resolve writes its target in the color attachment output stage,
+    // like rendering to it directly
+    if (upscaleMode == UpscaleMode::Off) {
+        renderGraph.write(scenePass, backbufferResource, colorWrite);
+    } else {
+        // Sampled afterwards, so never lazily allocated
+        sceneColorResource = renderGraph.createImage("scene color", { swapChainImageFormat, swapChainExtent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+        renderGraph.write(scenePass, sceneColorResource, colorWrite);
+        uint32_t upscalePass = renderGraph.addPass("upscale", [this](VkCommandBuffer commandBuffer) {
+            recordUpscalePass(commandBuffer);
+        });
+        renderGraph.read(upscalePass, sceneColorResource, { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR });
+        renderGraph.write(upscalePass, backbufferResource, colorWrite);
+    }
+    if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+        msaaColorResource = renderGraph.createImage("msaa color", { swapChainImageFormat, swapChainExtent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT, msaaSamples });
+        renderGraph.write(scenePass, msaaColorResource, colorWrite);
+    }
+    renderGraph.write(scenePass, depthResource, { VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR, 
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR });
+    if (deferred) {
+        // Written and read within the scene pass only, so lazily allocated
+        // where the device allows
+        gbufferAlbedoResource = renderGraph.createImage("gbuffer albedo", { GBUFFER_ALBEDO_FORMAT, swapChainExtent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+        gbufferNormalResource = renderGraph.createImage("gbuffer normal", { GBUFFER_NORMAL_FORMAT, swapChainExtent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+        renderGraph.write(scenePass, gbufferAlbedoResource, colorWrite);
+        renderGraph.write(scenePass, gbufferNormalResource, colorWrite);
+    }
+
+    // Transient images are created while compiling, since their memory 
+    // requirements decide which of them can share memory
+    renderGraphImages.assign(renderGraph.imageCount(), VK_NULL_HANDLE);
+    renderGraphImageViews.assign(renderGraph.imageCount(), VK_NULL_HANDLE);
+    renderGraph.compile([this](uint32_t image) {
+        const RenderGraph::ImageDesc& desc = renderGraph.getDesc(image);
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.extent.width = desc.extent.width;
+        imageInfo.extent.height = desc.extent.height;
+        imageInfo.extent.depth = 1;
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.format = desc.format;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageInfo.usage = desc.usage;
+        imageInfo.samples = desc.samples;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateImage(device, &imageInfo, nullptr, &renderGraphImages[image]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create render graph image!");
+        }
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(device, renderGraphImages[image], &memRequirements);
+        return memRequirements;
+    });
+
+    const auto& slots = renderGraph.getSlots();
+    renderGraphMemory.assign(slots.size(), VK_NULL_HANDLE);
+    for (size_t i = 0; i < slots.size(); i++) {
+        // Transient attachments may still refuse lazy memory
+        VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        if (slots[i].lazy && (slots[i].memoryTypeBits & lazyMemoryTypes)) {
+            properties |= VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+        }
+        uint32_t memoryTypeIndex = findMemoryType(slots[i].memoryTypeBits, properties);
+        if (allocateMemory(slots[i].size, memoryTypeIndex, MemoryCategory::Attachment, renderGraphMemory[i]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate render graph memory!");
+        }
+    }
+    for (uint32_t i = 0; i < renderGraph.imageCount(); i++) {
+        uint32_t slot = renderGraph.getSlot(i);
+        if (renderGraph.isImported(i) || slot == RenderGraph::NO_SLOT) {
+            continue;
+        }
+        // Images sharing a slot alias at offset 0
+        vkBindImageMemory(device, renderGraphImages[i], renderGraphMemory[slot], 0);
+        const RenderGraph::ImageDesc& desc = renderGraph.getDesc(i);
+        renderGraphImageViews[i] = createImageView(renderGraphImages[i], desc.format, desc.aspect);
+    }
+
+    const RenderGraph::Stats& stats = renderGraph.getStats();
+    std::cout << "render graph at " << swapChainExtent.width << 'x' << swapChainExtent.height << ": " 
+        << stats.passes - stats.culledPasses << '/' << stats.passes << " passes, " 
+        << stats.barriers << " barriers in " << stats.barrierBatches << " batches, " 
+        << stats.transientBytes / (1024.0 * 1024.0) << " MiB transient memory (" 
+        << stats.unaliasedBytes / (1024.0 * 1024.0) << " MiB without aliasing), of which " 
+        << stats.lazyBytes / (1024.0 * 1024.0) << " MiB lazily allocated\n";
 }
 
-void Application::createDepthResources() {
-    VkFormat depthFormat = findDepthFormat();
-    createImage(swapChainExtent.width, swapChainExtent.height, depthFormat, 
-        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
-    depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
-    // This will be automatically completed in the render pass
-    // transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+void Application::destroyRenderGraphImages(bool retire) {
+    for (uint32_t i = 0; i < renderGraphImages.size(); i++) {
+        // Imported images belong to their owner, e.g. the swap chain
+        if (renderGraph.isImported(i)) {
+            continue;
+        }
+        if (retire) {
+            retireImage(renderGraphImages[i], renderGraphImageViews[i], VK_NULL_HANDLE);
+        } else {
+            vkDestroyImageView(device, renderGraphImageViews[i], nullptr);
+            vkDestroyImage(device, renderGraphImages[i], nullptr);
+        }
+    }
+    // Freed after the images bound to them
+    for (auto memory : renderGraphMemory) {
+        if (retire) {
+            retireImage(VK_NULL_HANDLE, VK_NULL_HANDLE, memory);
+        } else {
+            freeMemory(memory);
+        }
+    }
+    renderGraphImages.clear();
+    renderGraphImageViews.clear();
+    renderGraphMemory.clear();
 }
 
 VkFormat Application::findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling,
@@ -1527,66 +7067,506 @@ VkFormat Application::findSupportedFormat(const std::vector<VkFormat>& candidate
         } else if (tiling == VK_IMAGE_TILING_OPTIMAL && (props.optimalTilingFeatures & features) == features) {
             return format;
         }
-        throw std::runtime_error("failed to find supported format!");
     }
-}
+    throw std::runtime_error("failed to find supported format!");
+}
+
+VkFormat Application::findDepthFormat() {
+    // Float first: reverse-Z relies on the precision of floats near 0. 
+    // With the fixed point fallback depth is merely as precise as before.
+    return findSupportedFormat(
+        { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+    );
+}
+
+bool Application::hasStencilComponent(VkFormat format) {
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+void Application::createCommandBuffer() {
+    commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    // Primary: Can be submitted for execution, but cannot be called from other command buffers
+    // Secondary: cannot be submitted, but can be called from primary command buffers
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+
+    if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffers!");
+    }
+}
+
+void Application::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    PROFILE_ZONE("recordCommandBuffer");
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = 0; // Optional
+    beginInfo.pInheritanceInfo = nullptr; // Optional
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+    if (gpuTimingSupported) {
+        vkCmdResetQueryPool(commandBuffer, timestampQueryPool, currentFrame * 2, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, currentFrame * 2);
+    }
+    // Outside any render pass, as resets must be
+    if (pipelineStatisticsSupported) {
+        vkCmdResetQueryPool(commandBuffer, statisticsQueryPool, currentFrame * DRAW_GROUP_COUNT, DRAW_GROUP_COUNT);
+    }
+    vkCmdResetQueryPool(commandBuffer, occlusionQueryPool, currentFrame * DRAW_GROUP_COUNT, DRAW_GROUP_COUNT);
+    statisticsPrepass[currentFrame] = enableDepthPrepass;
+
+    imageStates.resetStats();
+    if (enableVirtualTexturing) {
+        recordVirtualTextureUploads(commandBuffer);
+    }
+    // Sampled by the scene pass. Normally already the case, so no barrier 
+    // is recorded.
+    imageStates.require(enableVirtualTexturing ? vtCacheImage : textureImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+
+    if (upscaleMode != UpscaleMode::Off && upscaleDescriptorViews[currentFrame] != renderGraphImageViews[sceneColorResource]) {
+        // The frame that last used this slot has completed, so its set
+        // can be written
+        VkDescriptorImageInfo imageInfo{};
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo.imageView = renderGraphImageViews[sceneColorResource];
+        imageInfo.sampler = upscaleSampler;
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = upscaleDescriptorSets[currentFrame];
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+        upscaleDescriptorViews[currentFrame] = imageInfo.imageView;
+    }
+
+    if (shadingPath == ShadingPath::Deferred && deferredDescriptorViews[currentFrame] != renderGraphImageViews[gbufferAlbedoResource]) {
+        // The G-buffer views are recreated together, so the albedo view 
+        // stands for all three
+        std::array<VkDescriptorImageInfo, 3> imageInfos{};
+        imageInfos[0].imageView = renderGraphImageViews[gbufferAlbedoResource];
+        imageInfos[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfos[1].imageView = renderGraphImageViews[gbufferNormalResource];
+        imageInfos[1].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfos[2].imageView = renderGraphImageViews[depthResource];
+        imageInfos[2].imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = deferredDescriptorSets[currentFrame];
+        descriptorWrite.dstBinding = 1;
+        descriptorWrite.dstArrayElement = 0;
+        // Consecutive bindings of the same type are written in one go
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        descriptorWrite.descriptorCount = static_cast<uint32_t>(imageInfos.size());
+        descriptorWrite.pImageInfo = imageInfos.data();
+        vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+        deferredDescriptorViews[currentFrame] = imageInfos[0].imageView;
+    }
+
+    recordLightCulling(commandBuffer);
+
+    // The imported swap chain image changes from frame to frame
+    recordImageIndex = imageIndex;
+    renderGraphImages[backbufferResource] = swapChainImages[imageIndex];
+    renderStats = RenderStats{};
+    recordShadowPasses(commandBuffer);
+    renderGraph.execute(commandBuffer, renderGraphImages, pfnCmdPipelineBarrier2);
+    renderStats.barriers = renderGraph.getStats().barriers + imageStates.getStats().barriers;
+    renderStats.skippedBarriers = imageStates.getStats().skipped;
+
+    if (enableVirtualTexturing) {
+        // Make the feedback written by the fragment shader visible to 
+        // the host once the frame's fence is signaled
+        VkBufferMemoryBarrier feedbackBarrier{};
+        feedbackBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        feedbackBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        feedbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        feedbackBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        feedbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        feedbackBarrier.buffer = vtFeedbackBuffers[currentFrame];
+        feedbackBarrier.offset = 0;
+        feedbackBarrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 
+            0, 0, nullptr, 1, &feedbackBarrier, 0, nullptr);
+    }
+
+    if (gpuTimingSupported) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, currentFrame * 2 + 1);
+        timestampsWritten[currentFrame] = true;
+        timestampSamples[currentFrame] = msaaSamples;
+        timestampShading[currentFrame] = static_cast<uint32_t>(static_cast<uint32_t>(shadingPath) * LIGHT_COUNTS.size() + lightCountIndex);
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer!");
+    }
+}
+
+void Application::recordLightCulling(VkCommandBuffer commandBuffer) {
+    static auto startTime = std::chrono::steady_clock::now();
+
+    // The buffers of this slot were last used by a frame that has 
+    // completed, so they can be overwritten right away
+    VkBuffer clusterBuffer = clusterBuffers[currentFrame];
+    vkCmdFillBuffer(commandBuffer, clusterBuffer, 0, sizeof(uint32_t) * CLUSTER_COUNT, 0);
+    VkBufferMemoryBarrier clearBarrier{};
+    clearBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    clearBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    clearBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    clearBarrier.buffer = clusterBuffer;
+    clearBarrier.offset = 0;
+    clearBarrier.size = sizeof(uint32_t) * CLUSTER_COUNT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 
+        0, 0, nullptr, 1, &clearBarrier, 0, nullptr);
+
+    LightCullingPushConstants pushConstants{};
+    pushConstants.lightCount = LIGHT_COUNTS[lightCountIndex];
+    pushConstants.time = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    pushConstants.bin = shadingPath == ShadingPath::Clustered ? 1 : 0;
+    if (pushConstants.lightCount > 0) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullingPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullingPipelineLayout, 0, 1, 
+            &lightCullingDescriptorSets[currentFrame], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, lightCullingPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 
+            0, sizeof(LightCullingPushConstants), &pushConstants);
+        vkCmdDispatch(commandBuffer, (pushConstants.lightCount + LIGHT_CULLING_GROUP_SIZE - 1) / LIGHT_CULLING_GROUP_SIZE, 1, 1);
+    }
+    if (pushConstants.lightCount > 0 && pushConstants.bin) {
+        // Which lights win the appends of an overflowing cluster varies 
+        // from frame to frame. One workgroup per cluster rewrites those 
+        // with their lowest-index lights, from the lights written above.
+        std::array<VkBufferMemoryBarrier, 2> binBarriers{};
+        for (auto& barrier : binBarriers) {
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+        }
+        binBarriers[0].buffer = frameLightBuffers[currentFrame];
+        binBarriers[1].buffer = clusterBuffer;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 
+            0, 0, nullptr, static_cast<uint32_t>(binBarriers.size()), binBarriers.data(), 0, nullptr);
+        pushConstants.bin = 2;
+        vkCmdPushConstants(commandBuffer, lightCullingPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 
+            0, sizeof(LightCullingPushConstants), &pushConstants);
+        vkCmdDispatch(commandBuffer, CLUSTER_COUNT, 1, 1);
+    }
 
-VkFormat Application::findDepthFormat() {
-    return findSupportedFormat(
-        { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
-    );
+    // The deferred light pass reads the lights from its vertex shader too
+    std::array<VkBufferMemoryBarrier, 2> barriers{};
+    for (auto& barrier : barriers) {
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+    }
+    barriers[0].buffer = frameLightBuffers[currentFrame];
+    barriers[1].buffer = clusterBuffer;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 
+        0, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
 }
 
-bool Application::hasStencilComponent(VkFormat format) {
-    return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
-}
+void Application::recordShadowPasses(VkCommandBuffer commandBuffer) {
+    const VkPipelineStageFlags2KHR depthStages = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR;
+    const VkAccessFlags2KHR depthAccess = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR;
+    VkRenderPassBeginInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = shadowRenderPass;
+    renderPassInfo.renderArea.offset = { 0, 0 };
+    renderPassInfo.renderArea.extent = { SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE };
 
-void Application::createCommandBuffer() {
-    commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    std::array<bool, SHADOW_CASCADE_COUNT> stale{};
+    bool anyStale = false;
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        stale[i] = cachedStaticVersion[i] != staticSceneVersion || cachedCascadeViewProj[i] != cascadeViewProj[i];
+        anyStale = anyStale || stale[i];
+    }
+    if (anyStale) {
+        imageStates.require(shadowCacheImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, depthStages, depthAccess);
+        imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+        renderPassInfo.framebuffer = shadowCacheFramebuffer;
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        beginDrawGroup(commandBuffer, DrawGroup::StaticShadows);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowPipeline);
+        for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+            if (!stale[i]) {
+                continue;
+            }
+            const SkylineAllocator::Rect& rect = cascadeRects[i];
+            VkClearAttachment clear{};
+            clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+            clear.clearValue.depthStencil = { 1.0f, 0 };
+            VkClearRect clearRect{};
+            clearRect.rect = { { static_cast<int32_t>(rect.x), static_cast<int32_t>(rect.y) }, { rect.width, rect.height } };
+            clearRect.baseArrayLayer = 0;
+            clearRect.layerCount = 1;
+            vkCmdClearAttachments(commandBuffer, 1, &clear, 1, &clearRect);
+            drawShadowCasters(commandBuffer, i, true);
+            cachedCascadeViewProj[i] = cascadeViewProj[i];
+            cachedStaticVersion[i] = staticSceneVersion;
+            renderStats.staticShadowRenders++;
+        }
+        endDrawGroup(commandBuffer, DrawGroup::StaticShadows);
+        vkCmdEndRenderPass(commandBuffer);
+    }
 
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = commandPool;
-    // Primary: Can be submitted for execution, but cannot be called from other command buffers
-    // Secondary: cannot be submitted, but can be called from primary command buffers
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+    // The cached static depth becomes the starting point of this frame's
+    // atlas
+    imageStates.require(shadowCacheImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_READ_BIT_KHR);
+    imageStates.require(shadowAtlasImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    std::array<VkImageCopy, SHADOW_CASCADE_COUNT> regions{};
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        const SkylineAllocator::Rect& rect = cascadeRects[i];
+        regions[i].srcSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 0, 1 };
+        regions[i].srcOffset = { static_cast<int32_t>(rect.x), static_cast<int32_t>(rect.y), 0 };
+        regions[i].dstSubresource = regions[i].srcSubresource;
+        regions[i].dstOffset = regions[i].srcOffset;
+        regions[i].extent = { rect.width, rect.height, 1 };
+    }
+    vkCmdCopyImage(commandBuffer, shadowCacheImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
+        shadowAtlasImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
 
-    if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate command buffers!");
+    imageStates.require(shadowAtlasImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, depthStages, depthAccess);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
+    renderPassInfo.framebuffer = shadowAtlasFramebuffer;
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    beginDrawGroup(commandBuffer, DrawGroup::DynamicShadows);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shadowPipeline);
+    for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+        drawShadowCasters(commandBuffer, i, false);
     }
+    endDrawGroup(commandBuffer, DrawGroup::DynamicShadows);
+    vkCmdEndRenderPass(commandBuffer);
+
+    // Sampled by the scene pass, and the deferred ambient pass
+    imageStates.require(shadowAtlasImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    imageStates.flush(commandBuffer, pfnCmdPipelineBarrier2);
 }
 
-void Application::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = 0; // Optional
-    beginInfo.pInheritanceInfo = nullptr; // Optional
+void Application::drawShadowCasters(VkCommandBuffer commandBuffer, uint32_t cascade, bool staticCasters) {
+    const SkylineAllocator::Rect& rect = cascadeRects[cascade];
+    VkViewport viewport{};
+    viewport.x = static_cast<float>(rect.x);
+    viewport.y = static_cast<float>(rect.y);
+    viewport.width = static_cast<float>(rect.width);
+    viewport.height = static_cast<float>(rect.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    VkRect2D scissor{};
+    scissor.offset = { static_cast<int32_t>(rect.x), static_cast<int32_t>(rect.y) };
+    scissor.extent = { rect.width, rect.height };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-        throw std::runtime_error("failed to begin recording command buffer!");
+    // Casters outside the view still cast into it, so every draw of the 
+    // scene is considered, not only the visible ones
+    for (const auto& draw : sceneDraws) {
+        if (draw.isStatic != staticCasters) {
+            continue;
+        }
+        const Mesh& mesh = meshes[draw.meshIndex];
+        VkDeviceSize offset = 0;
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mesh.positionBuffer, &offset);
+        vkCmdBindIndexBuffer(commandBuffer, mesh.indexBuffer, 0, mesh.indexType);
+        ShadowPushConstants pushConstants{};
+        pushConstants.model = draw.model;
+        pushConstants.viewProj = cascadeViewProj[cascade];
+        vkCmdPushConstants(commandBuffer, shadowPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(ShadowPushConstants), &pushConstants);
+        vkCmdDrawIndexed(commandBuffer, draw.indexCount, 1, draw.firstIndex, 0, 0);
+        renderStats.shadowDraws++;
     }
+}
 
+void Application::recordScenePass(VkCommandBuffer commandBuffer) {
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = renderPass;
-    renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+    renderPassInfo.framebuffer = swapChainFramebuffers[recordImageIndex];
 
+    // Only the rendered part of the scene color target is cleared and 
+    // drawn to
     renderPassInfo.renderArea.offset = { 0, 0 };
-    renderPassInfo.renderArea.extent = swapChainExtent;
+    renderPassInfo.renderArea.extent = renderExtent;
 
-    std::array<VkClearValue, 2> clearValues{};
+    // Indexed by attachment: the resolve attachment's value is unused
+    bool deferred = shadingPath == ShadingPath::Deferred;
+    std::array<VkClearValue, 4> clearValues{};
     clearValues[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
-    clearValues[1].depthStencil = { 1.0f, 0 };
+    // Reverse-Z: the far end is 0
+    clearValues[1].depthStencil = { 0.0f, 0 };
+    clearValues[2].color = { {0.0f, 0.0f, 0.0f, 0.0f} };
+    clearValues[3].color = { {0.0f, 0.0f, 0.0f, 0.0f} };
 
-    renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.clearValueCount = deferred ? 4 : 2;
     renderPassInfo.pClearValues = clearValues.data();
 
     vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = static_cast<float>(renderExtent.width);
+    viewport.height = static_cast<float>(renderExtent.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.offset = { 0, 0 };
+    scissor.extent = renderExtent;
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    if (enableDepthPrepass) {
+        beginDrawGroup(commandBuffer, DrawGroup::DepthPrepass);
+        recordDepthPrepass(commandBuffer);
+        endDrawGroup(commandBuffer, DrawGroup::DepthPrepass);
+        vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+    }
+    beginDrawGroup(commandBuffer, DrawGroup::Scene);
+
+    // Draws come in key order, so state only has to be bound when it 
+    // differs from the previous draw's
+    VkPipeline boundPipeline = VK_NULL_HANDLE;
+    VkDescriptorSet boundDescriptorSet = VK_NULL_HANDLE;
+    VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+    VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+    for (const auto& entry : renderQueue.getEntries()) {
+        const auto& item = drawItems[entry.item];
+
+        VkPipeline pipeline = pipelines[item.pipelineIndex];
+        if (pipeline != boundPipeline) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            boundPipeline = pipeline;
+            renderStats.pipelineBinds++;
+        }
+        // All materials share the frame's descriptor set for now; 
+        // materialIndex selects within it through the push constants
+        VkDescriptorSet descriptorSet = descriptorSets[currentFrame];
+        if (descriptorSet != boundDescriptorSet) {
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+            boundDescriptorSet = descriptorSet;
+            renderStats.descriptorSetBinds++;
+        }
+        const Mesh& mesh = meshes[item.meshIndex];
+        if (mesh.vertexBuffer != boundVertexBuffer) {
+            VkBuffer vertexBuffers[] = { mesh.vertexBuffer };
+            VkDeviceSize offsets[] = { 0 };
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+            boundVertexBuffer = mesh.vertexBuffer;
+            renderStats.vertexBufferBinds++;
+        }
+        if (mesh.indexBuffer != boundIndexBuffer) {
+            vkCmdBindIndexBuffer(commandBuffer, mesh.indexBuffer, 0, mesh.indexType);
+            boundIndexBuffer = mesh.indexBuffer;
+            renderStats.indexBufferBinds++;
+        }
+
+        PushConstants pushConstants{};
+        pushConstants.model = item.model;
+        pushConstants.materialIndex = item.materialIndex;
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 
+            0, sizeof(PushConstants), &pushConstants);
+        vkCmdDrawIndexed(commandBuffer, item.indexCount, 1, item.firstIndex, 0, 0);
+        renderStats.draws++;
+    }
+    endDrawGroup(commandBuffer, DrawGroup::Scene);
+
+    if (deferred) {
+        // Lighting subpass: ambient over the whole G-buffer, then one 
+        // rectangle per light, blended additively
+        vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+        beginDrawGroup(commandBuffer, DrawGroup::DeferredLighting);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, deferredPipelineLayout, 0, 1, 
+            &deferredDescriptorSets[currentFrame], 0, nullptr);
+        DeferredPushConstants pushConstants{};
+        pushConstants.invExtent = glm::vec2(1.0f / renderExtent.width, 1.0f / renderExtent.height);
+        pushConstants.zNear = camera.getNear();
+        vkCmdPushConstants(commandBuffer, deferredPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 
+            0, sizeof(DeferredPushConstants), &pushConstants);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, deferredAmbientPipeline);
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        renderStats.pipelineBinds++;
+        renderStats.descriptorSetBinds++;
+        renderStats.draws++;
+        uint32_t lightCount = LIGHT_COUNTS[lightCountIndex];
+        if (lightCount > 0) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, deferredLightPipeline);
+            vkCmdDraw(commandBuffer, 4, lightCount, 0, 0);
+            renderStats.pipelineBinds++;
+            renderStats.draws++;
+        }
+        endDrawGroup(commandBuffer, DrawGroup::DeferredLighting);
+    }
+    
+    vkCmdEndRenderPass(commandBuffer);
+}
+
+void Application::recordDepthPrepass(VkCommandBuffer commandBuffer) {
+    // The same draws in the same order as the color subpass, so the same
+    // pipeline is bound throughout
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, depthPrepassPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
+    renderStats.pipelineBinds++;
+    renderStats.descriptorSetBinds++;
+    VkBuffer boundPositionBuffer = VK_NULL_HANDLE;
+    VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+    for (const auto& entry : renderQueue.getEntries()) {
+        const auto& item = drawItems[entry.item];
+        const Mesh& mesh = meshes[item.meshIndex];
+        if (mesh.positionBuffer != boundPositionBuffer) {
+            VkDeviceSize offset = 0;
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mesh.positionBuffer, &offset);
+            boundPositionBuffer = mesh.positionBuffer;
+            renderStats.vertexBufferBinds++;
+        }
+        if (mesh.indexBuffer != boundIndexBuffer) {
+            vkCmdBindIndexBuffer(commandBuffer, mesh.indexBuffer, 0, mesh.indexType);
+            boundIndexBuffer = mesh.indexBuffer;
+            renderStats.indexBufferBinds++;
+        }
+
+        PushConstants pushConstants{};
+        pushConstants.model = item.model;
+        pushConstants.materialIndex = item.materialIndex;
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 
+            0, sizeof(PushConstants), &pushConstants);
+        vkCmdDrawIndexed(commandBuffer, item.indexCount, 1, item.firstIndex, 0, 0);
+        renderStats.prepassDraws++;
+    }
+}
+
+void Application::recordUpscalePass(VkCommandBuffer commandBuffer) {
+    VkRenderPassBeginInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = upscaleRenderPass;
+    renderPassInfo.framebuffer = upscaleFramebuffers[recordImageIndex];
+    renderPassInfo.renderArea.offset = { 0, 0 };
+    renderPassInfo.renderArea.extent = swapChainExtent;
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
     VkViewport viewport{};
     viewport.x = 0.0f;
@@ -1602,31 +7582,63 @@ void Application::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t im
     scissor.extent = swapChainExtent;
     vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-    VkBuffer vertexBuffers[] = { vertexBuffer };
-    VkDeviceSize offsets[] = { 0 };
-    vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, upscalePipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, upscalePipelineLayout, 0, 1, 
+        &upscaleDescriptorSets[currentFrame], 0, nullptr);
+    UpscalePushConstants pushConstants{};
+    pushConstants.uvScale = glm::vec2(renderExtent.width / static_cast<float>(swapChainExtent.width), 
+        renderExtent.height / static_cast<float>(swapChainExtent.height));
+    pushConstants.texelSize = glm::vec2(1.0f / swapChainExtent.width, 1.0f / swapChainExtent.height);
+    // Sharpen more the more the image is magnified: not at all at native 
+    // resolution, fully at MIN_RENDER_SCALE
+    float magnification = (MAX_RENDER_SCALE - resolutionScaler.getScale()) / (MAX_RENDER_SCALE - MIN_RENDER_SCALE);
+    pushConstants.sharpness = upscaleMode == UpscaleMode::EdgeAware ? std::clamp(magnification, 0.0f, 1.0f) : 0.0f;
+    vkCmdPushConstants(commandBuffer, upscalePipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 
+        0, sizeof(UpscalePushConstants), &pushConstants);
+    // Fullscreen triangle generated from the vertex index
+    beginDrawGroup(commandBuffer, DrawGroup::Upscale);
+    vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+    endDrawGroup(commandBuffer, DrawGroup::Upscale);
 
-    vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
-    
     vkCmdEndRenderPass(commandBuffer);
-
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-        throw std::runtime_error("failed to record command buffer!");
-    }
 }
 
 void Application::drawFrame() {
-    // Wait for the previous frame
-    // Note that Fence blocks the host (i.e., CPU)
-    // VK_TRUE: wait for all fences (to become signaled) in the array
+    PROFILE_ZONE("drawFrame");
+    // Wait until the frame that last used this slot has completed, i.e. 
+    // at most framesInFlight - 1 frames are queued ahead of this one.
+    // This CPU-side wait is what bounds the latency.
+    // Note that it blocks the host (i.e., CPU)
     // UINT64_MAX: disable timeout
-    vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+    uint64_t waitValue = frameCount + 1 >= framesInFlight ? frameCount + 1 - framesInFlight : 0;
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &frameTimeline;
+    waitInfo.pValues = &waitValue;
+    auto blockedStart = std::chrono::steady_clock::now();
+    {
+        PROFILE_ZONE("waitForFrame");
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    }
+    deletionQueue.flush(completedFrameCount());
+    if (readGpuFrameTime() && upscaleMode != UpscaleMode::Off) {
+        resolutionScaler.update(gpuFrameMs);
+    }
+    readPipelineStatistics();
+    checkMemoryBudget();
+    updateRenderExtent();
+    if (measureLatency) {
+        trackLatency();
+    }
 
     uint32_t imageIndex;
-    VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    VkResult result;
+    {
+        PROFILE_ZONE("acquireNextImage");
+        result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    }
+    frameBlockedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - blockedStart).count();
 
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         recreateSwapChain();
@@ -1635,12 +7647,18 @@ void Application::drawFrame() {
         throw std::runtime_error("failed to acquire swap chain image!");
     }
 
-    // Set fence to unsignaled
-    // Must delay this to after recreateSwapChain to avoid deadlock
-    vkResetFences(device, 1, &inFlightFences[currentFrame]);
+    // After acquiring, so that staged uploads are always recorded
+    if (enableVirtualTexturing) {
+        updateVirtualTexture(currentFrame);
+    }
 
+    updateDrawItems();
+    updateShadowCascades();
     vkResetCommandBuffer(commandBuffers[currentFrame], 0);
     recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+    if (showRenderStats) {
+        reportRenderStats();
+    }
 
     updateUniformBuffer(currentFrame);
 
@@ -1659,13 +7677,32 @@ void Application::drawFrame() {
     submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 
     // Which semaphores to signal once the command buffer(s) has finished execution
-    VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
-    submitInfo.signalSemaphoreCount = 1;
+    // The binary semaphore is for presentation, which cannot wait on a timeline
+    VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame], frameTimeline };
+    submitInfo.signalSemaphoreCount = 2;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
-    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
-        throw std::runtime_error("failed to submit draw command buffer!");
+    // Values are ignored for binary semaphores
+    uint64_t waitValues[] = { 0 };
+    uint64_t signalValues[] = { 0, frameCount + 1 };
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = waitValues;
+    timelineInfo.signalSemaphoreValueCount = 2;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
+    submitInfo.pNext = &timelineInfo;
+
+    {
+        PROFILE_ZONE("queueSubmit");
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit draw command buffer!");
+        }
     }
+    if (measureLatency) {
+        latencyPending.emplace_back(frameCount, inputSampleTime);
+    }
+    frameCount++;
 
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1678,64 +7715,688 @@ void Application::drawFrame() {
     presentInfo.pSwapchains = swapChains;
     presentInfo.pImageIndices = &imageIndex;
 
-    presentInfo.pResults = nullptr; // Optional
+    presentInfo.pResults = nullptr; // Optional
+
+    // Tag the present so its actual display time can be queried later
+    VkPresentTimeGOOGLE presentTime{};
+    presentTime.presentID = ++presentId;
+    presentTime.desiredPresentTime = 0;
+    VkPresentTimesInfoGOOGLE presentTimesInfo{};
+    presentTimesInfo.sType = VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE;
+    presentTimesInfo.swapchainCount = 1;
+    presentTimesInfo.pTimes = &presentTime;
+    if (displayTimingSupported) {
+        presentInfo.pNext = &presentTimesInfo;
+    }
+
+    auto presentStart = std::chrono::steady_clock::now();
+    {
+        PROFILE_ZONE("queuePresent");
+        result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    }
+    // Some implementations block in present rather than in acquire
+    frameBlockedMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - presentStart).count();
+    if (measureLatency && displayTimingSupported) {
+        displayLatencyPending.emplace_back(presentId, inputSampleTime);
+    }
+    trackPresentTiming();
+    bool resized = framebufferResized.exchange(false);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || resized || presentPolicyChanged) {
+        presentPolicyChanged = false;
+        recreateSwapChain();
+    } else if (result != VK_SUCCESS) {
+        throw std::runtime_error("failed to present swap chain image!");
+    }
+    currentFrame = (currentFrame + 1) % framesInFlight;
+
+    if (measureLatency) {
+        // Catch frames that finished while recording, so that short queues
+        // are not only observed at the next wait
+        trackLatency();
+    }
+}
+
+void Application::createSyncObjects() {
+    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
+
+            throw std::runtime_error("failed to create synchronization objects for a frame!");
+        }
+    }
+
+    VkSemaphoreTypeCreateInfo timelineInfo{};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timelineInfo.initialValue = 0;
+    semaphoreInfo.pNext = &timelineInfo;
+    if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &frameTimeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create frame timeline semaphore!");
+    }
+}
+
+void Application::createTimestampQueries() {
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+    uint32_t validBits = queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits;
+    gpuTimingSupported = validBits > 0 && deviceProperties.limits.timestampPeriod > 0.0f;
+    if (!gpuTimingSupported) {
+        std::cout << "GPU frame timing: not supported by the graphics queue\n";
+        return;
+    }
+    timestampPeriodNs = deviceProperties.limits.timestampPeriod;
+    timestampMask = validBits >= 64 ? UINT64_MAX : (uint64_t(1) << validBits) - 1;
+    timestampsWritten.assign(MAX_FRAMES_IN_FLIGHT, false);
+    timestampSamples.assign(MAX_FRAMES_IN_FLIGHT, VK_SAMPLE_COUNT_1_BIT);
+    timestampShading.assign(MAX_FRAMES_IN_FLIGHT, 0);
+
+    VkQueryPoolCreateInfo queryPoolInfo{};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+    if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timestamp query pool!");
+    }
+}
+
+bool Application::readGpuFrameTime() {
+    if (!gpuTimingSupported || !timestampsWritten[currentFrame]) {
+        return false;
+    }
+    // The frame has completed, so the results are available without waiting
+    std::array<uint64_t, 2> timestamps;
+    VkResult result = vkGetQueryPoolResults(device, timestampQueryPool, currentFrame * 2, 2, 
+        sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    timestampsWritten[currentFrame] = false;
+    if (result != VK_SUCCESS) {
+        return false;
+    }
+    gpuFrameMs = ((timestamps[1] - timestamps[0]) & timestampMask) * timestampPeriodNs / 1e6;
+    size_t index = 0;
+    while ((1u << index) < static_cast<uint32_t>(timestampSamples[currentFrame])) {
+        index++;
+    }
+    msaaGpuTimeSumMs[index] += gpuFrameMs;
+    msaaGpuTimeFrames[index]++;
+    shadingGpuTimeSumMs[timestampShading[currentFrame]] += gpuFrameMs;
+    shadingGpuTimeFrames[timestampShading[currentFrame]]++;
+    return true;
+}
+
+void Application::createStatisticsQueries() {
+    drawGroupsWritten.assign(MAX_FRAMES_IN_FLIGHT, 0);
+    statisticsPrepass.assign(MAX_FRAMES_IN_FLIGHT, false);
+
+    VkQueryPoolCreateInfo queryPoolInfo{};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_OCCLUSION;
+    queryPoolInfo.queryCount = DRAW_GROUP_COUNT * MAX_FRAMES_IN_FLIGHT;
+    if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &occlusionQueryPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create occlusion query pool!");
+    }
+
+    if (!pipelineStatisticsSupported) {
+        std::cout << "draw group statistics: pipeline statistics queries not supported, only counting samples\n";
+        return;
+    }
+    queryPoolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    queryPoolInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT 
+        | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT 
+        | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+    if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &statisticsQueryPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline statistics query pool!");
+    }
+}
+
+void Application::beginDrawGroup(VkCommandBuffer commandBuffer, DrawGroup group) {
+    uint32_t query = currentFrame * DRAW_GROUP_COUNT + static_cast<uint32_t>(group);
+    if (pipelineStatisticsSupported) {
+        vkCmdBeginQuery(commandBuffer, statisticsQueryPool, query, 0);
+    }
+    vkCmdBeginQuery(commandBuffer, occlusionQueryPool, query, occlusionQueryPrecise ? VK_QUERY_CONTROL_PRECISE_BIT : 0);
+}
+
+void Application::endDrawGroup(VkCommandBuffer commandBuffer, DrawGroup group) {
+    uint32_t query = currentFrame * DRAW_GROUP_COUNT + static_cast<uint32_t>(group);
+    if (pipelineStatisticsSupported) {
+        vkCmdEndQuery(commandBuffer, statisticsQueryPool, query);
+    }
+    vkCmdEndQuery(commandBuffer, occlusionQueryPool, query);
+    drawGroupsWritten[currentFrame] |= 1u << static_cast<uint32_t>(group);
+}
+
+void Application::readPipelineStatistics() {
+    uint32_t written = drawGroupsWritten[currentFrame];
+    drawGroupsWritten[currentFrame] = 0;
+    if (written == 0) {
+        return;
+    }
+    drawGroupsRead = 0;
+    // The frame has completed, so the results are available without 
+    // waiting. Groups the frame did not record were reset but never 
+    // begun, and are skipped.
+    for (uint32_t i = 0; i < DRAW_GROUP_COUNT; i++) {
+        if (!(written & (1u << i))) {
+            continue;
+        }
+        uint32_t query = currentFrame * DRAW_GROUP_COUNT + i;
+        DrawGroupStats stats{};
+        if (pipelineStatisticsSupported) {
+            std::array<uint64_t, 3> counters{};
+            if (vkGetQueryPoolResults(device, statisticsQueryPool, query, 1, sizeof(counters), counters.data(), 
+                    sizeof(counters), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+                continue;
+            }
+            stats.vertexInvocations = counters[0];
+            stats.clippingPrimitives = counters[1];
+            stats.fragmentInvocations = counters[2];
+        }
+        if (vkGetQueryPoolResults(device, occlusionQueryPool, query, 1, sizeof(uint64_t), &stats.samplesPassed, 
+                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+            continue;
+        }
+        drawGroupStats[i] = stats;
+        drawGroupsRead |= 1u << i;
+        DrawGroupStats& sum = drawGroupStatsSum[i];
+        sum.vertexInvocations += stats.vertexInvocations;
+        sum.clippingPrimitives += stats.clippingPrimitives;
+        sum.fragmentInvocations += stats.fragmentInvocations;
+        sum.samplesPassed += stats.samplesPassed;
+        drawGroupFrames[i]++;
+        if (i == static_cast<uint32_t>(DrawGroup::Scene) && pipelineStatisticsSupported) {
+            size_t index = statisticsPrepass[currentFrame] ? 1 : 0;
+            fragmentInvocationSum[index] += static_cast<double>(stats.fragmentInvocations);
+            fragmentInvocationFrames[index]++;
+        }
+    }
+}
+
+#if ENABLE_CPU_PROFILER
+void Application::writeCpuTrace() {
+    size_t zones = Profiler::instance().endCapture("cpu_trace.json");
+    std::cout << "cpu trace: " << zones << " zones written to cpu_trace.json\n";
+}
+#endif
+
+void Application::writeDrawGroupReport(const std::string& filename) {
+    BenchmarkReport report;
+    for (uint32_t i = 0; i < DRAW_GROUP_COUNT; i++) {
+        double frames = drawGroupFrames[i];
+        if (frames == 0) {
+            continue;
+        }
+        const DrawGroupStats& sum = drawGroupStatsSum[i];
+        std::string prefix = std::string("draw_groups.") + DRAW_GROUP_NAMES[i] + ".";
+        report.add(prefix + "frames", frames, "frames");
+        if (pipelineStatisticsSupported) {
+            report.add(prefix + "vertex_invocations", sum.vertexInvocations / frames, "per frame");
+            report.add(prefix + "clipping_primitives", sum.clippingPrimitives / frames, "per frame");
+            report.add(prefix + "fragment_invocations", sum.fragmentInvocations / frames, "per frame");
+        }
+        report.add(prefix + "samples_passed", sum.samplesPassed / frames, "per frame");
+    }
+    for (size_t i = 0; i < fragmentInvocationFrames.size(); i++) {
+        if (fragmentInvocationFrames[i] > 0) {
+            report.add(std::string("draw_groups.scene.fragment_invocations_prepass_") + (i ? "on" : "off"), 
+                fragmentInvocationSum[i] / fragmentInvocationFrames[i], "per frame");
+        }
+    }
+    report.write(filename);
+}
+
+void Application::queryMemoryBudget(VkPhysicalDeviceMemoryProperties& properties, VkPhysicalDeviceMemoryBudgetPropertiesEXT& budget) {
+    budget = {};
+    budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 properties2{};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    if (memoryBudgetSupported) {
+        properties2.pNext = &budget;
+    }
+    vkGetPhysicalDeviceMemoryProperties2(physicalDevice, &properties2);
+    properties = properties2.memoryProperties;
+}
+
+void Application::writeMemoryReport(const std::string& filename) {
+    VkPhysicalDeviceMemoryProperties properties;
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget;
+    queryMemoryBudget(properties, budget);
+    const double MiB = 1024.0 * 1024.0;
+    BenchmarkReport report;
+    for (uint32_t heap = 0; heap < properties.memoryHeapCount; heap++) {
+        std::string prefix = "memory.heap" + std::to_string(heap) + ".";
+        report.add(prefix + "device_local", (properties.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? 1 : 0, "bool");
+        report.add(prefix + "size", properties.memoryHeaps[heap].size / MiB, "MiB");
+        report.add(prefix + "tracked", memoryTracker.heapBytes(heap) / MiB, "MiB");
+        // Usage covers the whole process, and whatever else the driver put
+        // there, so it is at least the tracked bytes
+        if (memoryBudgetSupported) {
+            report.add(prefix + "usage", budget.heapUsage[heap] / MiB, "MiB");
+            report.add(prefix + "budget", budget.heapBudget[heap] / MiB, "MiB");
+        }
+        for (uint32_t category = 0; category < MEMORY_CATEGORY_COUNT; category++) {
+            const MemoryTracker::Usage& usage = memoryTracker.get(static_cast<MemoryCategory>(category), heap);
+            if (usage.peakBytes == 0) {
+                continue;
+            }
+            std::string name = prefix + MEMORY_CATEGORY_NAMES[category];
+            report.add(name, usage.bytes / MiB, "MiB");
+            report.add(name + "_allocations", usage.allocations, "allocations");
+            report.add(name + "_peak", usage.peakBytes / MiB, "MiB");
+        }
+    }
+    report.write(filename);
+}
+
+void Application::checkMemoryBudget() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - memoryBudgetCheckTime < std::chrono::seconds(1)) {
+        return;
+    }
+    memoryBudgetCheckTime = now;
+    VkPhysicalDeviceMemoryProperties properties;
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget;
+    queryMemoryBudget(properties, budget);
+    for (uint32_t heap = 0; heap < properties.memoryHeapCount; heap++) {
+        // Without the extension only our own allocations can be compared,
+        // against the size of the heap
+        VkDeviceSize used = memoryBudgetSupported ? budget.heapUsage[heap] : memoryTracker.heapBytes(heap);
+        VkDeviceSize limit = memoryBudgetSupported ? budget.heapBudget[heap] : properties.memoryHeaps[heap].size;
+        bool nearLimit = limit > 0 && used > limit * MEMORY_BUDGET_WARNING;
+        uint32_t bit = 1u << heap;
+        if (nearLimit && !(memoryBudgetWarnedHeaps & bit)) {
+            std::cout << "warning: memory heap " << heap << " uses " << used / (1024.0 * 1024.0) << " of " 
+                << limit / (1024.0 * 1024.0) << " MiB " << (memoryBudgetSupported ? "budget" : "heap size") 
+                << ", " << memoryTracker.heapBytes(heap) / (1024.0 * 1024.0) << " MiB of it tracked\n";
+        }
+        memoryBudgetWarnedHeaps = nearLimit ? memoryBudgetWarnedHeaps | bit : memoryBudgetWarnedHeaps & ~bit;
+    }
+}
+
+void Application::reportFragmentInvocations() {
+    for (size_t i = 0; i < fragmentInvocationFrames.size(); i++) {
+        if (fragmentInvocationFrames[i] > 0) {
+            std::cout << "depth pre-pass " << (i ? "on" : "off") << ": " 
+                << fragmentInvocationSum[i] / fragmentInvocationFrames[i] 
+                << " fragment shader invocations per frame over " << fragmentInvocationFrames[i] << " frames\n";
+        }
+    }
+}
+
+void Application::reportMsaaFrameTimes() {
+    for (size_t i = 0; i < msaaGpuTimeFrames.size(); i++) {
+        if (msaaGpuTimeFrames[i] > 0) {
+            std::cout << "MSAA " << (1u << i) << "x: " << msaaGpuTimeSumMs[i] / msaaGpuTimeFrames[i] 
+                << " ms GPU time per frame over " << msaaGpuTimeFrames[i] << " frames\n";
+        }
+    }
+}
+
+void Application::reportShadingFrameTimes() {
+    const char* names[] = { "forward", "clustered", "deferred" };
+    for (size_t i = 0; i < shadingGpuTimeFrames.size(); i++) {
+        if (shadingGpuTimeFrames[i] > 0) {
+            std::cout << names[i / LIGHT_COUNTS.size()] << " shading, " << LIGHT_COUNTS[i % LIGHT_COUNTS.size()] << " lights: " 
+                << shadingGpuTimeSumMs[i] / shadingGpuTimeFrames[i] << " ms GPU time per frame over " 
+                << shadingGpuTimeFrames[i] << " frames\n";
+        }
+    }
+}
+
+void Application::retireRenderPassObjects() {
+    for (auto pipeline : pipelines) {
+        retirePipeline(pipeline);
+    }
+    pipelines.clear();
+    if (deferredAmbientPipeline != VK_NULL_HANDLE) {
+        retirePipeline(deferredAmbientPipeline);
+        retirePipeline(deferredLightPipeline);
+        deferredAmbientPipeline = deferredLightPipeline = VK_NULL_HANDLE;
+    }
+    if (depthPrepassPipeline != VK_NULL_HANDLE) {
+        retirePipeline(depthPrepassPipeline);
+        depthPrepassPipeline = VK_NULL_HANDLE;
+    }
+    retireRenderPass(renderPass);
+}
+
+void Application::setShadingPath(ShadingPath path) {
+    if (path == shadingPath) {
+        return;
+    }
+    retireRenderPassObjects();
+    shadingPath = path;
+    if (path == ShadingPath::Deferred && msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+        // Input attachments would have to be read and lit per sample
+        msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+        std::cout << "MSAA: 1x, deferred shading is not multisampled\n";
+    }
+    createRenderPass();
+    createGraphicsPipeline();
+    rebuildRenderTargets();
+    const char* names[] = { "forward", "clustered", "deferred" };
+    std::cout << "shading: " << names[static_cast<int>(path)] << '\n';
+    if (gpuTimingSupported) {
+        reportShadingFrameTimes();
+    }
+}
+
+void Application::setDepthPrepass(bool enable) {
+    retireRenderPassObjects();
+    enableDepthPrepass = enable;
+    createRenderPass();
+    createGraphicsPipeline();
+    rebuildRenderTargets();
+    std::cout << "depth pre-pass: " << (enable ? "on" : "off") << '\n';
+    if (pipelineStatisticsSupported) {
+        reportFragmentInvocations();
+    }
+}
+
+void Application::setLightCount(uint32_t index) {
+    lightCountIndex = index;
+    // The count is part of the uniforms, so every frame's buffer is stale.
+    // Camera versions start at 1.
+    uniformBufferVersions.fill(0);
+    std::cout << "lights: " << LIGHT_COUNTS[index] << '\n';
+    if (gpuTimingSupported) {
+        reportShadingFrameTimes();
+    }
+}
+
+void Application::setSampleCount(VkSampleCountFlagBits samples) {
+    if (samples == msaaSamples) {
+        return;
+    }
+    if (shadingPath == ShadingPath::Deferred && samples != VK_SAMPLE_COUNT_1_BIT) {
+        std::cout << "MSAA is not available with deferred shading\n";
+        return;
+    }
+    retireRenderPassObjects();
+
+    msaaSamples = samples;
+    createRenderPass();
+    createGraphicsPipeline();
+    rebuildRenderTargets();
+    std::cout << "MSAA: " << static_cast<uint32_t>(msaaSamples) << "x\n";
+    if (gpuTimingSupported) {
+        reportMsaaFrameTimes();
+    }
+}
+
+void Application::setUpscaleMode(UpscaleMode mode) {
+    const char* names[] = { "off", "bilinear", "edge-aware" };
+    bool rebuild = (mode == UpscaleMode::Off) != (upscaleMode == UpscaleMode::Off);
+    upscaleMode = mode;
+    resolutionScaler.reset();
+    if (rebuild) {
+        rebuildRenderTargets();
+    }
+    std::cout << "dynamic resolution: " << names[static_cast<int>(mode)] << '\n';
+    if (mode != UpscaleMode::Off && !gpuTimingSupported) {
+        std::cout << "no GPU timestamps, rendering at full resolution\n";
+    }
+}
+
+void Application::rebuildRenderTargets() {
+    retireRenderTargets();
+    createRenderGraph();
+    createFramebuffers();
+}
+
+void Application::retireRenderTargets() {
+    for (auto framebuffer : swapChainFramebuffers) {
+        retireFramebuffer(framebuffer);
+    }
+    for (auto framebuffer : upscaleFramebuffers) {
+        retireFramebuffer(framebuffer);
+    }
+    swapChainFramebuffers.clear();
+    upscaleFramebuffers.clear();
+    destroyRenderGraphImages(true);
+    // A new view may reuse a retired view's handle
+    std::fill(upscaleDescriptorViews.begin(), upscaleDescriptorViews.end(), VK_NULL_HANDLE);
+    std::fill(deferredDescriptorViews.begin(), deferredDescriptorViews.end(), VK_NULL_HANDLE);
+}
+
+void Application::updateRenderExtent() {
+    if (upscaleMode == UpscaleMode::Off) {
+        renderExtent = swapChainExtent;
+        return;
+    }
+    float scale = resolutionScaler.getScale();
+    renderExtent.width = std::clamp(static_cast<uint32_t>(std::lround(swapChainExtent.width * scale)), 1u, swapChainExtent.width);
+    renderExtent.height = std::clamp(static_cast<uint32_t>(std::lround(swapChainExtent.height * scale)), 1u, swapChainExtent.height);
+}
+
+void Application::setFramesInFlight(uint32_t count) {
+    count = std::clamp(count, 1u, static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT));
+    if (count == framesInFlight) {
+        return;
+    }
+    // Slots are assigned round-robin over framesInFlight, so the mapping 
+    // changes. Wait for every submitted frame before reusing any slot.
+    uint64_t waitValue = frameCount;
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &frameTimeline;
+    waitInfo.pValues = &waitValue;
+    vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+
+    framesInFlight = count;
+    currentFrame = 0;
+    std::cout << "frames in flight: " << framesInFlight << '\n';
+}
+
+void Application::trackLatency() {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t completed = completedFrameCount();
+    while (!latencyPending.empty() && latencyPending.front().first < completed) {
+        double latencyMs = std::chrono::duration<double, std::milli>(now - latencyPending.front().second).count();
+        latencySumMs += latencyMs;
+        latencyMaxMs = std::max(latencyMaxMs, latencyMs);
+        latencySamples++;
+        latencyPending.pop_front();
+    }
 
-    result = vkQueuePresentKHR(presentQueue, &presentInfo);
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
-        framebufferResized = false;
-        recreateSwapChain();
-    } else if (result != VK_SUCCESS) {
-        throw std::runtime_error("failed to present swap chain image!");
+    if (now - latencyReportTime >= std::chrono::seconds(1) && latencySamples > 0) {
+        std::cout << "frames in flight: " << framesInFlight 
+            << ", input to GPU completion: avg " << latencySumMs / latencySamples 
+            << " ms, max " << latencyMaxMs << " ms, " << latencySamples << " frames";
+        if (displayLatencySamples > 0) {
+            std::cout << ", input to display: avg " << displayLatencySumMs / displayLatencySamples 
+                << " ms, max " << displayLatencyMaxMs << " ms";
+        }
+        if (presentIntervalSamples > 0) {
+            std::cout << ", present interval: avg " << presentIntervalSumMs / presentIntervalSamples << " ms";
+        }
+        std::cout << '\n';
+        latencySumMs = latencyMaxMs = 0.0;
+        latencySamples = 0;
+        displayLatencySumMs = displayLatencyMaxMs = 0.0;
+        displayLatencySamples = 0;
+        presentIntervalSumMs = 0.0;
+        presentIntervalSamples = 0;
+        latencyReportTime = now;
     }
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 }
 
-void Application::createSyncObjects() {
-    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+void Application::paceFrame() {
+    PROFILE_ZONE("paceFrame");
+    auto now = std::chrono::steady_clock::now();
+    auto sleepUntil = now;
+
+    if (presentPolicy == PresentPolicy::FixedFps) {
+        auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / TARGET_FPS));
+        // Don't try to catch up after a long frame
+        nextFrameTime = std::max(nextFrameTime + period, now);
+        sleepUntil = nextFrameTime;
+    } else if (presentPolicy == PresentPolicy::LatencyOptimized) {
+        // Whatever time the last frame spent blocked could have been spent
+        // sleeping before its input was sampled. Integrate towards blocking
+        // for only LATENCY_MARGIN_MS, which keeps the frame on its vblank.
+        latencySleepMs = std::clamp(latencySleepMs + 0.5 * (frameBlockedMs - LATENCY_MARGIN_MS), 0.0, refreshIntervalMs);
+        sleepUntil = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(latencySleepMs));
+    }
 
-    VkSemaphoreCreateInfo semaphoreInfo{};
-    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    // The OS sleep granularity can exceed a millisecond, so sleep coarsely
+    // and yield for the remainder
+    while (std::chrono::steady_clock::now() + std::chrono::milliseconds(2) < sleepUntil) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    while (std::chrono::steady_clock::now() < sleepUntil) {
+        std::this_thread::yield();
+    }
+}
 
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+void Application::trackPresentTiming() {
+    double intervalMs = 0.0;
+    if (displayTimingSupported) {
+        uint32_t count = 0;
+        pfnGetPastPresentationTiming(device, swapChain, &count, nullptr);
+        if (count == 0) {
+            return;
+        }
+        std::vector<VkPastPresentationTimingGOOGLE> timings(count);
+        pfnGetPastPresentationTiming(device, swapChain, &count, timings.data());
+        // Timings are returned once, oldest first
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t actual = timings[i].actualPresentTime;
+            if (lastActualPresentTime != 0 && actual > lastActualPresentTime) {
+                intervalMs = (actual - lastActualPresentTime) / 1e6;
+                presentIntervalSumMs += intervalMs;
+                presentIntervalSamples++;
+            }
+            lastActualPresentTime = actual;
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+            // Ids whose timing never arrives, e.g. from a retired swap 
+            // chain, are skipped over. actualPresentTime is taken to be in 
+            // the time domain of steady_clock (CLOCK_MONOTONIC on Linux).
+            while (!displayLatencyPending.empty() && displayLatencyPending.front().first < timings[i].presentID) {
+                displayLatencyPending.pop_front();
+            }
+            if (!displayLatencyPending.empty() && displayLatencyPending.front().first == timings[i].presentID) {
+                auto sampled = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    displayLatencyPending.front().second.time_since_epoch()).count();
+                double latencyMs = (static_cast<double>(actual) - static_cast<double>(sampled)) / 1e6;
+                displayLatencySumMs += latencyMs;
+                displayLatencyMaxMs = std::max(displayLatencyMaxMs, latencyMs);
+                displayLatencySamples++;
+                displayLatencyPending.pop_front();
+            }
+        }
+        return;
+    }
 
-            throw std::runtime_error("failed to create synchronization objects for a frame!");
+    auto now = std::chrono::steady_clock::now();
+    if (lastPresentCallTime.time_since_epoch().count() != 0) {
+        intervalMs = std::chrono::duration<double, std::milli>(now - lastPresentCallTime).count();
+        presentIntervalSumMs += intervalMs;
+        presentIntervalSamples++;
+        // Under FIFO, present calls settle to one per vblank
+        if (presentPolicy == PresentPolicy::VSync || presentPolicy == PresentPolicy::LatencyOptimized) {
+            refreshIntervalMs = 0.95 * refreshIntervalMs + 0.05 * intervalMs;
         }
     }
+    lastPresentCallTime = now;
+}
+
+void Application::setPresentPolicy(PresentPolicy policy) {
+    const char* names[] = { "vsync", "uncapped", "fixed fps", "latency optimized" };
+    presentPolicy = policy;
+    presentPolicyChanged = true;
+    latencySleepMs = 0.0;
+    nextFrameTime = std::chrono::steady_clock::now();
+    std::cout << "present policy: " << names[static_cast<int>(policy)] << '\n';
 }
 
 void Application::recreateSwapChain() {
-    int width = 0, height = 0;
-    glfwGetFramebufferSize(window, &width, &height);
-    while (width == 0 || height == 0) {
-        glfwGetFramebufferSize(window, &width, &height);
-        glfwWaitEvents();
+    // Minimized: wait on the render thread until the main thread reports
+    // a usable size again
+    while ((framebufferWidth == 0 || framebufferHeight == 0) && running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
-    vkDeviceWaitIdle(device);
+    if (!running) {
+        return;
+    }
+    framebufferResized = false;
 
-    cleanupSwapChain();
+    retireSwapChain();
     createSwapChain();
     createImageViews();
-    createDepthResources();
+    createRenderGraph();
     createFramebuffers();
 }
 
+void Application::retireSwapChain() {
+    retireRenderTargets();
+    for (auto imageView : swapChainImageViews) {
+        retireImage(VK_NULL_HANDLE, imageView, VK_NULL_HANDLE);
+    }
+    swapChainImageViews.clear();
+
+    // Queued after the image views, which must not outlive their images
+    VkSwapchainKHR oldSwapChain = swapChain;
+    deletionQueue.push(frameCount, [=]() {
+        vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+    });
+}
+
+void Application::retireImage(VkImage image, VkImageView imageView, VkDeviceMemory memory) {
+    // Null handles are ignored by the destroy functions, so swap chain 
+    // image views can be retired without their image
+    deletionQueue.push(frameCount, [=]() {
+        vkDestroyImageView(device, imageView, nullptr);
+        vkDestroyImage(device, image, nullptr);
+        freeMemory(memory);
+    });
+}
+
+void Application::retirePipeline(VkPipeline pipeline) {
+    deletionQueue.push(frameCount, [=]() {
+        vkDestroyPipeline(device, pipeline, nullptr);
+    });
+}
+
+void Application::retireFramebuffer(VkFramebuffer framebuffer) {
+    deletionQueue.push(frameCount, [=]() {
+        vkDestroyFramebuffer(device, framebuffer, nullptr);
+    });
+}
+
+void Application::retireRenderPass(VkRenderPass pass) {
+    deletionQueue.push(frameCount, [=]() {
+        vkDestroyRenderPass(device, pass, nullptr);
+    });
+}
+
+uint64_t Application::completedFrameCount() {
+    uint64_t value;
+    vkGetSemaphoreCounterValue(device, frameTimeline, &value);
+    return value;
+}
+
 void Application::cleanupSwapChain() {
-    vkDestroyImageView(device, depthImageView, nullptr);
-    vkDestroyImage(device, depthImage, nullptr);
-    vkFreeMemory(device, depthImageMemory, nullptr);
+    destroyRenderGraphImages(false);
 
     for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
         vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
     }
+    for (size_t i = 0; i < upscaleFramebuffers.size(); i++) {
+        vkDestroyFramebuffer(device, upscaleFramebuffers[i], nullptr);
+    }
 
     for (size_t i = 0; i < swapChainImageViews.size(); i++) {
         vkDestroyImageView(device, swapChainImageViews[i], nullptr);
@@ -1745,7 +8406,7 @@ void Application::cleanupSwapChain() {
 }
 
 void Application::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, 
-    VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+    VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory, MemoryCategory category) {
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
@@ -1759,12 +8420,8 @@ void Application::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+    uint32_t memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+    if (allocateMemory(memRequirements.size, memoryTypeIndex, category, bufferMemory) != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate buffer memory!");
     }
 
@@ -1772,6 +8429,25 @@ void Application::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 }
 
 
+VkResult Application::allocateMemory(VkDeviceSize size, uint32_t memoryTypeIndex, MemoryCategory category, VkDeviceMemory& memory) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryTypeIndex;
+    VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, &memory);
+    if (result == VK_SUCCESS) {
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+        memoryTracker.add(memory, category, memProperties.memoryTypes[memoryTypeIndex].heapIndex, size);
+    }
+    return result;
+}
+
+void Application::freeMemory(VkDeviceMemory memory) {
+    memoryTracker.remove(memory);
+    vkFreeMemory(device, memory, nullptr);
+}
+
 /*
     @param typeFiler: The bit field of memory types that are suitable
     @param properties: Required properties of the memory
@@ -1787,3 +8463,1208 @@ uint32_t Application::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags
     throw std::runtime_error("failed to find suitable memory type!");
     return 0;
 }
+
+
+void runCpuBenchmarks(BenchmarkReport& report) {
+    benchmarkCamera(report);
+    benchmarkTransforms(report);
+    benchmarkCulling(report);
+    benchmarkBvh(report);
+    benchmarkRenderQueue(report);
+    benchmarkRenderGraph(report);
+    benchmarkImageStates(report);
+    benchmarkLazyAttachments(report);
+    benchmarkResolutionScaling(report);
+    benchmarkDeferredShading(report);
+    benchmarkClusteredShading(report);
+    benchmarkShadows(report);
+    benchmarkDepthPrepass(report);
+    benchmarkReverseZ(report);
+    benchmarkProfiler(report);
+    benchmarkMemoryTracker(report);
+}
+
+void benchmarkCamera(BenchmarkReport& report) {
+    // Many cameras (shadow views, probes, portals), of which only a few 
+    // move in any given frame
+    const size_t cameraCount = 10000;
+    const int frames = 100;
+    const size_t movingPerFrame = cameraCount / 100;
+
+    std::vector<Camera> cameras(cameraCount);
+    for (auto& c : cameras) {
+        c.setAspect(16.0f / 9.0f);
+    }
+    volatile float sink = 0.0f;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        for (size_t i = 0; i < cameraCount; i++) {
+            const Camera& c = cameras[i];
+            glm::vec3 position = c.getPosition() + glm::vec3(i % movingPerFrame == 0 ? 0.001f * frame : 0.0f);
+            glm::mat4 view = glm::lookAt(position, position + c.getForward(), glm::vec3(0.0f, 0.0f, 1.0f));
+            glm::mat4 proj = infiniteReversePerspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f);
+            glm::mat4 viewProj = proj * view;
+            sink = sink + viewProj[3][3];
+        }
+    }
+    double recomputeNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        for (size_t i = frame % 100; i < cameraCount; i += 100) {
+            cameras[i].setPosition(cameras[i].getPosition() + glm::vec3(0.001f));
+        }
+        for (auto& c : cameras) {
+            sink = sink + c.getViewProj()[3][3] + c.getFrustumPlanes()[0].w;
+        }
+    }
+    double cachedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    double perCamera = static_cast<double>(cameraCount) * frames;
+    report.add("camera.recompute_every_frame", recomputeNs / perCamera, "ns/camera");
+    report.add("camera.cached_1pct_dirty", cachedNs / perCamera, "ns/camera");
+    report.add("camera.speedup", recomputeNs / cachedNs, "x");
+}
+
+void benchmarkTransforms(BenchmarkReport& report) {
+    // 256 trees of 4096 nodes, each node having up to 4 children
+    const uint32_t treeCount = 256;
+    const uint32_t treeSize = 4096;
+    const int iterations = 20;
+
+    TransformHierarchy hierarchy;
+    std::vector<uint32_t> roots;
+    std::vector<uint32_t> ids;
+    for (uint32_t tree = 0; tree < treeCount; tree++) {
+        size_t first = ids.size();
+        for (uint32_t i = 0; i < treeSize; i++) {
+            uint32_t id = hierarchy.create(i == 0 ? TransformHierarchy::NO_PARENT : ids[first + (i - 1) / 4]);
+            hierarchy.setPosition(id, glm::vec3(0.1f * (i % 7), 0.2f, 0.05f * (i % 3)));
+            hierarchy.setRotation(id, glm::angleAxis(0.01f * i, glm::normalize(glm::vec3(1.0f, 2.0f, 3.0f))));
+            hierarchy.setScale(id, glm::vec3(0.99f));
+            ids.push_back(id);
+        }
+        roots.push_back(ids[first]);
+    }
+    hierarchy.update();
+
+    WorkerPool pool;
+    double transforms = static_cast<double>(hierarchy.size()) * iterations;
+    auto measure = [&](WorkerPool* workerPool) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            // Moving the roots makes every world matrix stale
+            for (uint32_t root : roots) {
+                hierarchy.setRotation(root, glm::angleAxis(0.001f * i, glm::vec3(0.0f, 0.0f, 1.0f)));
+            }
+            hierarchy.update(workerPool);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return transforms / seconds / 1e6;
+    };
+    report.add("transforms.single_thread", measure(nullptr), "Mtransforms/s");
+    report.add("transforms.parallel", measure(&pool), "Mtransforms/s");
+    report.add("transforms.threads", static_cast<double>(pool.threadCount()), "threads");
+
+    // Only 1% of the nodes move, and with them their subtrees
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        for (size_t j = 1; j < ids.size(); j += 100) {
+            hierarchy.setPosition(ids[j], glm::vec3(0.001f * i));
+        }
+        hierarchy.update(&pool);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report.add("transforms.update_1pct_dirty", seconds * 1e3 / iterations, "ms");
+}
+
+void benchmarkCulling(BenchmarkReport& report) {
+    // Objects scattered around the default camera, about a fifth of them visible
+    const size_t objectCount = 1 << 20;
+    const int iterations = 20;
+
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> size(0.05f, 0.5f);
+    ObjectBounds bounds;
+    bounds.resize(objectCount);
+    for (size_t i = 0; i < objectCount; i++) {
+        glm::vec3 center(position(random), position(random), position(random));
+        glm::vec3 extent(size(random), size(random), size(random));
+        bounds.set(i, center - extent, center + extent);
+    }
+
+    Camera camera;
+    camera.setAspect(16.0f / 9.0f);
+    const auto& planes = camera.getFrustumPlanes();
+
+    // The compiler may contract the plane tests of the kernels and of the 
+    // reference into FMAs differently, so objects within rounding of a 
+    // plane may go either way. Any other difference is a bug.
+    auto onPlane = [&](const ObjectBounds& objects, FrustumCuller::Test test, uint32_t i) {
+        for (const auto& plane : planes) {
+            double x, y, z, margin;
+            if (test == FrustumCuller::Test::Sphere) {
+                x = objects.centerX[i];
+                y = objects.centerY[i];
+                z = objects.centerZ[i];
+                margin = objects.radius[i];
+            } else {
+                x = plane.x >= 0.0f ? objects.maxX[i] : objects.minX[i];
+                y = plane.y >= 0.0f ? objects.maxY[i] : objects.minY[i];
+                z = plane.z >= 0.0f ? objects.maxZ[i] : objects.minZ[i];
+                margin = 0.0;
+            }
+            double d = plane.x * x + plane.y * y + plane.z * z + plane.w + margin;
+            double scale = std::abs(plane.x * x) + std::abs(plane.y * y) + std::abs(plane.z * z) + std::abs(plane.w) + margin;
+            if (std::abs(d) <= 1e-6 * scale) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto matches = [&](const ObjectBounds& objects, FrustumCuller::Test test, const std::vector<uint32_t>& visible, 
+        const std::vector<uint32_t>& expected, size_t expectedCount) {
+        size_t a = 0;
+        size_t b = 0;
+        while (a < visible.size() || b < expectedCount) {
+            if (a < visible.size() && b < expectedCount && visible[a] == expected[b]) {
+                a++;
+                b++;
+                continue;
+            }
+            bool fromVisible = b == expectedCount || (a < visible.size() && visible[a] < expected[b]);
+            uint32_t index = fromVisible ? visible[a++] : expected[b++];
+            if (!onPlane(objects, test, index)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    WorkerPool pool;
+    FrustumCuller culler;
+    std::vector<uint32_t> visible;
+    std::vector<uint32_t> expected(bounds.centerX.size());
+    for (auto test : { FrustumCuller::Test::Sphere, FrustumCuller::Test::Box }) {
+        std::string name = test == FrustumCuller::Test::Sphere ? "culling.sphere" : "culling.box";
+
+        auto start = std::chrono::steady_clock::now();
+        size_t expectedCount = 0;
+        for (int i = 0; i < iterations; i++) {
+            expectedCount = FrustumCuller::cullRangeScalar(planes, bounds, test, 0, objectCount, expected.data());
+        }
+        double scalarNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            culler.cull(planes, bounds, test, nullptr, visible);
+        }
+        double simdNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            culler.cull(planes, bounds, test, &pool, visible);
+        }
+        double parallelNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        if (!matches(bounds, test, visible, expected, expectedCount)) {
+            throw std::runtime_error("culling result differs from the scalar reference!");
+        }
+
+        double tests = static_cast<double>(objectCount) * iterations;
+        report.add(name + ".scalar", scalarNs / tests, "ns/object");
+        report.add(name + ".simd", simdNs / tests, "ns/object");
+        report.add(name + ".parallel", parallelNs / tests, "ns/object");
+        report.add(name + ".visible", static_cast<double>(expectedCount), "objects");
+    }
+
+    // Object counts that are not a multiple of the batch or the job size
+    for (size_t count : { size_t(1), size_t(7), size_t(CULLING_BATCH + 3), FrustumCuller::CHUNK_SIZE + 5 }) {
+        ObjectBounds subset;
+        subset.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            subset.set(i, glm::vec3(bounds.minX[i], bounds.minY[i], bounds.minZ[i]), glm::vec3(bounds.maxX[i], bounds.maxY[i], bounds.maxZ[i]));
+        }
+        for (auto test : { FrustumCuller::Test::Sphere, FrustumCuller::Test::Box }) {
+            size_t expectedCount = FrustumCuller::cullRangeScalar(planes, subset, test, 0, count, expected.data());
+            culler.cull(planes, subset, test, &pool, visible);
+            if (!matches(subset, test, visible, expected, expectedCount)) {
+                throw std::runtime_error("culling result differs from the scalar reference!");
+            }
+        }
+    }
+}
+
+void benchmarkBvh(BenchmarkReport& report) {
+    // A world much larger than the default camera's frustum, so only a 
+    // small part of it is visible, which is where the hierarchy pays off
+    const size_t objectCount = 1 << 18;
+    const int iterations = 20;
+    const int queryCount = 1000;
+
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> position(-40.0f, 40.0f);
+    std::uniform_real_distribution<float> size(0.05f, 0.5f);
+    std::vector<glm::vec3> centers(objectCount);
+    std::vector<glm::vec3> extents(objectCount);
+    ObjectBounds bounds;
+    bounds.resize(objectCount);
+    for (size_t i = 0; i < objectCount; i++) {
+        centers[i] = glm::vec3(position(random), position(random), position(random));
+        extents[i] = glm::vec3(size(random), size(random), size(random));
+        bounds.set(i, centers[i] - extents[i], centers[i] + extents[i]);
+    }
+
+    Camera camera;
+    camera.setAspect(16.0f / 9.0f);
+    const auto& planes = camera.getFrustumPlanes();
+
+    Bvh4 bvh;
+    auto start = std::chrono::steady_clock::now();
+    bvh.build(bounds);
+    report.add("bvh.build", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), "ms");
+    report.add("bvh.nodes", static_cast<double>(bvh.nodeCount()), "nodes");
+
+    // Frustum queries, against the linear SIMD culler
+    FrustumCuller culler;
+    std::vector<uint32_t> linear;
+    std::vector<uint32_t> visible;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        culler.cull(planes, bounds, FrustumCuller::Test::Box, nullptr, linear);
+    }
+    double linearMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        bvh.queryFrustum(planes, bounds, visible);
+    }
+    double bvhMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+    std::sort(visible.begin(), visible.end());
+    if (visible != linear) {
+        throw std::runtime_error("BVH frustum query differs from the linear culler!");
+    }
+    report.add("bvh.frustum_linear", linearMs, "ms");
+    report.add("bvh.frustum_query", bvhMs, "ms");
+    report.add("bvh.visible", static_cast<double>(visible.size()), "objects");
+
+    // Ray and nearest queries, checked against brute force
+    std::vector<glm::vec3> origins(queryCount);
+    std::vector<glm::vec3> directions(queryCount);
+    for (int q = 0; q < queryCount; q++) {
+        origins[q] = glm::vec3(position(random), position(random), position(random));
+        directions[q] = glm::normalize(-origins[q] + glm::vec3(position(random), position(random), position(random)));
+    }
+    volatile uint32_t sink = 0;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queryCount; q++) {
+        float distance;
+        sink = sink + bvh.raycast(origins[q], directions[q], bounds, distance);
+    }
+    double rayUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / queryCount;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queryCount; q++) {
+        float distance;
+        sink = sink + bvh.nearest(origins[q], bounds, distance);
+    }
+    double nearestUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / queryCount;
+    report.add("bvh.raycast", rayUs, "us/query");
+    report.add("bvh.nearest", nearestUs, "us/query");
+
+    for (int q = 0; q < 100; q++) {
+        glm::vec3 invDir = 1.0f / Bvh4::safeDirection(directions[q]);
+        uint32_t expectedHit = Bvh4::NO_HIT;
+        uint32_t expectedNearest = Bvh4::NO_HIT;
+        float expectedT = FLT_MAX;
+        float expectedSquared = FLT_MAX;
+        for (uint32_t i = 0; i < objectCount; i++) {
+            float t;
+            if (Bvh4::rayHitsObject(origins[q], invDir, bounds, i, FLT_MAX, t) && t < expectedT) {
+                expectedT = t;
+                expectedHit = i;
+            }
+            float squared = Bvh4::distanceSquaredToObject(origins[q], bounds, i);
+            if (squared < expectedSquared) {
+                expectedSquared = squared;
+                expectedNearest = i;
+            }
+        }
+        float distance;
+        if (bvh.raycast(origins[q], directions[q], bounds, distance) != expectedHit) {
+            throw std::runtime_error("BVH raycast differs from brute force!");
+        }
+        if (bvh.nearest(origins[q], bounds, distance) != expectedNearest) {
+            throw std::runtime_error("BVH nearest query differs from brute force!");
+        }
+    }
+
+    // Every object moves a little: refit instead of rebuilding
+    for (size_t i = 0; i < objectCount; i++) {
+        glm::vec3 center = centers[i] + glm::vec3(0.05f * (i % 3), 0.0f, -0.05f * (i % 5));
+        bounds.set(i, center - extents[i], center + extents[i]);
+    }
+    start = std::chrono::steady_clock::now();
+    bvh.refit(bounds);
+    report.add("bvh.refit", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), "ms");
+    bvh.queryFrustum(planes, bounds, visible);
+    culler.cull(planes, bounds, FrustumCuller::Test::Box, nullptr, linear);
+    std::sort(visible.begin(), visible.end());
+    if (visible != linear) {
+        throw std::runtime_error("BVH frustum query after refit differs from the linear culler!");
+    }
+}
+
+void benchmarkRenderQueue(BenchmarkReport& report) {
+    // Draws submitted in scene order, spread over a few pipelines and 
+    // many materials and meshes
+    const size_t drawCount = 1 << 20;
+    const int iterations = 10;
+
+    std::mt19937 random(3);
+    std::vector<uint64_t> keys(drawCount);
+    for (auto& key : keys) {
+        key = RenderQueue::makeKey(0, random() % 8, random() % 256, random() % 64, (random() % 1000) / 1000.0f);
+    }
+
+    RenderQueue queue;
+    auto fill = [&] {
+        queue.clear();
+        for (size_t i = 0; i < drawCount; i++) {
+            queue.push(keys[i], static_cast<uint32_t>(i));
+        }
+    };
+
+    std::vector<RenderQueue::Entry> expected;
+    double stdSortMs = 0.0;
+    for (int i = 0; i < iterations; i++) {
+        fill();
+        expected = queue.getEntries();
+        auto start = std::chrono::steady_clock::now();
+        std::stable_sort(expected.begin(), expected.end(), [](const auto& a, const auto& b) { return a.key < b.key; });
+        stdSortMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    WorkerPool pool;
+    auto measure = [&](WorkerPool* workerPool) {
+        double totalMs = 0.0;
+        for (int i = 0; i < iterations; i++) {
+            fill();
+            auto start = std::chrono::steady_clock::now();
+            queue.sort(workerPool);
+            totalMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            const auto& sorted = queue.getEntries();
+            for (size_t j = 0; j < drawCount; j++) {
+                if (sorted[j].key != expected[j].key || sorted[j].item != expected[j].item) {
+                    throw std::runtime_error("radix sort differs from std::stable_sort!");
+                }
+            }
+        }
+        return totalMs / iterations;
+    };
+    report.add("render_queue.std_stable_sort", stdSortMs / iterations, "ms");
+    report.add("render_queue.radix_sort", measure(nullptr), "ms");
+    report.add("render_queue.radix_sort_parallel", measure(&pool), "ms");
+
+    // State changes the recorder would make, in submission and in key order
+    auto stateChanges = [](const std::vector<uint64_t>& order) {
+        size_t changes = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            changes += i == 0 || RenderQueue::pipelineOf(order[i]) != RenderQueue::pipelineOf(order[i - 1]);
+            changes += i == 0 || RenderQueue::materialOf(order[i]) != RenderQueue::materialOf(order[i - 1]);
+            changes += i == 0 || RenderQueue::meshOf(order[i]) != RenderQueue::meshOf(order[i - 1]);
+        }
+        return static_cast<double>(changes);
+    };
+    std::vector<uint64_t> sortedKeys;
+    for (const auto& entry : queue.getEntries()) {
+        sortedKeys.push_back(entry.key);
+    }
+    report.add("render_queue.state_changes_unsorted", stateChanges(keys), "binds");
+    report.add("render_queue.state_changes_sorted", stateChanges(sortedKeys), "binds");
+}
+
+void benchmarkRenderGraph(BenchmarkReport& report) {
+    // A deferred-style frame at 1080p. The debug pass writes an image 
+    // nothing reads and must be culled; the G-buffer is dead by the time 
+    // the post-processing targets are written, so they can share memory.
+    const VkExtent2D extent = { 1920, 1080 };
+    const int iterations = 1000;
+    const ImageUse colorWrite = { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR };
+    const ImageUse depthWrite = { VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR, 
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR };
+    const ImageUse sampled = { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR };
+    auto bytesPerTexel = [](VkFormat format) -> VkDeviceSize {
+        return format == VK_FORMAT_R16G16B16A16_SFLOAT ? 8 : 4;
+    };
+
+    RenderGraph graph;
+    uint32_t debug = 0;
+    auto build = [&] {
+        graph.clear();
+        uint32_t backbuffer = graph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT,
+            { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, 0 },
+            { VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_NONE_KHR, 0 });
+        auto target = [&](const char* name, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect) {
+            return graph.createImage(name, { format, extent, usage, aspect, VK_SAMPLE_COUNT_1_BIT });
+        };
+        const VkImageUsageFlags colorUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        uint32_t albedo = target("albedo", VK_FORMAT_R8G8B8A8_UNORM, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+        uint32_t normal = target("normal", VK_FORMAT_R16G16B16A16_SFLOAT, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+        uint32_t depth = target("depth", VK_FORMAT_D32_SFLOAT, 
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+        uint32_t hdr = target("hdr", VK_FORMAT_R16G16B16A16_SFLOAT, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+        uint32_t bloom = target("bloom", VK_FORMAT_R16G16B16A16_SFLOAT, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+        uint32_t blur = target("blur", VK_FORMAT_R16G16B16A16_SFLOAT, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+        debug = target("debug", VK_FORMAT_R8G8B8A8_UNORM, colorUsage, VK_IMAGE_ASPECT_COLOR_BIT);
+
+        auto noop = [](VkCommandBuffer) {};
+        uint32_t gbuffer = graph.addPass("gbuffer", noop);
+        graph.write(gbuffer, albedo, colorWrite);
+        graph.write(gbuffer, normal, colorWrite);
+        graph.write(gbuffer, depth, depthWrite);
+        uint32_t debugView = graph.addPass("debug", noop);
+        graph.read(debugView, normal, sampled);
+        graph.write(debugView, debug, colorWrite);
+        uint32_t lighting = graph.addPass("lighting", noop);
+        graph.read(lighting, albedo, sampled);
+        graph.read(lighting, normal, sampled);
+        graph.read(lighting, depth, sampled);
+        graph.write(lighting, hdr, colorWrite);
+        uint32_t bright = graph.addPass("bloom", noop);
+        graph.read(bright, hdr, sampled);
+        graph.write(bright, bloom, colorWrite);
+        uint32_t blurPass = graph.addPass("blur", noop);
+        graph.read(blurPass, bloom, sampled);
+        graph.write(blurPass, blur, colorWrite);
+        uint32_t tonemap = graph.addPass("tonemap", noop);
+        graph.read(tonemap, hdr, sampled);
+        graph.read(tonemap, blur, sampled);
+        graph.write(tonemap, backbuffer, colorWrite);
+    };
+    auto requirements = [&](uint32_t image) {
+        const RenderGraph::ImageDesc& desc = graph.getDesc(image);
+        VkMemoryRequirements req{};
+        req.size = static_cast<VkDeviceSize>(desc.extent.width) * desc.extent.height * bytesPerTexel(desc.format);
+        req.alignment = 65536;
+        req.memoryTypeBits = 1;
+        return req;
+    };
+
+    double totalMs = 0.0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        build();
+        graph.compile(requirements);
+        totalMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    const RenderGraph::Stats& stats = graph.getStats();
+    if (stats.culledPasses != 1) {
+        throw std::runtime_error("render graph culled the wrong passes!");
+    }
+    if (graph.getSlot(debug) != RenderGraph::NO_SLOT) {
+        throw std::runtime_error("render graph allocated memory for a culled image!");
+    }
+    if (stats.transientBytes >= stats.unaliasedBytes) {
+        throw std::runtime_error("render graph did not alias any transient image!");
+    }
+    report.add("render_graph.compile", totalMs / iterations, "ms");
+    report.add("render_graph.barriers", stats.barriers, "barriers");
+    report.add("render_graph.barrier_batches", stats.barrierBatches, "batches");
+    report.add("render_graph.transient_memory", stats.transientBytes / (1024.0 * 1024.0), "MiB");
+    report.add("render_graph.unaliased_memory", stats.unaliasedBytes / (1024.0 * 1024.0), "MiB");
+}
+
+void benchmarkImageStates(BenchmarkReport& report) {
+    // Cube map textures with full mip chains, all sampled every frame. 
+    // Each frame one of them has its mip chain regenerated level by level, 
+    // the pattern hard-coded transitions could not express.
+    const uint32_t textureCount = 256;
+    const uint32_t mipLevels = 10;
+    const uint32_t layers = 6;
+    const int frames = 1000;
+
+    static uint32_t recordedBarriers;
+    recordedBarriers = 0;
+    PFN_vkCmdPipelineBarrier2KHR countBarriers = [](VkCommandBuffer, const VkDependencyInfoKHR* dependencyInfo) {
+        recordedBarriers += dependencyInfo->imageMemoryBarrierCount;
+    };
+
+    ImageStateTracker tracker;
+    std::vector<VkImage> textures(textureCount);
+    for (uint32_t i = 0; i < textureCount; i++) {
+        // Only used as keys
+        textures[i] = reinterpret_cast<VkImage>(static_cast<uintptr_t>(i + 1));
+        tracker.track(textures[i], VK_IMAGE_ASPECT_COLOR_BIT, mipLevels, layers);
+    }
+
+    // The first use of a whole image needs one barrier, not one per subresource
+    for (VkImage texture : textures) {
+        tracker.require(texture, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+    }
+    tracker.flush(VK_NULL_HANDLE, countBarriers);
+    if (recordedBarriers != textureCount) {
+        throw std::runtime_error("image state tracker did not merge subresource barriers!");
+    }
+
+    // One barrier per transition, as transitionImageLayout recorded them
+    uint64_t naiveBarriers = 0;
+    recordedBarriers = 0;
+    tracker.resetStats();
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        VkImage regenerated = textures[frame % textureCount];
+        tracker.require(regenerated, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layers }, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+        tracker.flush(VK_NULL_HANDLE, countBarriers);
+        naiveBarriers++;
+        for (uint32_t level = 1; level < mipLevels; level++) {
+            tracker.require(regenerated, { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 1, 0, layers }, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
+                VK_PIPELINE_STAGE_2_BLIT_BIT_KHR, VK_ACCESS_2_TRANSFER_READ_BIT_KHR);
+            tracker.require(regenerated, { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, layers }, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+                VK_PIPELINE_STAGE_2_BLIT_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR);
+            tracker.flush(VK_NULL_HANDLE, countBarriers);
+            naiveBarriers += 2;
+        }
+        for (VkImage texture : textures) {
+            tracker.require(texture, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+                VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+            naiveBarriers++;
+        }
+        tracker.flush(VK_NULL_HANDLE, countBarriers);
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for (VkImage texture : textures) {
+        for (uint32_t level = 0; level < mipLevels; level++) {
+            for (uint32_t layer = 0; layer < layers; layer++) {
+                if (tracker.getLayout(texture, level, layer) != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+                    throw std::runtime_error("image state tracker lost a layout!");
+                }
+            }
+        }
+    }
+    const ImageStateTracker::Stats& stats = tracker.getStats();
+    report.add("image_states.require", totalMs * 1e6 / stats.requests, "ns");
+    report.add("image_states.barriers_per_frame", static_cast<double>(recordedBarriers) / frames, "barriers");
+    report.add("image_states.naive_barriers_per_frame", static_cast<double>(naiveBarriers) / frames, "barriers");
+    report.add("image_states.skipped_per_frame", static_cast<double>(stats.skipped) / frames, "subresources");
+}
+
+void benchmarkLazyAttachments(BenchmarkReport& report) {
+    // Memory a tiler saves at common resolutions when the multisampled 
+    // color and depth targets of a forward pass, which only the pass 
+    // itself touches, are lazily allocated. The resolved color target is 
+    // sampled afterwards and must stay backed.
+    struct Resolution {
+        const char* name;
+        VkExtent2D extent;
+    };
+    const Resolution resolutions[] = {
+        { "720p", { 1280, 720 } }, { "1080p", { 1920, 1080 } }, { "1440p", { 2560, 1440 } }, { "2160p", { 3840, 2160 } }
+    };
+    const VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_4_BIT;
+
+    for (const auto& resolution : resolutions) {
+        RenderGraph graph;
+        graph.setLazyAllocation(true);
+        uint32_t backbuffer = graph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT,
+            { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, 0 },
+            { VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_NONE_KHR, 0 });
+        uint32_t color = graph.createImage("color", { VK_FORMAT_R16G16B16A16_SFLOAT, resolution.extent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT, samples });
+        uint32_t depth = graph.createImage("depth", { VK_FORMAT_D32_SFLOAT, resolution.extent, 
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT, samples });
+        uint32_t resolved = graph.createImage("resolved", { VK_FORMAT_R16G16B16A16_SFLOAT, resolution.extent, 
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+
+        auto noop = [](VkCommandBuffer) {};
+        uint32_t forward = graph.addPass("forward", noop);
+        graph.write(forward, color, { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR });
+        graph.write(forward, depth, { VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR, 
+            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR });
+        graph.write(forward, resolved, { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR });
+        uint32_t post = graph.addPass("post", noop);
+        graph.read(post, resolved, { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR });
+        graph.write(post, backbuffer, { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+            VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR });
+
+        graph.compile([&](uint32_t image) {
+            const RenderGraph::ImageDesc& desc = graph.getDesc(image);
+            VkMemoryRequirements req{};
+            VkDeviceSize texelBytes = desc.format == VK_FORMAT_R16G16B16A16_SFLOAT ? 8 : 4;
+            req.size = static_cast<VkDeviceSize>(desc.extent.width) * desc.extent.height * texelBytes * desc.samples;
+            req.alignment = 65536;
+            req.memoryTypeBits = 1;
+            return req;
+        });
+        bool colorLazy = graph.getDesc(color).usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+        bool depthLazy = graph.getDesc(depth).usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+        bool resolvedLazy = graph.getDesc(resolved).usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+        if (!colorLazy || !depthLazy || resolvedLazy) {
+            throw std::runtime_error("render graph chose the wrong transient attachments!");
+        }
+        const RenderGraph::Stats& stats = graph.getStats();
+        report.add(std::string("lazy_attachments.saved_") + resolution.name, stats.lazyBytes / (1024.0 * 1024.0), "MiB");
+        report.add(std::string("lazy_attachments.backed_") + resolution.name, 
+            (stats.transientBytes - stats.lazyBytes) / (1024.0 * 1024.0), "MiB");
+    }
+}
+
+void benchmarkResolutionScaling(BenchmarkReport& report) {
+    // Simulated GPU frame times: a fixed cost plus a per-pixel cost that 
+    // follows the square of the render scale, with some noise. The 
+    // per-pixel cost triples for a while in the middle, e.g. a heavy 
+    // effect filling the screen. Times are read back two frames late, as 
+    // with frames in flight.
+    const uint32_t frames = 1800;
+    const uint32_t spikeStart = 600;
+    const uint32_t spikeEnd = 1200;
+    const uint32_t latency = 2;
+    const double fixedMs = 2.0;
+    auto pixelMs = [&](uint32_t frame) {
+        return frame >= spikeStart && frame < spikeEnd ? 30.0 : 10.0;
+    };
+    std::mt19937 rng(7);
+    std::normal_distribution<double> noise(1.0, 0.03);
+
+    ResolutionScaler scaler{ ResolutionScaler::Settings{} };
+    const ResolutionScaler::Settings& settings = scaler.getSettings();
+    std::vector<double> gpuMs(frames);
+    std::vector<float> scales(frames);
+    uint32_t overBudget = 0;
+    uint32_t overBudgetFixed = 0;
+    double spikeScaleSum = 0.0;
+    uint32_t spikeScaleFrames = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        if (frame >= latency) {
+            scaler.update(gpuMs[frame - latency]);
+        }
+        float scale = scaler.getScale();
+        if (scale < settings.minScale || scale > settings.maxScale) {
+            throw std::runtime_error("render scale out of bounds!");
+        }
+        scales[frame] = scale;
+        double n = noise(rng);
+        gpuMs[frame] = (fixedMs + pixelMs(frame) * scale * scale) * n;
+        overBudget += gpuMs[frame] > settings.budgetMs;
+        overBudgetFixed += (fixedMs + pixelMs(frame)) * n > settings.budgetMs;
+        // Once settled, i.e. after a short reaction time
+        if (frame >= spikeStart + 30 && frame < spikeEnd) {
+            spikeScaleSum += scale;
+            spikeScaleFrames++;
+        }
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Frames until the scale has settled within a step of where it ends up
+    auto settleFrames = [&](uint32_t from, uint32_t to) {
+        float settled = scales[to - 1];
+        uint32_t frame = to;
+        while (frame > from && std::abs(scales[frame - 1] - settled) <= settings.step) {
+            frame--;
+        }
+        return frame - from;
+    };
+    if (scales[spikeStart - 1] != settings.maxScale || scales[frames - 1] != settings.maxScale) {
+        throw std::runtime_error("render scale did not return to full resolution!");
+    }
+    report.add("resolution_scaling.update", totalMs * 1e6 / frames, "ns");
+    report.add("resolution_scaling.spike_scale", spikeScaleSum / spikeScaleFrames, "scale");
+    report.add("resolution_scaling.spike_settle", settleFrames(spikeStart, spikeEnd), "frames");
+    report.add("resolution_scaling.recover_settle", settleFrames(spikeEnd, frames), "frames");
+    report.add("resolution_scaling.over_budget", overBudget, "frames");
+    report.add("resolution_scaling.over_budget_fixed", overBudgetFixed, "frames");
+}
+
+void benchmarkDeferredShading(BenchmarkReport& report) {
+    // Forward shading evaluates every light for every fragment. Deferred 
+    // only evaluates a light inside the screen rectangle of its sphere of 
+    // influence, so its cost follows the summed area of the rectangles. 
+    // Counted at 1080p from the default camera, for the lights the 
+    // application draws.
+    const VkExtent2D extent = { 1920, 1080 };
+    Camera camera;
+    camera.setAspect(extent.width / static_cast<float>(extent.height));
+    const glm::mat4& view = camera.getView();
+    const glm::mat4& proj = camera.getProj();
+    glm::mat4 viewProj = camera.getViewProj();
+    std::mt19937 random(5);
+    std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+    for (uint32_t count : { 1000u, 10000u, 100000u }) {
+        std::vector<Light> lights = generateLights(count, 1);
+        std::vector<glm::vec4> rects(count);
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < count; i++) {
+            rects[i] = lightScreenRect(lights[i], view, proj, camera.getNear());
+        }
+        double rectMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        double lightPixels = 0.0;
+        for (uint32_t i = 0; i < count; i++) {
+            const glm::vec4& rect = rects[i];
+            if (rect.z <= rect.x || rect.w <= rect.y) {
+                continue;
+            }
+            lightPixels += (rect.z - rect.x) * 0.5 * extent.width * (rect.w - rect.y) * 0.5 * extent.height;
+            // Points on the sphere in front of the camera must project into
+            // the rectangle
+            for (int j = 0; j < 16; j++) {
+                glm::vec3 offset(direction(random), direction(random), direction(random));
+                if (glm::length(offset) < 1e-3f) {
+                    continue;
+                }
+                glm::vec3 point = glm::vec3(lights[i].positionRadius) + glm::normalize(offset) * lights[i].positionRadius.w;
+                glm::vec4 clip = viewProj * glm::vec4(point, 1.0f);
+                if (clip.w <= camera.getNear()) {
+                    continue;
+                }
+                glm::vec2 ndc = glm::vec2(clip) / clip.w;
+                const float epsilon = 1e-4f;
+                if (ndc.x >= -1.0f && ndc.x <= 1.0f && ndc.y >= -1.0f && ndc.y <= 1.0f 
+                    && (ndc.x < rect.x - epsilon || ndc.x > rect.z + epsilon || ndc.y < rect.y - epsilon || ndc.y > rect.w + epsilon)) {
+                    throw std::runtime_error("light screen rectangle does not cover its sphere!");
+                }
+            }
+        }
+        double pixels = static_cast<double>(extent.width) * extent.height;
+        std::string suffix = "_" + std::to_string(count);
+        report.add("deferred.light_rect" + suffix, rectMs * 1e6 / count, "ns/light");
+        // Upper bound for forward: the scene covering the whole screen
+        report.add("deferred.forward_evaluations_per_pixel" + suffix, count, "lights");
+        report.add("deferred.evaluations_per_pixel" + suffix, lightPixels / pixels, "lights");
+    }
+
+    // The G-buffer and depth only live within the scene pass, so a tiler 
+    // never backs them with memory
+    RenderGraph graph;
+    graph.setLazyAllocation(true);
+    uint32_t backbuffer = graph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT,
+        { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, 0 },
+        { VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_NONE_KHR, 0 });
+    const VkImageUsageFlags gbufferUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+    uint32_t depth = graph.createImage("depth", { VK_FORMAT_D32_SFLOAT, extent, 
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_DEPTH_BIT, VK_SAMPLE_COUNT_1_BIT });
+    uint32_t albedo = graph.createImage("gbuffer albedo", { GBUFFER_ALBEDO_FORMAT, extent, gbufferUsage, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+    uint32_t normal = graph.createImage("gbuffer normal", { GBUFFER_NORMAL_FORMAT, extent, gbufferUsage, VK_IMAGE_ASPECT_COLOR_BIT, VK_SAMPLE_COUNT_1_BIT });
+    const ImageUse colorWrite = { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR };
+    uint32_t scene = graph.addPass("scene", [](VkCommandBuffer) {});
+    graph.write(scene, backbuffer, colorWrite);
+    graph.write(scene, depth, { VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR, 
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR });
+    graph.write(scene, albedo, colorWrite);
+    graph.write(scene, normal, colorWrite);
+    graph.compile([&](uint32_t image) {
+        const RenderGraph::ImageDesc& desc = graph.getDesc(image);
+        VkMemoryRequirements req{};
+        // Every format here has 4 bytes per texel
+        req.size = static_cast<VkDeviceSize>(desc.extent.width) * desc.extent.height * 4;
+        req.alignment = 65536;
+        req.memoryTypeBits = 1;
+        return req;
+    });
+    const RenderGraph::Stats& stats = graph.getStats();
+    if (stats.lazyBytes != stats.transientBytes) {
+        throw std::runtime_error("G-buffer is not lazily allocated!");
+    }
+    report.add("deferred.gbuffer_lazy_1080p", stats.lazyBytes / (1024.0 * 1024.0), "MiB");
+}
+
+void benchmarkClusteredShading(BenchmarkReport& report) {
+    // Clustered shading evaluates the lights of a fragment's cluster only,
+    // at most MAX_LIGHTS_PER_CLUSTER of them. Binned from the default 
+    // camera, like cluster_lights.comp does each frame.
+    Camera camera;
+    camera.setAspect(1920.0f / 1080.0f);
+    const glm::mat4& view = camera.getView();
+    const glm::mat4& proj = camera.getProj();
+    glm::mat4 viewProj = camera.getViewProj();
+    float zNear = camera.getNear();
+    float zFar = camera.getFar();
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (uint32_t count : { 1000u, 10000u, 100000u }) {
+        std::vector<Light> lights = generateLights(count, 1);
+        for (auto& light : lights) {
+            light = animateLight(light, 1.0f);
+        }
+        LightClusters clusters;
+        auto start = std::chrono::steady_clock::now();
+        binLights(lights, view, proj, zNear, zFar, clusters);
+        double binMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // Points inside a light's sphere must find the light in their 
+        // cluster, unless the cluster overflowed
+        for (uint32_t i = 0; i < count; i += 7) {
+            for (int j = 0; j < 8; j++) {
+                glm::vec3 offset(direction(random), direction(random), direction(random));
+                if (glm::length(offset) < 1e-3f) {
+                    continue;
+                }
+                glm::vec3 point = glm::vec3(lights[i].positionRadius) + glm::normalize(offset) * unit(random) * lights[i].positionRadius.w;
+                glm::vec4 clip = viewProj * glm::vec4(point, 1.0f);
+                float depth = -(view * glm::vec4(point, 1.0f)).z;
+                glm::vec2 ndc = glm::vec2(clip) / clip.w;
+                if (depth <= zNear || depth >= zFar || glm::abs(ndc.x) >= 1.0f || glm::abs(ndc.y) >= 1.0f) {
+                    continue;
+                }
+                glm::uvec2 tile = clusterScreenTile(ndc);
+                uint32_t cell = clusterIndex(glm::uvec3(tile, clusterDepthSlice(depth, zNear, zFar)));
+                if (clusters.counts[cell] > MAX_LIGHTS_PER_CLUSTER) {
+                    continue;
+                }
+                auto first = clusters.lights.begin() + static_cast<size_t>(cell) * MAX_LIGHTS_PER_CLUSTER;
+                if (std::find(first, first + clusters.counts[cell], i) == first + clusters.counts[cell]) {
+                    throw std::runtime_error("light is missing from a cluster it reaches!");
+                }
+            }
+        }
+
+        // Evaluated per fragment: the stored lights of its cluster. Binned 
+        // lights beyond the cap are dropped.
+        uint64_t entries = 0;
+        uint32_t occupied = 0;
+        uint32_t maxCount = 0;
+        uint32_t overflowed = 0;
+        for (uint32_t c : clusters.counts) {
+            entries += std::min(c, MAX_LIGHTS_PER_CLUSTER);
+            occupied += c > 0 ? 1 : 0;
+            maxCount = std::max(maxCount, c);
+            overflowed += c > MAX_LIGHTS_PER_CLUSTER ? 1 : 0;
+        }
+        std::string suffix = "_" + std::to_string(count);
+        report.add("clustered.bin" + suffix, binMs * 1e6 / count, "ns/light");
+        report.add("clustered.lights_per_cluster" + suffix, occupied > 0 ? static_cast<double>(entries) / occupied : 0.0, "lights");
+        report.add("clustered.max_binned_per_cluster" + suffix, maxCount, "lights");
+        report.add("clustered.overflowed_clusters" + suffix, overflowed, "clusters");
+    }
+}
+
+void benchmarkShadows(BenchmarkReport& report) {
+    // Skyline packing of shadow maps of mixed sizes into a 4096^2 atlas,
+    // until nothing more fits. Every size is a multiple of 128, so 
+    // overlaps are found on a grid of 128^2 cells.
+    const uint32_t atlasSize = 4096;
+    const uint32_t cell = 128;
+    std::mt19937 random(11);
+    std::uniform_int_distribution<uint32_t> sizeLog(0, 3);
+    SkylineAllocator allocator;
+    allocator.reset(atlasSize, atlasSize);
+    std::vector<bool> used((atlasSize / cell) * (atlasSize / cell), false);
+    uint32_t allocations = 0;
+    uint32_t failures = 0;
+    std::chrono::steady_clock::duration allocateTime{};
+    while (failures < 32) {
+        uint32_t width = cell << sizeLog(random);
+        uint32_t height = cell << sizeLog(random);
+        auto start = std::chrono::steady_clock::now();
+        auto rect = allocator.allocate(width, height);
+        allocateTime += std::chrono::steady_clock::now() - start;
+        if (!rect) {
+            failures++;
+            continue;
+        }
+        allocations++;
+        if (rect->x + rect->width > atlasSize || rect->y + rect->height > atlasSize) {
+            throw std::runtime_error("shadow map allocated outside the atlas!");
+        }
+        for (uint32_t y = rect->y / cell; y < (rect->y + rect->height) / cell; y++) {
+            for (uint32_t x = rect->x / cell; x < (rect->x + rect->width) / cell; x++) {
+                if (used[y * (atlasSize / cell) + x]) {
+                    throw std::runtime_error("shadow maps overlap in the atlas!");
+                }
+                used[y * (atlasSize / cell) + x] = true;
+            }
+        }
+    }
+    report.add("shadow.atlas_allocate", std::chrono::duration<double, std::nano>(allocateTime).count() / (allocations + failures), "ns");
+    report.add("shadow.atlas_fill", static_cast<double>(allocator.getUsedArea()) / (static_cast<double>(atlasSize) * atlasSize), "fraction");
+
+    // A camera slowly flying and turning for 10 seconds at 60 fps. The 
+    // static casters of a cascade are rendered again whenever its matrix 
+    // changes. Snapping by SHADOW_SNAP_TEXELS is compared to snapping by
+    // a single texel, the least that avoids shimmering edges.
+    Camera camera;
+    camera.setAspect(16.0f / 9.0f);
+    const uint32_t frames = 600;
+    for (uint32_t snapTexels : { 1u, SHADOW_SNAP_TEXELS }) {
+        std::array<glm::mat4, SHADOW_CASCADE_COUNT> previous{};
+        uint32_t renders = 0;
+        for (uint32_t frame = 0; frame < frames; frame++) {
+            camera.setPosition(glm::vec3(2.0f, 2.0f, 2.0f) + glm::vec3(-0.5f, 0.2f, 0.0f) * (frame / static_cast<float>(frames)));
+            camera.setRotation(glm::radians(-135.0f + 10.0f * frame / frames), -0.6154797f);
+            glm::mat4 view = camera.getView();
+            glm::mat4 invView = glm::inverse(view);
+            auto splits = shadowCascadeSplits(camera.getNear(), SHADOW_DISTANCE);
+            float nearDepth = camera.getNear();
+            for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; i++) {
+                glm::mat4 viewProj = fitShadowCascade(invView, camera.getFovy(), camera.getAspect(), nearDepth, splits[i], 
+                    SUN_DIRECTION, SHADOW_CASCADE_RESOLUTION, snapTexels);
+                if (frame == 0 || viewProj != previous[i]) {
+                    renders++;
+                }
+                previous[i] = viewProj;
+                // The cascade must contain its slice of the view frustum
+                float tanY = std::tan(camera.getFovy() * 0.5f);
+                float tanX = tanY * camera.getAspect();
+                for (float depth : { nearDepth, splits[i] }) {
+                    for (int corner = 0; corner < 4; corner++) {
+                        glm::vec4 point(tanX * depth * ((corner & 1) ? 1.0f : -1.0f), tanY * depth * ((corner & 2) ? 1.0f : -1.0f), -depth, 1.0f);
+                        glm::vec4 clip = viewProj * invView * point;
+                        const float epsilon = 1e-4f;
+                        if (std::abs(clip.x) > 1.0f + epsilon || std::abs(clip.y) > 1.0f + epsilon || clip.z < -epsilon || clip.z > 1.0f + epsilon) {
+                            throw std::runtime_error("shadow cascade does not cover its slice of the frustum!");
+                        }
+                    }
+                }
+                nearDepth = splits[i];
+            }
+        }
+        std::string suffix = snapTexels == 1 ? "_texel_snap" : "_coarse_snap";
+        report.add("shadow.static_renders" + suffix, renders / static_cast<double>(frames * SHADOW_CASCADE_COUNT), "fraction");
+    }
+}
+
+void benchmarkDepthPrepass(BenchmarkReport& report) {
+    // Overdraw of a LESS test depends on the order the draws arrive in, 
+    // which the render queue decides by state before depth. After a 
+    // pre-pass an EQUAL test shades exactly one fragment per covered 
+    // pixel in any order, at the cost of rasterizing every draw's depth
+    // twice. Counted on a depth buffer for screen rectangles at distinct
+    // depths.
+    const uint32_t width = 480;
+    const uint32_t height = 270;
+    const uint32_t drawCount = 200;
+    struct Rect {
+        uint32_t x0, y0, x1, y1;
+        float depth;
+    };
+    std::mt19937 random(9);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Rect> rects(drawCount);
+    for (uint32_t i = 0; i < drawCount; i++) {
+        uint32_t w = static_cast<uint32_t>(width * (0.05f + 0.35f * unit(random)));
+        uint32_t h = static_cast<uint32_t>(height * (0.05f + 0.35f * unit(random)));
+        rects[i].x0 = static_cast<uint32_t>((width - w) * unit(random));
+        rects[i].y0 = static_cast<uint32_t>((height - h) * unit(random));
+        rects[i].x1 = rects[i].x0 + w;
+        rects[i].y1 = rects[i].y0 + h;
+        rects[i].depth = (i + 0.5f) / drawCount;
+    }
+    std::shuffle(rects.begin(), rects.end(), random);
+
+    std::vector<float> depthBuffer(static_cast<size_t>(width) * height);
+    // Fragments passing the test, i.e. shaded, or written for the pre-pass
+    auto rasterize = [&](const std::vector<Rect>& draws, bool equal) {
+        uint64_t passed = 0;
+        for (const Rect& rect : draws) {
+            for (uint32_t y = rect.y0; y < rect.y1; y++) {
+                for (uint32_t x = rect.x0; x < rect.x1; x++) {
+                    float& stored = depthBuffer[static_cast<size_t>(y) * width + x];
+                    if (equal ? rect.depth == stored : rect.depth < stored) {
+                        passed++;
+                        if (!equal) {
+                            stored = rect.depth;
+                        }
+                    }
+                }
+            }
+        }
+        return passed;
+    };
+    uint64_t rasterized = 0;
+    for (const Rect& rect : rects) {
+        rasterized += static_cast<uint64_t>(rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+    }
+
+    std::vector<Rect> backToFront = rects;
+    std::sort(backToFront.begin(), backToFront.end(), [](const Rect& a, const Rect& b) { return a.depth > b.depth; });
+    std::vector<Rect> frontToBack(backToFront.rbegin(), backToFront.rend());
+    std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+    uint64_t frontToBackShaded = rasterize(frontToBack, false);
+    // Every pixel covered by any draw is shaded exactly once in this order
+    const double covered = static_cast<double>(frontToBackShaded);
+    report.add("depth_prepass.rasterized_per_covered_pixel", rasterized / covered, "fragments");
+    report.add("depth_prepass.shaded_per_covered_pixel_front_to_back", frontToBackShaded / covered, "fragments");
+    std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+    report.add("depth_prepass.shaded_per_covered_pixel_unsorted", rasterize(rects, false) / covered, "fragments");
+    std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+    report.add("depth_prepass.shaded_per_covered_pixel_back_to_front", rasterize(backToFront, false) / covered, "fragments");
+
+    std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+    rasterize(rects, false);
+    uint64_t prepassShaded = rasterize(rects, true);
+    if (prepassShaded != frontToBackShaded) {
+        throw std::runtime_error("depth pre-pass does not shade each covered pixel once!");
+    }
+    report.add("depth_prepass.shaded_per_covered_pixel_prepass", prepassShaded / covered, "fragments");
+}
+
+void benchmarkReverseZ(BenchmarkReport& report) {
+    Camera camera;
+    camera.setAspect(16.0f / 9.0f);
+    const float zNear = camera.getNear();
+    const glm::mat4& proj = camera.getProj();
+    // Depth must fall from 1 at the near plane towards 0, and stay above 0
+    // however far away
+    float previous = 2.0f;
+    for (float distance : { zNear, 1.0f, 10.0f, 1e3f, 1e5f, 1e7f }) {
+        glm::vec4 clip = proj * glm::vec4(0.0f, 0.0f, -distance, 1.0f);
+        float depth = clip.z / clip.w;
+        if (!(depth > 0.0f && depth <= 1.0f && depth < previous) || std::abs(depth - zNear / distance) > 1e-6f * depth) {
+            throw std::runtime_error("reverse-Z depth is not zNear / distance!");
+        }
+        previous = depth;
+    }
+    // The near plane comes from the projection, the far plane from zFar
+    const auto& planes = camera.getFrustumPlanes();
+    glm::vec3 forward = camera.getForward();
+    auto inside = [&](float distance, size_t plane) {
+        glm::vec3 point = camera.getPosition() + forward * distance;
+        return glm::dot(glm::vec3(planes[plane]), point) + planes[plane].w >= 0.0f;
+    };
+    if (inside(zNear * 0.5f, 4) || !inside(zNear * 2.0f, 4) || !inside(camera.getFar() * 0.99f, 5) || inside(camera.getFar() * 1.01f, 5)) {
+        throw std::runtime_error("frustum near or far plane is misplaced!");
+    }
+
+    // Smallest distance difference that still changes the stored depth, 
+    // relative to the distance. Standard Z needs a far plane, put beyond 
+    // the farthest distance here.
+    const double n = zNear;
+    const double f = 1e5;
+    auto floatStep = [](double depth) {
+        float value = static_cast<float>(depth);
+        return static_cast<double>(std::nextafter(value, 2.0f)) - value;
+    };
+    for (double distance : { 1.0, 100.0, 10000.0 }) {
+        double standard = f / (f - n) * (1.0 - n / distance);
+        double standardSlope = f * n / ((f - n) * distance * distance);
+        double reverse = n / distance;
+        double reverseSlope = n / (distance * distance);
+        std::string suffix = "_" + std::to_string(static_cast<int>(distance)) + "m";
+        report.add("reverse_z.relative_step_standard_d24" + suffix, 1.0 / 16777216.0 / standardSlope / distance, "fraction");
+        report.add("reverse_z.relative_step_standard_f32" + suffix, floatStep(standard) / standardSlope / distance, "fraction");
+        report.add("reverse_z.relative_step_reverse_f32" + suffix, floatStep(reverse) / reverseSlope / distance, "fraction");
+    }
+}
+
+void benchmarkProfiler(BenchmarkReport& report) {
+#if ENABLE_CPU_PROFILER
+    // Batches stay below the ring capacity and are flushed in between, so 
+    // that no zone is dropped and every one counts
+    const int batches = 200;
+    const int batchZones = 1024;
+    Profiler& profiler = Profiler::instance();
+    // A zone reads two of these. Virtual machines may trap rdtsc, which 
+    // makes it several times slower than on bare metal.
+    const int timestamps = 1000000;
+    uint64_t sum = 0;
+    auto timestampStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < timestamps; i++) {
+        sum += Profiler::now();
+    }
+    double timestampNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - timestampStart).count() / timestamps;
+    if (sum == 0) {
+        throw std::runtime_error("profiler timestamps are not running!");
+    }
+    report.add("profiler.timestamp_cost", timestampNs, "ns");
+
+    profiler.beginCapture();
+    double totalNs = 0.0;
+    for (int batch = 0; batch < batches; batch++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < batchZones; i++) {
+            PROFILE_ZONE("benchmark");
+        }
+        totalNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        profiler.flush();
+    }
+    size_t zones = profiler.endCapture("benchmark_trace.json");
+    if (zones != static_cast<size_t>(batches) * batchZones) {
+        throw std::runtime_error("profiler lost zones!");
+    }
+    // The budget is 20 ns per zone. Where reading the timestamp alone costs
+    // more than 10 ns, as under virtualization, it cannot be met; the 
+    // overhead shows what the ring push adds on top of the two reads.
+    double zoneNs = totalNs / (static_cast<double>(batches) * batchZones);
+    report.add("profiler.zone_cost", zoneNs, "ns");
+    report.add("profiler.zone_overhead", zoneNs - 2.0 * timestampNs, "ns");
+#else
+    (void)report;
+#endif
+}
+
+void benchmarkMemoryTracker(BenchmarkReport& report) {
+    // Random allocations and frees over all categories and two heaps, 
+    // checked against totals kept alongside
+    const uint64_t operations = 1000000;
+    const uint32_t heaps = 2;
+    std::mt19937 rng(7);
+    MemoryTracker tracker;
+    std::vector<std::pair<VkDeviceMemory, VkDeviceSize>> live;
+    std::array<std::array<VkDeviceSize, heaps>, MEMORY_CATEGORY_COUNT> expected{};
+    std::array<std::array<VkDeviceSize, heaps>, MEMORY_CATEGORY_COUNT> expectedPeak{};
+    std::vector<std::pair<MemoryCategory, uint32_t>> owners;
+    uint64_t nextHandle = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < operations; i++) {
+        if (live.empty() || rng() % 2 == 0) {
+            // Handles are opaque; any unique nonzero value will do
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+            std::memcpy(&memory, &nextHandle, sizeof(memory));
+            nextHandle++;
+            auto category = static_cast<MemoryCategory>(rng() % MEMORY_CATEGORY_COUNT);
+            uint32_t heap = rng() % heaps;
+            VkDeviceSize size = (rng() % 1024 + 1) * 256;
+            tracker.add(memory, category, heap, size);
+            live.emplace_back(memory, size);
+            owners.emplace_back(category, heap);
+            VkDeviceSize& bytes = expected[static_cast<size_t>(category)][heap];
+            bytes += size;
+            expectedPeak[static_cast<size_t>(category)][heap] = std::max(expectedPeak[static_cast<size_t>(category)][heap], bytes);
+        } else {
+            size_t index = rng() % live.size();
+            tracker.remove(live[index].first);
+            expected[static_cast<size_t>(owners[index].first)][owners[index].second] -= live[index].second;
+            live[index] = live.back();
+            live.pop_back();
+            owners[index] = owners.back();
+            owners.pop_back();
+        }
+    }
+    double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    for (uint32_t category = 0; category < MEMORY_CATEGORY_COUNT; category++) {
+        for (uint32_t heap = 0; heap < heaps; heap++) {
+            const MemoryTracker::Usage& usage = tracker.get(static_cast<MemoryCategory>(category), heap);
+            if (usage.bytes != expected[category][heap] || usage.peakBytes != expectedPeak[category][heap]) {
+                throw std::runtime_error("memory tracker totals are wrong!");
+            }
+        }
+    }
+    if (tracker.liveAllocations() != live.size()) {
+        throw std::runtime_error("memory tracker lost allocations!");
+    }
+    // What is not freed is what cleanup reports as leaked
+    for (size_t i = 1; i < live.size(); i++) {
+        tracker.remove(live[i].first);
+    }
+    if (tracker.liveAllocations() != (live.empty() ? 0 : 1) || tracker.liveBytes() != (live.empty() ? 0 : live[0].second)) {
+        throw std::runtime_error("memory tracker missed a leak!");
+    }
+    report.add("memory_tracker.operation", elapsedNs / operations, "ns");
+}
@@ -1,13 +1,150 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
 
+#include "lighting.glsl"
+#include "clusters.glsl"
+#include "shadows.glsl"
+
+// Set from enableVirtualTexturing at pipeline creation
+layout(constant_id = 0) const bool VIRTUAL_TEXTURING = false;
+// Deferred: write the G-buffer (albedo, normal) instead of lit colors
+layout(constant_id = 1) const bool DEFERRED = false;
+// Clustered: only the lights binned into the fragment's cluster are evaluated
+layout(constant_id = 2) const bool CLUSTERED = false;
+
+// Nothing here writes depth or discards, so hidden fragments are rejected
+// before shading even though the virtual texture feedback is a side effect
+layout(early_fragment_tests) in;
+
+// Must match VT_MAX_LEVELS and VT_NOT_RESIDENT in main.cpp
+const uint VT_MAX_LEVELS = 16;
+const uint VT_NOT_RESIDENT = 0xFFFFFFFFu;
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    mat4 viewProj;
+    mat4 invViewProj;
+    uint lightCount;
+    float lightIntensity;
+    float zNear;
+    float zFar;
+    mat4 shadowViewProj[SHADOW_CASCADE_COUNT];
+    vec4 shadowRects[SHADOW_CASCADE_COUNT];
+    vec4 cascadeSplits;
+    vec4 sun;
+} ubo;
 
 layout(binding = 1) uniform sampler2D texSampler;
 
+// Maps each page of the virtual texture to a slot of the page cache
+layout(std430, binding = 2) readonly buffer PageTable {
+    uvec4 info;                  // x: level count, y: width, z: height of level 0
+    uvec4 cache;                 // x: page size in texels, y: pages per side of the cache
+    uvec4 levels[VT_MAX_LEVELS]; // x: first page, y: pages wide, z: pages high
+    uint entries[];
+} pageTable;
+
+// Pages this frame wanted, read back by the CPU to decide what to load
+layout(std430, binding = 3) writeonly buffer Feedback {
+    uint requests[];
+} feedback;
+
+layout(binding = 4) uniform sampler2D pageCache;
+
+layout(std430, binding = 5) readonly buffer Lights {
+    Light lights[];
+};
+
+// Written by cluster_lights.comp earlier in the frame
+layout(std430, binding = 6) readonly buffer Clusters {
+    uint clusterCounts[CLUSTER_COUNT];
+    uint clusterLights[];
+};
+
+layout(binding = 7) uniform sampler2DShadow shadowAtlas;
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) in vec3 fragPosition;
 
 layout(location = 0) out vec4 outColor;
+layout(location = 1) out vec4 outNormal;
+
+// Index of the page covering uv at the given level, and the position of uv
+// inside that page in [0, 1)
+uint pageIndex(vec2 uv, uint level, out vec2 local) {
+    uvec4 l = pageTable.levels[level];
+    vec2 levelSize = vec2(max(pageTable.info.yz >> level, uvec2(1)));
+    vec2 pageCoord = uv * levelSize / float(pageTable.cache.x);
+    uvec2 page = min(uvec2(pageCoord), l.yz - 1);
+    local = pageCoord - vec2(page);
+    return l.x + page.y * l.y + page.x;
+}
+
+vec4 sampleVirtual(vec2 uv) {
+    // Mip selection has to happen here: derivatives of the page cache
+    // coordinates are meaningless across page borders. They are taken 
+    // before wrapping, which would make them jump at every repeat seam.
+    vec2 texelUv = uv * vec2(pageTable.info.yz);
+    vec2 dx = dFdx(texelUv);
+    vec2 dy = dFdy(texelUv);
+    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+    uv = fract(uv); // repeat addressing
+    uint levelCount = pageTable.info.x;
+    uint wanted = uint(clamp(floor(lod), 0.0, float(levelCount - 1)));
+
+    vec2 local;
+    feedback.requests[pageIndex(uv, wanted, local)] = 1u;
+
+    // Fall back to coarser levels until a resident page is found.
+    // The coarsest level is always resident.
+    uint side = pageTable.cache.y;
+    float halfTexel = 0.5 / float(pageTable.cache.x);
+    for (uint level = wanted; level < levelCount; level++) {
+        uint slot = pageTable.entries[pageIndex(uv, level, local)];
+        if (slot != VT_NOT_RESIDENT) {
+            vec2 origin = vec2(slot % side, slot / side);
+            vec2 coord = (origin + clamp(local, halfTexel, 1.0 - halfTexel)) / float(side);
+            return textureLod(pageCache, coord, 0.0);
+        }
+    }
+    return vec4(0.0);
+}
 
 void main() {
-    outColor = texture(texSampler, fragTexCoord);
-}
\ No newline at end of file
+    vec4 albedo;
+    if (VIRTUAL_TEXTURING) {
+        albedo = sampleVirtual(fragTexCoord);
+    } else {
+        albedo = texture(texSampler, fragTexCoord);
+    }
+    // The vertices have no normals. The face normal from the screen space
+    // derivatives always points to the viewer, so faces are lit two-sided.
+    vec3 normal = normalize(cross(dFdy(fragPosition), dFdx(fragPosition)));
+
+    if (DEFERRED) {
+        outColor = albedo;
+        outNormal = vec4(normal * 0.5 + 0.5, 0.0);
+        return;
+    }
+    float depth = -(ubo.view * vec4(fragPosition, 1.0)).z;
+    float shadow = sunShadow(shadowAtlas, ubo.shadowViewProj, ubo.shadowRects, ubo.cascadeSplits, fragPosition, depth);
+    vec3 light = vec3(AMBIENT + ubo.sun.w * max(dot(normal, -ubo.sun.xyz), 0.0) * shadow);
+    if (CLUSTERED) {
+        vec4 clip = ubo.viewProj * vec4(fragPosition, 1.0);
+        uvec3 cluster = uvec3(screenTile(clip.xy / clip.w), depthSlice(depth, ubo.zNear, ubo.zFar));
+        uint cell = clusterIndex(cluster);
+        uint count = min(clusterCounts[cell], MAX_LIGHTS_PER_CLUSTER);
+        for (uint i = 0; i < count; i++) {
+            uint index = clusterLights[cell * MAX_LIGHTS_PER_CLUSTER + i];
+            light += evaluateLight(lights[index], fragPosition, normal, ubo.lightIntensity);
+        }
+    } else {
+        // Forward: every light is evaluated for every fragment
+        for (uint i = 0; i < ubo.lightCount; i++) {
+            light += evaluateLight(lights[i], fragPosition, normal, ubo.lightIntensity);
+        }
+    }
+    outColor = vec4(albedo.rgb * light, albedo.a);
+}
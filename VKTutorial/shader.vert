@@ -1,20 +1,32 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 model;
     mat4 view;
     mat4 proj;
+    mat4 viewProj;
 } ubo;
 
+// Per-draw data, must match PushConstants in main.cpp
+layout(push_constant) uniform PushConstants {
+    mat4 model;
+    uint materialIndex;
+} pushConstants;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) out vec3 fragPosition;
+
+// Must be computed exactly like in depth_prepass.vert
+invariant gl_Position;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    vec4 position = pushConstants.model * vec4(inPosition, 1.0);
+    gl_Position = ubo.viewProj * position;
     fragColor = inColor;
     fragTexCoord = inTexCoord;
+    fragPosition = position.xyz;
 }
@@ -0,0 +1,14 @@
+#version 450
+
+// Must match ShadowPushConstants in main.cpp
+layout(push_constant) uniform ShadowPushConstants {
+    mat4 model;
+    mat4 viewProj;
+} shadow;
+
+layout(location = 0) in vec3 inPosition;
+
+// Depth only, there is no fragment shader
+void main() {
+    gl_Position = shadow.viewProj * shadow.model * vec4(inPosition, 1.0);
+}
@@ -0,0 +1,23 @@
+// Sun shadows from the cascades in the shadow atlas. Must match the 
+// SHADOW_ constants in main.cpp.
+
+const uint SHADOW_CASCADE_COUNT = 3;
+
+// 1 where the sun reaches position, 0 in shadow, filtered by the 
+// comparison sampler. depth is the view depth, which picks the cascade.
+float sunShadow(sampler2DShadow atlas, mat4 viewProj[SHADOW_CASCADE_COUNT], vec4 rects[SHADOW_CASCADE_COUNT], 
+    vec4 splits, vec3 position, float depth) {
+    uint cascade = 0;
+    while (cascade < SHADOW_CASCADE_COUNT && depth > splits[cascade]) {
+        cascade++;
+    }
+    if (cascade == SHADOW_CASCADE_COUNT) {
+        return 1.0; // beyond the shadow distance
+    }
+    vec4 clip = viewProj[cascade] * vec4(position, 1.0);
+    vec3 ndc = clip.xyz / clip.w;
+    // Keep the filter footprint inside the cascade's part of the atlas
+    vec2 halfTexel = 0.5 / (vec2(textureSize(atlas, 0)) * rects[cascade].zw);
+    vec2 uv = clamp(ndc.xy * 0.5 + 0.5, halfTexel, 1.0 - halfTexel);
+    return texture(atlas, vec3(rects[cascade].xy + uv * rects[cascade].zw, ndc.z));
+}
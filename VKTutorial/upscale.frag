@@ -0,0 +1,42 @@
+#version 450
+
+layout(binding = 0) uniform sampler2D sceneColor;
+
+// Must match UpscalePushConstants in main.cpp
+layout(push_constant) uniform UpscalePushConstants {
+    vec2 uvScale;   // rendered part of the scene color target
+    vec2 texelSize; // of the scene color target
+    float sharpness;
+} upscale;
+
+layout(location = 0) in vec2 uv;
+
+layout(location = 0) out vec4 outColor;
+
+// Half a texel inside the rendered part, so that filtering never blends in
+// texels of the target that were not rendered this frame
+vec3 fetch(vec2 coord) {
+    coord = clamp(coord, 0.5 * upscale.texelSize, upscale.uvScale - 0.5 * upscale.texelSize);
+    return texture(sceneColor, coord).rgb;
+}
+
+void main() {
+    vec2 coord = uv * upscale.uvScale;
+    vec3 color = fetch(coord);
+    if (upscale.sharpness > 0.0) {
+        // Contrast adaptive sharpening: subtract the cross neighbours, 
+        // weighted less where the neighbourhood already spans a wide range,
+        // so edges do not ring and flat areas are left alone
+        vec3 n = fetch(coord - vec2(0.0, upscale.texelSize.y));
+        vec3 s = fetch(coord + vec2(0.0, upscale.texelSize.y));
+        vec3 w = fetch(coord - vec2(upscale.texelSize.x, 0.0));
+        vec3 e = fetch(coord + vec2(upscale.texelSize.x, 0.0));
+        vec3 minColor = min(color, min(min(n, s), min(w, e)));
+        vec3 maxColor = max(color, max(max(n, s), max(w, e)));
+        vec3 amount = sqrt(clamp(min(minColor, 1.0 - maxColor) / max(maxColor, vec3(1e-4)), 0.0, 1.0));
+        // Fades out towards native resolution, where there is nothing to restore
+        vec3 weight = -amount * 0.2 * upscale.sharpness;
+        color = clamp((color + (n + s + w + e) * weight) / (1.0 + 4.0 * weight), 0.0, 1.0);
+    }
+    outColor = vec4(color, 1.0);
+}